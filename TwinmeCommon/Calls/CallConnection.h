@@ -12,6 +12,7 @@
 #import <Twinlife/TLConversationService.h>
 
 #import "CallStatus.h"
+#import "StreamingControlIQ.h"
 
 typedef NS_OPTIONS(NSInteger, CameraControlMode) {
     CameraControlModeCheck,
@@ -47,6 +48,7 @@ typedef NS_OPTIONS(NSInteger, CameraControlMode) {
 @class TLVersion;
 @class TLSerializerFactory;
 @class TLBinaryPacketIQSerializer;
+@class TLBinaryPacketIQ;
 @class WordCheckResult;
 
 /**
@@ -88,6 +90,8 @@ typedef NS_OPTIONS(NSInteger, CameraControlMode) {
 
 + (nonnull TLBinaryPacketIQSerializer *)STREAMING_DATA_SERIALIZER;
 
++ (nonnull TLBinaryPacketIQSerializer *)STREAMING_PARITY_SERIALIZER;
+
 /// Create the call connection at begining of an incoming or outgoing P2P setup.
 - (nonnull instancetype)initWithCallService:(nonnull CallService *)callService serializerFactory:(nonnull TLSerializerFactory *)serializerFactory call:(nonnull CallState *)call originator:(nonnull id<TLOriginator>)originator mode:(CallStatus)mode peerConnectionId:(nullable NSUUID *)peerConnectionId retryState:(int)retryState memberId:(nullable NSString *)memberId;
 
@@ -115,12 +119,37 @@ typedef NS_OPTIONS(NSInteger, CameraControlMode) {
 /// Get the audio streaming status.
 - (StreamingStatus)streamingStatus;
 
+/// Get the maximum size of a streaming data block that we can exchange with the peer.
+- (int32_t)streamingMaxDataSize;
+
+/// Check if the peer can rebuild a missing streaming data block from a StreamingParityIQ.
+- (BOOL)isStreamingParitySupported;
+
+/// Check if the peer knows the stream end from the StreamingDataIQ and not from the size of the blocks.
+- (BOOL)isStreamingEndSupported;
+
+/// Get the serializer to send the streaming data blocks to the peer.
+- (nonnull TLBinaryPacketIQSerializer *)streamingDataSerializer;
+
+/// Send a streaming IQ to the peer and record it when the call has a streaming recorder.
+- (void)sendStreamingIQ:(nonnull TLBinaryPacketIQ *)iq;
+
+/// Queue a streaming data IQ for the peer: the IQs of interactive streams are sent first but a background
+/// IQ is sent after STREAMING_INTERACTIVE_BURST interactive ones so that the background stream is not starved.
+- (void)sendStreamingIQ:(nonnull TLBinaryPacketIQ *)iq priority:(StreamingPriority)priority;
+
+/// Check if we are playing an interactive stream from this peer.
+- (BOOL)hasInteractiveStream;
+
 /// Check if this connection supports control camera by peer in P2P calls.
 - (TLVideoZoomable)isZoomable;
 
 /// Get the audio stream player
 - (nullable StreamPlayer *)streamPlayer;
 
+/// Get the stream players of this peer: the current stream, the prefetched next stream and the interactive streams.
+- (nonnull NSArray<StreamPlayer *> *)allStreamPlayers;
+
 /// Get the main participant.
 - (nullable CallParticipant *)mainParticipant;
 
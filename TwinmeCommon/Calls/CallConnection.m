@@ -27,14 +27,17 @@
 #import "CallConnection.h"
 #import "CallParticipant.h"
 #import "CallState.h"
+#import "CallSetupTracer.h"
 #import "ParticipantInfoIQ.h"
 #import "ParticipantTransferIQ.h"
 #import "StreamingControlIQ.h"
 #import "StreamingInfoIQ.h"
 #import "StreamingRequestIQ.h"
 #import "StreamingDataIQ.h"
+#import "StreamingParityIQ.h"
 #import "Streamer.h"
 #import "StreamPlayer.h"
+#import "StreamingRecorder.h"
 
 #import "KeyCheckInitiateIQ.h"
 #import "OnKeyCheckInitiateIQ.h"
@@ -51,13 +54,26 @@ static const int ddLogLevel = DDLogLevelInfo;
 static const int ddLogLevel = DDLogLevelWarning;
 #endif
 
+// The streaming parity only recovers blocks on an unreliable or partially reliable data channel: on the reliable
+// SCTP channel it costs a quarter of the bandwidth for nothing.  Define STREAMING_PARITY when the data channel
+// is opened with a retransmit or lifetime limit, the parity is used only when both peers have it.
+#if defined(STREAMING_PARITY)
+# define DATA_VERSION_STREAM              @"CallService:1.5.0:stream,stream-large,stream-ctl2,stream-fec,stream-eof"
+#else
+# define DATA_VERSION_STREAM              @"CallService:1.5.0:stream,stream-large,stream-ctl2,stream-eof"
+#endif
+
 #if defined(SKRED)
-# define DATA_VERSION                     @"CallService:1.5.0:stream,transfer,message,geoloc"
+# define DATA_VERSION                     DATA_VERSION_STREAM ",transfer,message,geoloc"
 #else
-# define DATA_VERSION                     @"CallService:1.5.0:stream,transfer,message"
+# define DATA_VERSION                     DATA_VERSION_STREAM ",transfer,message"
 #endif
 
 #define CAP_STREAM                       @"stream"
+#define CAP_STREAM_LARGE                 @"stream-large"
+#define CAP_STREAM_CONTROL_DELTA         @"stream-ctl2"
+#define CAP_STREAM_PARITY                @"stream-fec"
+#define CAP_STREAM_END                   @"stream-eof"
 #define CAP_TRANSFER                     @"transfer"
 #define CAP_MESSAGE                      @"message"
 #define CAP_GEOLOCATION                  @"geoloc"
@@ -73,6 +89,7 @@ static const int ddLogLevel = DDLogLevelWarning;
 #define STREAMING_INFO_SCHEMA_ID         @"30991309-e91f-4295-8a9c-995fcfaf042e"
 #define STREAMING_REQUEST_SCHEMA_ID      @"4fab57a3-6c24-4318-b71d-22b60807cbc5"
 #define STREAMING_DATA_SCHEMA_ID         @"5a5d0994-2ca3-4a62-9da3-9b7d5c4abdd4"
+#define STREAMING_PARITY_SCHEMA_ID       @"d3b6b4c1-5e8f-4c2a-9f0e-7a41c2e5b813"
 #define HOLD_CALL_SCHEMA_ID              @"f373eaf0-79ef-4091-8179-de622afce358"
 #define RESUME_CALL_SCHEMA_ID            @"70ea071a-48f7-41e9-ace5-2c3616f8abf5"
 
@@ -90,6 +107,15 @@ static const int ddLogLevel = DDLogLevelWarning;
 
 #define IMAGE_JPEG_QUALITY               0.8
 
+// Number of interactive streaming IQs sent in a row before a pending background one.
+#define STREAMING_INTERACTIVE_BURST      4
+
+// The streaming IQs are given to the data channel by windows of STREAMING_SEND_WINDOW bytes every
+// STREAMING_SEND_INTERVAL ms: the others wait in our queues where an interactive IQ can overtake them
+// (the data channel send does not block and its buffer is a FIFO).
+#define STREAMING_SEND_WINDOW            STREAMING_DATA_MAX_SIZE
+#define STREAMING_SEND_INTERVAL          10
+
 static TLBinaryPacketIQSerializer *IQ_PARTICIPANT_INFO_SERIALIZER = nil;
 static TLBinaryPacketIQSerializer *IQ_PREPARE_TRANSFER_SERIALIZER = nil;
 static TLBinaryPacketIQSerializer *IQ_ON_PREPARE_TRANSFER_SERIALIZER = nil;
@@ -99,6 +125,8 @@ static TLBinaryPacketIQSerializer *IQ_STREAMING_CONTROL_SERIALIZER = nil;
 static TLBinaryPacketIQSerializer *IQ_STREAMING_INFO_SERIALIZER = nil;
 static TLBinaryPacketIQSerializer *IQ_STREAMING_REQUEST_SERIALIZER = nil;
 static TLBinaryPacketIQSerializer *IQ_STREAMING_DATA_SERIALIZER = nil;
+static TLBinaryPacketIQSerializer *IQ_STREAMING_DATA_SERIALIZER_2 = nil;
+static TLBinaryPacketIQSerializer *IQ_STREAMING_PARITY_SERIALIZER = nil;
 static TLBinaryPacketIQSerializer *IQ_HOLD_CALL_SERIALIZER = nil;
 static TLBinaryPacketIQSerializer *IQ_RESUME_CALL_SERIALIZER = nil;
 
@@ -130,7 +158,21 @@ static TLBinaryPacketIQSerializer *IQ_CAMERA_RESPONSE_SERIALIZER = nil;
 @property (nonatomic, nullable) TLJobId *timerJobId;
 @property (nonatomic, nullable) TLVersion *peerVersion;
 @property (nonatomic, nullable) StreamPlayer *mediaStream;
+/// The next stream announced by the streamer and prefetched while the current one plays.
+@property (nonatomic, nullable) StreamPlayer *nextMediaStream;
+/// The interactive streams played along with the current one.
+@property (nonatomic, readonly, nonnull) NSMutableDictionary<NSNumber *, StreamPlayer *> *interactiveStreams;
+@property (nonatomic, readonly, nonnull) dispatch_queue_t streamingSendQueue;
+@property (nonatomic, readonly, nonnull) NSMutableArray<TLBinaryPacketIQ *> *streamingInteractiveIQs;
+@property (nonatomic, readonly, nonnull) NSMutableArray<TLBinaryPacketIQ *> *streamingBackgroundIQs;
+@property (nonatomic) int streamingInteractiveBurst;
+@property (nonatomic) BOOL streamingSendScheduled;
 @property (nonatomic) StreamingStatus peerStreamingStatus;
+@property (nonatomic) int32_t peerStreamingMaxDataSize;
+@property (nonatomic) BOOL peerStreamingControlDelta;
+@property (nonatomic) BOOL peerStreamingParity;
+@property (nonatomic) BOOL peerStreamingEnd;
+@property (nonatomic, readonly, nonnull) StreamingControlIQDeltaSerializer *streamingControlDeltaSerializer;
 @property (nonatomic) CallMessageSupport peerMessageStatus;
 @property (nonatomic) CallGeolocationSupport peerGeolocationStatus;
 @property (nonatomic) TLVideoZoomable zoomable;
@@ -159,6 +201,15 @@ static TLBinaryPacketIQSerializer *IQ_CAMERA_RESPONSE_SERIALIZER = nil;
 
 - (void)onStreamingDataIQWithIQ:(nonnull TLBinaryPacketIQ *)iq;
 
+/// Get the player of the stream: the current one, the next one of the queue or an interactive one.
+- (nullable StreamPlayer *)streamPlayerWithIdent:(int64_t)ident;
+
+/// Send the next window of queued streaming IQs by order of priority and schedule the next window
+/// if some IQs are still queued (called from the streamingSendQueue).
+- (void)sendPendingStreamingIQs;
+
+- (void)onStreamingParityIQWithIQ:(nonnull TLBinaryPacketIQ *)iq;
+
 - (void)onStreamingControlIQWithIQ:(nonnull TLBinaryPacketIQ *)iq;
 
 - (void)onStreamingInfoIQWithIQ:(nonnull TLBinaryPacketIQ *)iq;
@@ -195,6 +246,8 @@ static TLBinaryPacketIQSerializer *IQ_CAMERA_RESPONSE_SERIALIZER = nil;
     IQ_STREAMING_CONTROL_SERIALIZER = [[StreamingControlIQSerializer alloc] initWithSchema:STREAMING_CONTROL_SCHEMA_ID schemaVersion:1];
     IQ_STREAMING_REQUEST_SERIALIZER = [[StreamingRequestIQSerializer alloc] initWithSchema:STREAMING_REQUEST_SCHEMA_ID schemaVersion:1];
     IQ_STREAMING_DATA_SERIALIZER = [[StreamingDataIQSerializer alloc] initWithSchema:STREAMING_DATA_SCHEMA_ID schemaVersion:1];
+    IQ_STREAMING_DATA_SERIALIZER_2 = [[StreamingDataIQSerializer alloc] initWithSchema:STREAMING_DATA_SCHEMA_ID schemaVersion:2];
+    IQ_STREAMING_PARITY_SERIALIZER = [[StreamingParityIQSerializer alloc] initWithSchema:STREAMING_PARITY_SCHEMA_ID schemaVersion:1];
     IQ_HOLD_CALL_SERIALIZER = [[TLBinaryPacketIQSerializer alloc] initWithSchema:HOLD_CALL_SCHEMA_ID schemaVersion:1];
     IQ_RESUME_CALL_SERIALIZER = [[TLBinaryPacketIQSerializer alloc] initWithSchema:RESUME_CALL_SCHEMA_ID schemaVersion:1];
     
@@ -231,6 +284,11 @@ static TLBinaryPacketIQSerializer *IQ_CAMERA_RESPONSE_SERIALIZER = nil;
     return IQ_STREAMING_DATA_SERIALIZER;
 }
 
++ (nonnull TLBinaryPacketIQSerializer *)STREAMING_PARITY_SERIALIZER {
+    
+    return IQ_STREAMING_PARITY_SERIALIZER;
+}
+
 - (nonnull instancetype)initWithCallService:(nonnull CallService *)callService serializerFactory:(nonnull TLSerializerFactory *)serializerFactory call:(nonnull CallState *)call originator:(nonnull id<TLOriginator>)originator mode:(CallStatus)mode peerConnectionId:(nullable NSUUID *)peerConnectionId retryState:(int)retryState memberId:(nullable NSString *)memberId {
     DDLogVerbose(@"%@ initWithCallService: %@ callService: %@ originator:%@ mode: %ld peerConnectionId: %@ retryState: %d memberId: %@", LOG_TAG, callService, call, originator, (long)mode, peerConnectionId, retryState, memberId);
     DDLogInfo(@"%@ call %@ new connection %@ from %@ mode: %ld retryState: %d memberId: %@", LOG_TAG, call, peerConnectionId, originator.name, (long)mode, retryState, memberId);
@@ -258,6 +316,13 @@ static TLBinaryPacketIQSerializer *IQ_CAMERA_RESPONSE_SERIALIZER = nil;
         _callRoomMemberId = memberId;
         _transferToMemberId = nil;
         _peerStreamingStatus = StreamingStatusUnknown;
+        _peerStreamingMaxDataSize = STREAMING_DATA_DEFAULT_SIZE;
+        _streamingControlDeltaSerializer = [[StreamingControlIQDeltaSerializer alloc] initWithSchema:STREAMING_CONTROL_SCHEMA_ID];
+        _interactiveStreams = [[NSMutableDictionary alloc] init];
+        _streamingSendQueue = dispatch_queue_create("streamingSendQueue", DISPATCH_QUEUE_SERIAL);
+        _streamingInteractiveIQs = [[NSMutableArray alloc] init];
+        _streamingBackgroundIQs = [[NSMutableArray alloc] init];
+        _streamingInteractiveBurst = 0;
         _peerMessageStatus = CallMessageSupportUnknown;
         _peerGeolocationStatus = CallGeolocationSupportUnknown;
         _peerTwincodeOutboundId = originator.peerTwincodeOutboundId;
@@ -296,9 +361,18 @@ static TLBinaryPacketIQSerializer *IQ_CAMERA_RESPONSE_SERIALIZER = nil;
         [self addPacketListener:IQ_STREAMING_DATA_SERIALIZER listener:^(TLBinaryPacketIQ * iq) {
             [handler onStreamingDataIQWithIQ:iq];
         }];
+        [self addPacketListener:IQ_STREAMING_DATA_SERIALIZER_2 listener:^(TLBinaryPacketIQ * iq) {
+            [handler onStreamingDataIQWithIQ:iq];
+        }];
+        [self addPacketListener:IQ_STREAMING_PARITY_SERIALIZER listener:^(TLBinaryPacketIQ * iq) {
+            [handler onStreamingParityIQWithIQ:iq];
+        }];
         [self addPacketListener:IQ_STREAMING_CONTROL_SERIALIZER listener:^(TLBinaryPacketIQ * iq) {
             [handler onStreamingControlIQWithIQ:iq];
         }];
+        [self addPacketListener:_streamingControlDeltaSerializer listener:^(TLBinaryPacketIQ * iq) {
+            [handler onStreamingControlIQWithIQ:iq];
+        }];
         [self addPacketListener:IQ_STREAMING_INFO_SERIALIZER listener:^(TLBinaryPacketIQ * iq) {
             [handler onStreamingInfoIQWithIQ:iq];
         }];
@@ -430,12 +504,150 @@ static TLBinaryPacketIQSerializer *IQ_CAMERA_RESPONSE_SERIALIZER = nil;
     return _peerStreamingStatus;
 }
 
+- (int32_t)streamingMaxDataSize {
+    DDLogVerbose(@"%@ streamingMaxDataSize", LOG_TAG);
+
+    return _peerStreamingMaxDataSize;
+}
+
+- (BOOL)isStreamingParitySupported {
+    DDLogVerbose(@"%@ isStreamingParitySupported", LOG_TAG);
+
+    return _peerStreamingParity;
+}
+
+- (BOOL)isStreamingEndSupported {
+    DDLogVerbose(@"%@ isStreamingEndSupported", LOG_TAG);
+
+    return _peerStreamingEnd;
+}
+
+- (nonnull TLBinaryPacketIQSerializer *)streamingDataSerializer {
+    DDLogVerbose(@"%@ streamingDataSerializer", LOG_TAG);
+
+    return _peerStreamingEnd ? IQ_STREAMING_DATA_SERIALIZER_2 : IQ_STREAMING_DATA_SERIALIZER;
+}
+
+- (void)sendStreamingIQ:(nonnull TLBinaryPacketIQ *)iq {
+    DDLogVerbose(@"%@ sendStreamingIQ: %@", LOG_TAG, iq);
+
+    [self.call.streamingRecorder recordWithIQ:iq peerConnectionId:self.peerConnectionId received:NO];
+
+    // The same control IQ is sent to every peer, use the compact encoding for those that support it.
+    // The start of a stream defines the base of its next controls: serialize and send them one at a time.
+    if (self.peerStreamingControlDelta && [iq isKindOfClass:[StreamingControlIQ class]]) {
+        StreamingControlIQ *controlIQ = (StreamingControlIQ *)iq;
+        StreamingControlIQ *deltaIQ = [[StreamingControlIQ alloc] initWithSerializer:self.streamingControlDeltaSerializer requestId:controlIQ.requestId ident:controlIQ.ident mode:controlIQ.mode length:controlIQ.length timestamp:controlIQ.timestamp position:controlIQ.position latency:controlIQ.latency packetCount:controlIQ.packetCount];
+        @synchronized (self.streamingControlDeltaSerializer) {
+            [self sendMessageWithIQ:deltaIQ statType:TLPeerConnectionServiceStatTypeIqSetPushObject];
+        }
+        return;
+    }
+    [self sendMessageWithIQ:iq statType:TLPeerConnectionServiceStatTypeIqSetPushObject];
+}
+
+- (void)sendStreamingIQ:(nonnull TLBinaryPacketIQ *)iq priority:(StreamingPriority)priority {
+    DDLogVerbose(@"%@ sendStreamingIQ: %@ priority: %d", LOG_TAG, iq, priority);
+
+    BOOL schedule;
+    @synchronized (self.streamingBackgroundIQs) {
+        if (priority == StreamingPriorityInteractive) {
+            [self.streamingInteractiveIQs addObject:iq];
+        } else {
+            [self.streamingBackgroundIQs addObject:iq];
+        }
+        schedule = !self.streamingSendScheduled;
+        self.streamingSendScheduled = YES;
+    }
+
+    // When a window is already scheduled, the IQ waits for it.
+    if (schedule) {
+        dispatch_async(self.streamingSendQueue, ^{
+            [self sendPendingStreamingIQs];
+        });
+    }
+}
+
+- (void)sendPendingStreamingIQs {
+    DDLogVerbose(@"%@ sendPendingStreamingIQs", LOG_TAG);
+
+    int64_t sent = 0;
+    while (sent < STREAMING_SEND_WINDOW) {
+        TLBinaryPacketIQ *iq;
+        @synchronized (self.streamingBackgroundIQs) {
+            BOOL background = self.streamingBackgroundIQs.count > 0;
+            if (self.streamingInteractiveIQs.count > 0 && (!background || self.streamingInteractiveBurst < STREAMING_INTERACTIVE_BURST)) {
+                iq = self.streamingInteractiveIQs[0];
+                [self.streamingInteractiveIQs removeObjectAtIndex:0];
+                self.streamingInteractiveBurst++;
+            } else if (background) {
+                iq = self.streamingBackgroundIQs[0];
+                [self.streamingBackgroundIQs removeObjectAtIndex:0];
+                self.streamingInteractiveBurst = 0;
+            } else {
+                self.streamingSendScheduled = NO;
+                return;
+            }
+        }
+        [self sendStreamingIQ:iq];
+
+        // The controls and requests are small, only the data and parity blocks fill the window.
+        if ([iq isKindOfClass:[StreamingDataIQ class]]) {
+            sent += ((StreamingDataIQ *)iq).length;
+        } else if ([iq isKindOfClass:[StreamingParityIQ class]]) {
+            sent += ((StreamingParityIQ *)iq).data.length;
+        }
+    }
+
+    dispatch_after(dispatch_time(DISPATCH_TIME_NOW, STREAMING_SEND_INTERVAL * NSEC_PER_MSEC), self.streamingSendQueue, ^{
+        [self sendPendingStreamingIQs];
+    });
+}
+
+- (BOOL)hasInteractiveStream {
+    DDLogVerbose(@"%@ hasInteractiveStream", LOG_TAG);
+
+    @synchronized (self) {
+        return self.interactiveStreams.count > 0;
+    }
+}
+
+- (nullable StreamPlayer *)streamPlayerWithIdent:(int64_t)ident {
+    DDLogVerbose(@"%@ streamPlayerWithIdent: %lld", LOG_TAG, ident);
+
+    @synchronized (self) {
+        if (self.mediaStream && self.mediaStream.ident == ident) {
+            return self.mediaStream;
+        }
+        if (self.nextMediaStream && self.nextMediaStream.ident == ident) {
+            return self.nextMediaStream;
+        }
+        return self.interactiveStreams[[NSNumber numberWithLongLong:ident]];
+    }
+}
+
 - (nullable StreamPlayer *)streamPlayer {
     DDLogVerbose(@"%@ streamPlayer", LOG_TAG);
     
     return _mediaStream;
 }
 
+- (nonnull NSArray<StreamPlayer *> *)allStreamPlayers {
+    DDLogVerbose(@"%@ allStreamPlayers", LOG_TAG);
+
+    NSMutableArray<StreamPlayer *> *result = [[NSMutableArray alloc] init];
+    @synchronized (self) {
+        if (self.mediaStream) {
+            [result addObject:self.mediaStream];
+        }
+        if (self.nextMediaStream) {
+            [result addObject:self.nextMediaStream];
+        }
+        [result addObjectsFromArray:[self.interactiveStreams allValues]];
+    }
+    return result;
+}
+
 - (nullable CallParticipant *)mainParticipant {
     DDLogVerbose(@"%@ mainParticipant", LOG_TAG);
 
@@ -616,6 +828,7 @@ static TLBinaryPacketIQSerializer *IQ_CAMERA_RESPONSE_SERIALIZER = nil;
         self.peerConnectionId = peerConnectionId;
         self.participants[peerConnectionId] = participant;
     }
+    [self.call updatePeerWithConnection:self];
 
     id<CallParticipantDelegate> observer = [self.callService callParticipantDelegate];
     if (observer) {
@@ -798,11 +1011,16 @@ static TLBinaryPacketIQSerializer *IQ_CAMERA_RESPONSE_SERIALIZER = nil;
     DDLogVerbose(@"%@ onDataChannelOpenWithPeerConnectionId: %@ peerVersion: %@", LOG_TAG, peerConnectionId, peerVersion);
 
     self.peerDataVersion = peerVersion;
+    [self.call.setupTracer markWithPhase:CallSetupPhaseDataChannelOpen];
 
     // CallService:<version>:<capability>,...,<capability>.
     NSArray<NSString *> *list = [peerVersion componentsSeparatedByCharactersInSet:[NSCharacterSet characterSetWithCharactersInString:@":,"]];
     if (list.count >= 3) {
         StreamingStatus status = StreamingStatusNotAvailable;
+        int32_t streamingMaxDataSize = STREAMING_DATA_DEFAULT_SIZE;
+        BOOL streamingControlDelta = NO;
+        BOOL streamingParity = NO;
+        BOOL streamingEnd = NO;
         CallMessageSupport messageStatus = CallMessageSupportNo;
         CallGeolocationSupport geolocationStatus = CallGeolocationSupportNo;
         TLVideoZoomable zoomable = TLVideoZoomableNever;
@@ -810,6 +1028,16 @@ static TLBinaryPacketIQSerializer *IQ_CAMERA_RESPONSE_SERIALIZER = nil;
         for (NSUInteger i = list.count; --i >= 1; ) {
             if ([list[i] isEqualToString:CAP_STREAM]) {
                 status = StreamingStatusReady;
+            } else if ([list[i] isEqualToString:CAP_STREAM_LARGE]) {
+                streamingMaxDataSize = STREAMING_DATA_MAX_SIZE;
+            } else if ([list[i] isEqualToString:CAP_STREAM_CONTROL_DELTA]) {
+                streamingControlDelta = YES;
+            } else if ([list[i] isEqualToString:CAP_STREAM_PARITY]) {
+#if defined(STREAMING_PARITY)
+                streamingParity = YES;
+#endif
+            } else if ([list[i] isEqualToString:CAP_STREAM_END]) {
+                streamingEnd = YES;
             } else if ([list[i] isEqualToString:CAP_MESSAGE]) {
                 messageStatus = CallMessageSupportYes;
             } else if ([list[i] isEqualToString:CAP_GEOLOCATION]) {
@@ -821,6 +1049,10 @@ static TLBinaryPacketIQSerializer *IQ_CAMERA_RESPONSE_SERIALIZER = nil;
             }
         }
         self.peerStreamingStatus = status;
+        self.peerStreamingMaxDataSize = streamingMaxDataSize;
+        self.peerStreamingControlDelta = streamingControlDelta;
+        self.peerStreamingParity = streamingParity;
+        self.peerStreamingEnd = streamingEnd;
         self.peerMessageStatus = messageStatus;
         self.peerGeolocationStatus = geolocationStatus;
         self.zoomable = zoomable;
@@ -876,13 +1108,19 @@ static TLBinaryPacketIQSerializer *IQ_CAMERA_RESPONSE_SERIALIZER = nil;
 
     NSMutableArray<CallParticipant *> *participants = nil;
     StreamPlayer *mediaStream;
+    StreamPlayer *nextMediaStream;
+    NSArray<StreamPlayer *> *interactiveStreams;
     @synchronized (self) {
         if (self.timerJobId) {
             [self.timerJobId cancel];
             self.timerJobId = nil;
         }
         mediaStream = self.mediaStream;
+        nextMediaStream = self.nextMediaStream;
+        interactiveStreams = [self.interactiveStreams allValues];
         self.mediaStream = nil;
+        self.nextMediaStream = nil;
+        [self.interactiveStreams removeAllObjects];
 
         for (NSUUID *uuid in self.participants) {
             CallParticipant *participant = self.participants[uuid];
@@ -899,6 +1137,12 @@ static TLBinaryPacketIQSerializer *IQ_CAMERA_RESPONSE_SERIALIZER = nil;
     if (mediaStream) {
         [mediaStream stopWithNotify:NO];
     }
+    if (nextMediaStream) {
+        [nextMediaStream stopWithNotify:NO];
+    }
+    for (StreamPlayer *interactiveStream in interactiveStreams) {
+        [interactiveStream stopWithNotify:NO];
+    }
 
     id<CallParticipantDelegate> delegate = self.callService.callParticipantDelegate;
     if (delegate && participants) {
@@ -973,8 +1217,9 @@ static TLBinaryPacketIQSerializer *IQ_CAMERA_RESPONSE_SERIALIZER = nil;
     }
 
     StreamingRequestIQ *streamingRequestIQ = (StreamingRequestIQ *)iq;
-    Streamer *streamer = [self.call currentStreamer];
-    if (streamer && streamingRequestIQ.ident == streamer.ident) {
+    [self.call.streamingRecorder recordWithIQ:iq peerConnectionId:self.peerConnectionId received:YES];
+    Streamer *streamer = [self.call streamerWithIdent:streamingRequestIQ.ident];
+    if (streamer) {
         [streamer onStreamingRequestWithConnection:self iq:streamingRequestIQ];
     }
 }
@@ -987,15 +1232,27 @@ static TLBinaryPacketIQSerializer *IQ_CAMERA_RESPONSE_SERIALIZER = nil;
     }
 
     StreamingDataIQ *streamingDataIQ = (StreamingDataIQ *)iq;
-    StreamPlayer *streamPlayer;
-    @synchronized (self) {
-        streamPlayer = self.mediaStream;
-    }
-    if (streamPlayer && streamingDataIQ.ident == streamPlayer.ident) {
+    [self.call.streamingRecorder recordWithIQ:iq peerConnectionId:self.peerConnectionId received:YES];
+    StreamPlayer *streamPlayer = [self streamPlayerWithIdent:streamingDataIQ.ident];
+    if (streamPlayer) {
         [streamPlayer onStreamingDataWithIQ:streamingDataIQ];
     }
 }
 
+- (void)onStreamingParityIQWithIQ:(nonnull TLBinaryPacketIQ *)iq {
+    DDLogVerbose(@"%@ onStreamingParityIQWithIQ: %@", LOG_TAG, iq);
+
+    if (![iq isKindOfClass:[StreamingParityIQ class]]) {
+        return;
+    }
+
+    StreamingParityIQ *streamingParityIQ = (StreamingParityIQ *)iq;
+    StreamPlayer *streamPlayer = [self streamPlayerWithIdent:streamingParityIQ.ident];
+    if (streamPlayer) {
+        [streamPlayer onStreamingParityWithIQ:streamingParityIQ];
+    }
+}
+
 - (void)onStreamingControlIQWithIQ:(nonnull TLBinaryPacketIQ *)iq {
     DDLogVerbose(@"%@ onStreamingControlIQWithIQ: %@", LOG_TAG, iq);
 
@@ -1004,21 +1261,63 @@ static TLBinaryPacketIQSerializer *IQ_CAMERA_RESPONSE_SERIALIZER = nil;
     }
 
     StreamingControlIQ *streamingControlIQ = (StreamingControlIQ *)iq;
+    [self.call.streamingRecorder recordWithIQ:iq peerConnectionId:self.peerConnectionId received:YES];
     StreamPlayer *stopMediaStream = nil;
     StreamPlayer *mediaStream;
+    StreamPlayer *interactiveStream;
     switch (streamingControlIQ.mode) {
-        case StreamingControlModeStartAudio:
-            mediaStream = [[StreamPlayer alloc] initWithIdent:streamingControlIQ.ident size:streamingControlIQ.length video:NO call:self.call connection:self streamer:nil];
+        case StreamingControlModeStartAudio: {
+            StreamPlayer *stopNextMediaStream = nil;
+            BOOL prefetched;
             @synchronized (self) {
                 stopMediaStream = self.mediaStream;
+                mediaStream = self.nextMediaStream;
+                if (mediaStream && mediaStream.ident != streamingControlIQ.ident) {
+                    stopNextMediaStream = mediaStream;
+                    mediaStream = nil;
+                }
+                self.nextMediaStream = nil;
+                prefetched = mediaStream != nil;
+                if (!mediaStream) {
+                    mediaStream = [[StreamPlayer alloc] initWithIdent:streamingControlIQ.ident size:streamingControlIQ.length packetCount:streamingControlIQ.packetCount video:NO call:self.call connection:self streamer:nil];
+                }
                 self.mediaStream = mediaStream;
             }
-            [mediaStream start];
+            if (stopNextMediaStream) {
+                [stopNextMediaStream stopWithNotify:NO];
+            }
+            if (prefetched) {
+                [mediaStream startPlayback];
+            } else {
+                [mediaStream start];
+            }
             [self postWithEvent:CallParticipantEventStreamStart];
             break;
+        }
+
+        case StreamingControlModePrepareAudio:
+            mediaStream = [[StreamPlayer alloc] initWithIdent:streamingControlIQ.ident size:streamingControlIQ.length packetCount:streamingControlIQ.packetCount video:NO call:self.call connection:self streamer:nil];
+            @synchronized (self) {
+                stopMediaStream = self.nextMediaStream;
+                self.nextMediaStream = mediaStream;
+            }
+            [mediaStream prefetch];
+            break;
+
+        case StreamingControlModeStartInteractiveAudio:
+            // The interactive stream plays with the current stream which is not replaced.
+            mediaStream = [[StreamPlayer alloc] initWithIdent:streamingControlIQ.ident size:streamingControlIQ.length packetCount:streamingControlIQ.packetCount video:NO call:self.call connection:self streamer:nil];
+            mediaStream.priority = StreamingPriorityInteractive;
+            @synchronized (self) {
+                NSNumber *key = [NSNumber numberWithLongLong:streamingControlIQ.ident];
+                stopMediaStream = self.interactiveStreams[key];
+                self.interactiveStreams[key] = mediaStream;
+            }
+            [mediaStream start];
+            break;
 
         case StreamingControlModeStartVideo:
-            mediaStream = [[StreamPlayer alloc] initWithIdent:streamingControlIQ.ident size:streamingControlIQ.length video:YES call:self.call connection:self streamer:nil];
+            mediaStream = [[StreamPlayer alloc] initWithIdent:streamingControlIQ.ident size:streamingControlIQ.length packetCount:streamingControlIQ.packetCount video:YES call:self.call connection:self streamer:nil];
             @synchronized (self) {
                 stopMediaStream = self.mediaStream;
                 self.mediaStream = mediaStream;
@@ -1029,9 +1328,12 @@ static TLBinaryPacketIQSerializer *IQ_CAMERA_RESPONSE_SERIALIZER = nil;
 
         case StreamingControlModePause:
             @synchronized (self) {
+                interactiveStream = self.interactiveStreams[[NSNumber numberWithLongLong:streamingControlIQ.ident]];
                 mediaStream = self.mediaStream;
             }
-            if (mediaStream) {
+            if (interactiveStream) {
+                [interactiveStream onStreamingControlWithIQ:streamingControlIQ];
+            } else if (mediaStream) {
                 [mediaStream onStreamingControlWithIQ:streamingControlIQ];
                 [self postWithEvent:CallParticipantEventStreamPause];
             }
@@ -1039,29 +1341,44 @@ static TLBinaryPacketIQSerializer *IQ_CAMERA_RESPONSE_SERIALIZER = nil;
 
         case StreamingControlModeResume:
             @synchronized (self) {
+                interactiveStream = self.interactiveStreams[[NSNumber numberWithLongLong:streamingControlIQ.ident]];
                 mediaStream = self.mediaStream;
             }
-            if (mediaStream) {
+            if (interactiveStream) {
+                [interactiveStream onStreamingControlWithIQ:streamingControlIQ];
+            } else if (mediaStream) {
                 [mediaStream onStreamingControlWithIQ:streamingControlIQ];
                 [self postWithEvent:CallParticipantEventStreamResume];
             }
             break;
 
         case StreamingControlModeSeek:
-            @synchronized (self) {
-                mediaStream = self.mediaStream;
-            }
-            if (mediaStream && streamingControlIQ.length >= 0 && mediaStream.ident == streamingControlIQ.ident) {
+            mediaStream = [self streamPlayerWithIdent:streamingControlIQ.ident];
+            if (mediaStream && streamingControlIQ.length >= 0) {
                 [mediaStream seekWithPosition:streamingControlIQ.length];
             }
             break;
 
         case StreamingControlModeStop:
             @synchronized (self) {
-                stopMediaStream = self.mediaStream;
-                self.mediaStream = nil;
+                NSNumber *key = [NSNumber numberWithLongLong:streamingControlIQ.ident];
+                if (self.interactiveStreams[key]) {
+                    // The interactive stream is finished, the current one continues.
+                    stopMediaStream = self.interactiveStreams[key];
+                    [self.interactiveStreams removeObjectForKey:key];
+                    mediaStream = nil;
+                } else if (self.nextMediaStream && self.nextMediaStream.ident == streamingControlIQ.ident) {
+                    // The next stream of the queue is cancelled, the current one continues.
+                    stopMediaStream = self.nextMediaStream;
+                    self.nextMediaStream = nil;
+                    mediaStream = nil;
+                } else {
+                    stopMediaStream = self.mediaStream;
+                    mediaStream = stopMediaStream;
+                    self.mediaStream = nil;
+                }
             }
-            if (stopMediaStream) {
+            if (mediaStream) {
                 [self postWithEvent:CallParticipantEventStreamStop];
             }
             break;
@@ -1076,7 +1393,7 @@ static TLBinaryPacketIQSerializer *IQ_CAMERA_RESPONSE_SERIALIZER = nil;
         case StreamingControlModeStatusUnSupported:
         case StreamingControlModeStatusReady:
         case StreamingControlModeStatusCompleted: {
-            Streamer *streamer = [self.call currentStreamer];
+            Streamer *streamer = [self.call streamerWithIdent:streamingControlIQ.ident];
             if (streamer) {
                 [streamer onStreamingControlWithConnection:self iq:streamingControlIQ];
             }
@@ -1100,11 +1417,8 @@ static TLBinaryPacketIQSerializer *IQ_CAMERA_RESPONSE_SERIALIZER = nil;
     }
 
     StreamingInfoIQ *streamingInfoIQ = (StreamingInfoIQ *)iq;
-    StreamPlayer *streamPlayer;
-    @synchronized (self) {
-        streamPlayer = self.mediaStream;
-    }
-    if (!streamPlayer || streamPlayer.ident != streamingInfoIQ.ident) {
+    StreamPlayer *streamPlayer = [self streamPlayerWithIdent:streamingInfoIQ.ident];
+    if (!streamPlayer) {
         return;
     }
 
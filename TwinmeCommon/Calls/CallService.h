@@ -163,6 +163,14 @@ typedef enum {
 /// Returns YES if the streaming started and NO if there was some problem (call terminated, ...).
 - (BOOL)startStreamingWithMediaItem:(nonnull MPMediaItem *)mediaItem;
 
+/// Start streaming the media items one after the other, the next one is prefetched while the current one plays.
+/// Returns YES if the streaming started and NO if there was some problem (call terminated, ...).
+- (BOOL)startStreamingWithMediaItems:(nonnull NSArray<MPMediaItem *> *)mediaItems;
+
+/// Start an interactive stream that the peers play along with the current stream.
+/// Returns YES if the streaming started and NO if there was some problem (call terminated, ...).
+- (BOOL)startInteractiveStreamingWithMediaItem:(nonnull MPMediaItem *)mediaItem;
+
 /// Stop streaming content, notify the peers to stop their player and release all resources.
 - (void)stopStreaming;
 
@@ -10,6 +10,7 @@
  */
 
 #import <CocoaLumberjack.h>
+#import <stdatomic.h>
 
 #import <CallKit/CallKit.h>
 #import <CallKit/CXError.h>
@@ -55,6 +56,7 @@
 #import "CallParticipant.h"
 #import "CallConnection.h"
 #import "CallState.h"
+#import "CallSetupTracer.h"
 
 #if 0
 //static const int ddLogLevel = DDLogLevelVerbose;
@@ -65,12 +67,26 @@ static const int ddLogLevel = DDLogLevelWarning;
 
 #define CONNECT_TIMEOUT 15.0 // After accepting a call, delay before we get the connection.
 
+#define MAX_PARALLEL_OUTGOING_CONNECTIONS 4 // Outgoing peer connections of a call room being created at the same time.
+#define REQUEST_TABLE_SHARDS 8 // Number of independent locks for the pending requests.
+#define REQUEST_EXPIRE_DELAY 300 // Delay (s) after which a request without response is dropped.
+
 typedef void (^CallStartedAction) (BOOL success);
 
-// An operation related to a connection in an Audio or Video call.
-@interface ConnectionOperation : NSObject;
+// An operation waiting for the response of a twinlife service.
+@interface CallOperation : NSObject;
 
 @property (nonatomic, readonly) int operation;
+/// Monotonic time (ns) when the operation was created.
+@property (nonatomic, readonly) uint64_t creationTime;
+
+- (nonnull instancetype)initWithOperationId:(int)operationId;
+
+@end
+
+// An operation related to a connection in an Audio or Video call.
+@interface ConnectionOperation : CallOperation;
+
 @property (nonatomic, nonnull, readonly) CallConnection *callConnection;
 @property (nonatomic, nonnull, readonly) CallState *call;
 
@@ -79,15 +95,40 @@ typedef void (^CallStartedAction) (BOOL success);
 @end
 
 // An operation related to an Audio or Video call's CallState.
-@interface CallStateOperation : NSObject;
+@interface CallStateOperation : CallOperation;
 
-@property (nonatomic, readonly) int operation;
 @property (nonatomic, nonnull, readonly) CallState *call;
 
 - (nonnull instancetype)initWithCallState:(nonnull CallState *)call operationId:(int)operationId;
 
 @end
 
+// The operations waiting for a response, indexed by request id.  The table is split in shards with their own lock
+// so that the twinlife thread and the call setup don't contend during bursts, and the operations that never
+// got a response are dropped after REQUEST_EXPIRE_DELAY.
+@interface CallRequestTable : NSObject;
+
+- (nonnull instancetype)init;
+
+- (void)putWithRequestId:(int64_t)requestId operation:(nonnull CallOperation *)operation;
+
+/// Remove and return the operation associated with the request id when it is of the given class.
+- (nullable id)removeWithRequestId:(int64_t)requestId kind:(nonnull Class)kind;
+
+@end
+
+// An immutable snapshot of the call service state read by the UI without taking the service lock.
+@interface CallServiceState : NSObject;
+
+@property (nonatomic, nullable, readonly) CallState *activeCall;
+@property (nonatomic, nullable, readonly) CallState *holdCall;
+@property (nonatomic, nullable, readonly) RTC_OBJC_TYPE(RTCVideoTrack) *localVideoTrack;
+@property (nonatomic, readonly) BOOL cameraMuteOn;
+
+- (nonnull instancetype)initWithActiveCall:(nullable CallState *)activeCall holdCall:(nullable CallState *)holdCall localVideoTrack:(nullable RTC_OBJC_TYPE(RTCVideoTrack) *)localVideoTrack cameraMuteOn:(BOOL)cameraMuteOn;
+
+@end
+
 
 //
 // Interface: CallService ()
@@ -144,6 +185,9 @@ typedef void (^CallStartedAction) (BOOL success);
  *   * callsContacts,
  *   * callkitCalls,
  *   * activeCall, holdCall
+ *   The activeCall, holdCall, currentLocalVideoTrack and cameraMuteOn are stored from the serial stateQueue only and each
+ *   store publishes an immutable CallServiceState snapshot: their getters, and the UI, read that snapshot and never wait
+ *   for the service lock.  Use setActiveCall:holdCall: to change both calls with a single snapshot.
  * - The `CallConnection`, `CallState` and `CallParticipant` MUST also handle and protect their own properties.
  * - An outgoing call must be made through CallKit so that we handle correctly the call if the user leaves the application.
  *  The outgoing ringtone is started by didActivateAudioSession() because this is the first place we are allowed to access and use the audio.
@@ -165,8 +209,11 @@ typedef void (^CallStartedAction) (BOOL success);
 @property (nonatomic, readonly, nonnull) NSMutableDictionary<NSUUID *, CallConnection *> *peers;
 
 @property (nonatomic) BOOL isTwinlifeReady;
-@property (nonatomic, readonly, nonnull) NSMutableDictionary<NSNumber *, ConnectionOperation *> *connectionRequestIds;
-@property (nonatomic, readonly, nonnull) NSMutableDictionary<NSNumber *, CallStateOperation *> *callStateRequestIds;
+@property (nonatomic, readonly, nonnull) CallRequestTable *requests;
+/// The call room member connections waiting for the creation of their outgoing peer connection, by order of priority.
+@property (nonatomic, readonly, nonnull) NSMutableArray<CallConnection *> *pendingOutgoingConnections;
+/// The call room member connections whose outgoing peer connection is being created.
+@property (nonatomic, readonly, nonnull) NSMutableSet<CallConnection *> *admittedOutgoingConnections;
 @property (nonatomic) BOOL restarted;
 
 @property (nonatomic) BOOL connected;
@@ -193,6 +240,9 @@ typedef void (^CallStartedAction) (BOOL success);
 
 // We must record only one local video track: it is connected to the video source which is shared by every P2P connection.
 @property (nonatomic, nullable) RTC_OBJC_TYPE(RTCVideoTrack) *currentLocalVideoTrack;
+/// The last published state snapshot, it is replaced from the stateQueue only.
+@property (atomic, nonnull) CallServiceState *serviceState;
+@property (nonatomic, readonly, nonnull) dispatch_queue_t stateQueue;
 
 - (int64_t)newOperationWithConnection:(nonnull CallConnection *)connection operationId:(int)operationId;
 
@@ -251,6 +301,30 @@ typedef void (^CallStartedAction) (BOOL success);
 - (void)onMemberJoinCallRoomWithCallRoomId:(nonnull NSUUID *)callRoomId memberId:(nonnull NSString *)memberId p2pSessionId:(nullable NSUUID *)p2pSessionId status:(TLMemberStatus)status;
 
 - (void)onTransferRequestWithConnectionId:(nonnull NSUUID *)peerConnectionId originator:(id<TLOriginator>)originator;
+
+/// Queue the call room member connections by order of priority and start the creation of their outgoing peer connection
+/// with at most MAX_PARALLEL_OUTGOING_CONNECTIONS creations in progress.
+- (void)admitOutgoingConnections:(nonnull NSArray<CallConnection *> *)connections;
+
+/// Start the creation of the pending outgoing peer connections while we are below MAX_PARALLEL_OUTGOING_CONNECTIONS.
+- (void)startPendingOutgoingConnections;
+
+/// Create the outgoing peer connection of a call room member.
+- (void)createOutgoingPeerConnectionWithConnection:(nonnull CallConnection *)callConnection;
+
+/// Remove the connection from the pending outgoing connections and release its slot if it was admitted
+/// (when its creation completes, fails or when it is terminated).
+- (void)releaseOutgoingConnectionWithConnection:(nonnull CallConnection *)callConnection;
+
+/// Remove the pending and admitted outgoing connections of the call when it is terminated.
+- (void)releaseOutgoingConnectionsWithCall:(nonnull CallState *)call;
+
+/// Change the active and hold calls and publish them in the same snapshot (used to switch the calls).
+- (void)setActiveCall:(nullable CallState *)activeCall holdCall:(nullable CallState *)holdCall;
+
+/// Publish a new CallServiceState snapshot after activeCall, holdCall, currentLocalVideoTrack or cameraMuteOn changed
+/// (must be called from the stateQueue).
+- (void)publishState;
 @end
 
 //
@@ -282,6 +356,28 @@ TL_CREATE_ASSERT_POINT(CALLKIT_INCONSISTENCY, 4108);
 
 @end
 
+//
+// Implementation: CallOperation
+//
+
+#undef LOG_TAG
+#define LOG_TAG @"CallOperation"
+
+@implementation CallOperation
+
+- (nonnull instancetype)initWithOperationId:(int)operationId {
+    
+    self = [super init];
+    
+    if (self) {
+        _operation = operationId;
+        _creationTime = clock_gettime_nsec_np(CLOCK_UPTIME_RAW);
+    }
+    return self;
+}
+
+@end
+
 //
 // Implementation: ConnectionOperation
 //
@@ -293,12 +389,11 @@ TL_CREATE_ASSERT_POINT(CALLKIT_INCONSISTENCY, 4108);
 
 - (nonnull instancetype)initWithConnection:(nonnull CallConnection *)connection operationId:(int)operationId {
     
-    self = [super init];
+    self = [super initWithOperationId:operationId];
     
     if (self) {
         _callConnection = connection;
         _call = connection.call;
-        _operation = operationId;
     }
     return self;
 }
@@ -317,11 +412,122 @@ TL_CREATE_ASSERT_POINT(CALLKIT_INCONSISTENCY, 4108);
 
 - (nonnull instancetype)initWithCallState:(nonnull CallState *)call operationId:(int)operationId {
     
-    self = [super init];
+    self = [super initWithOperationId:operationId];
     
     if (self) {
         _call = call;
-        _operation = operationId;
+    }
+    return self;
+}
+
+@end
+
+//
+// Interface: CallRequestTable ()
+//
+
+@interface CallRequestTable ()
+
+@property (nonatomic, readonly, nonnull) NSArray<NSMutableDictionary<NSNumber *, CallOperation *> *> *shards;
+@property (nonatomic) atomic_ullong nextPurgeTime;
+
+/// Drop the operations older than REQUEST_EXPIRE_DELAY.
+- (void)purgeWithTime:(uint64_t)now;
+
+@end
+
+//
+// Implementation: CallRequestTable
+//
+
+#undef LOG_TAG
+#define LOG_TAG @"CallRequestTable"
+
+@implementation CallRequestTable
+
+- (nonnull instancetype)init {
+    
+    self = [super init];
+    
+    if (self) {
+        NSMutableArray<NSMutableDictionary<NSNumber *, CallOperation *> *> *shards = [[NSMutableArray alloc] initWithCapacity:REQUEST_TABLE_SHARDS];
+        for (int i = 0; i < REQUEST_TABLE_SHARDS; i++) {
+            [shards addObject:[[NSMutableDictionary alloc] init]];
+        }
+        _shards = shards;
+        _nextPurgeTime = clock_gettime_nsec_np(CLOCK_UPTIME_RAW) + REQUEST_EXPIRE_DELAY * NSEC_PER_SEC;
+    }
+    return self;
+}
+
+- (void)putWithRequestId:(int64_t)requestId operation:(nonnull CallOperation *)operation {
+    DDLogVerbose(@"%@ putWithRequestId: %lld operation: %d", LOG_TAG, requestId, operation.operation);
+
+    NSMutableDictionary<NSNumber *, CallOperation *> *shard = self.shards[(uint64_t)requestId % REQUEST_TABLE_SHARDS];
+    @synchronized (shard) {
+        shard[[NSNumber numberWithLongLong:requestId]] = operation;
+    }
+
+    // Only one thread wins the exchange and purges the table.
+    uint64_t now = operation.creationTime;
+    unsigned long long purgeTime = atomic_load(&_nextPurgeTime);
+    if (now >= purgeTime && atomic_compare_exchange_strong(&_nextPurgeTime, &purgeTime, now + REQUEST_EXPIRE_DELAY * NSEC_PER_SEC)) {
+        [self purgeWithTime:now];
+    }
+}
+
+- (nullable id)removeWithRequestId:(int64_t)requestId kind:(nonnull Class)kind {
+    DDLogVerbose(@"%@ removeWithRequestId: %lld", LOG_TAG, requestId);
+
+    NSNumber *lRequestId = [NSNumber numberWithLongLong:requestId];
+    NSMutableDictionary<NSNumber *, CallOperation *> *shard = self.shards[(uint64_t)requestId % REQUEST_TABLE_SHARDS];
+    @synchronized (shard) {
+        CallOperation *operation = shard[lRequestId];
+        if (![operation isKindOfClass:kind]) {
+            return nil;
+        }
+        [shard removeObjectForKey:lRequestId];
+        return operation;
+    }
+}
+
+- (void)purgeWithTime:(uint64_t)now {
+    DDLogVerbose(@"%@ purgeWithTime: %llu", LOG_TAG, now);
+
+    uint64_t expireTime = now - REQUEST_EXPIRE_DELAY * NSEC_PER_SEC;
+    for (NSMutableDictionary<NSNumber *, CallOperation *> *shard in self.shards) {
+        @synchronized (shard) {
+            NSSet<NSNumber *> *expired = [shard keysOfEntriesPassingTest:^BOOL(NSNumber *requestId, CallOperation *operation, BOOL *stop) {
+                return operation.creationTime < expireTime;
+            }];
+            if (expired.count > 0) {
+                DDLogInfo(@"%@ dropping %lu requests without response", LOG_TAG, (unsigned long)expired.count);
+                [shard removeObjectsForKeys:[expired allObjects]];
+            }
+        }
+    }
+}
+
+@end
+
+//
+// Implementation: CallServiceState
+//
+
+#undef LOG_TAG
+#define LOG_TAG @"CallServiceState"
+
+@implementation CallServiceState
+
+- (nonnull instancetype)initWithActiveCall:(nullable CallState *)activeCall holdCall:(nullable CallState *)holdCall localVideoTrack:(nullable RTC_OBJC_TYPE(RTCVideoTrack) *)localVideoTrack cameraMuteOn:(BOOL)cameraMuteOn {
+    
+    self = [super init];
+    
+    if (self) {
+        _activeCall = activeCall;
+        _holdCall = holdCall;
+        _localVideoTrack = localVideoTrack;
+        _cameraMuteOn = cameraMuteOn;
     }
     return self;
 }
@@ -439,14 +645,9 @@ TL_CREATE_ASSERT_POINT(CALLKIT_INCONSISTENCY, 4108);
 - (void)onErrorWithRequestId:(int64_t)requestId errorCode:(TLBaseServiceErrorCode)errorCode errorParameter:(NSString *)errorParameter {
     DDLogVerbose(@"%@ onErrorWithRequestId: %lld errorCode: %d errorParameter: %@", LOG_TAG, requestId, errorCode, errorParameter);
     
-    NSNumber *lRequestId = [NSNumber numberWithLongLong:requestId];
-    ConnectionOperation *request;
-    @synchronized(self.service.connectionRequestIds) {
-        request = self.service.connectionRequestIds[lRequestId];
-        if (!request) {
-            return;
-        }
-        [self.service.connectionRequestIds removeObjectForKey:lRequestId];
+    ConnectionOperation *request = [self.service.requests removeWithRequestId:requestId kind:[ConnectionOperation class]];
+    if (!request) {
+        return;
     }
     [self.service onErrorWithConnection:request.callConnection operationId:request.operation errorCode:errorCode errorParameter:errorParameter];
 }
@@ -529,14 +730,9 @@ TL_CREATE_ASSERT_POINT(CALLKIT_INCONSISTENCY, 4108);
 - (void)onErrorWithRequestId:(int64_t)requestId errorCode:(TLBaseServiceErrorCode)errorCode errorParameter:(nullable NSString *)errorParameter {
     DDLogVerbose(@"%@ onErrorWithRequestId: %lld errorCode: %d errorParameter: %@", LOG_TAG, requestId, errorCode, errorParameter);
     
-    ConnectionOperation *request;
-    NSNumber *lRequestId = [NSNumber numberWithLongLong:requestId];
-    @synchronized(self.service.connectionRequestIds) {
-        request = self.service.connectionRequestIds[lRequestId];
-        if (!request) {
-            return;
-        }
-        [self.service.connectionRequestIds removeObjectForKey:lRequestId];
+    ConnectionOperation *request = [self.service.requests removeWithRequestId:requestId kind:[ConnectionOperation class]];
+    if (!request) {
+        return;
     }
     
     [self.service onErrorWithConnection:request.callConnection operationId:request.operation errorCode:errorCode errorParameter:errorParameter];
@@ -590,14 +786,9 @@ TL_CREATE_ASSERT_POINT(CALLKIT_INCONSISTENCY, 4108);
 - (void)onCreateCallRoomWithRequestId:(int64_t)requestId callRoomId:(nonnull NSUUID *)callRoomId memberId:(nonnull NSString *)memberId mode:(int)mode maxMemberCount:(int)maxMemberCount {
     DDLogVerbose(@"%@ onCreateCallRoomWithRequestId: %lld callRoomId: %@ memberId: %@ mode: %d maxMemberCount: %d", LOG_TAG, requestId, callRoomId, memberId, mode, maxMemberCount);
 
-    ConnectionOperation *request;
-    NSNumber *lRequestId = [NSNumber numberWithLongLong:requestId];
-    @synchronized (self.service.connectionRequestIds) {
-        request = self.service.connectionRequestIds[lRequestId];
-        if (!request) {
-            return;
-        }
-        [self.service.connectionRequestIds removeObjectForKey:lRequestId];
+    ConnectionOperation *request = [self.service.requests removeWithRequestId:requestId kind:[ConnectionOperation class]];
+    if (!request) {
+        return;
     }
 
     [self.service onCreateCallRoomWithCall:request.call callRoomId:callRoomId memberId:memberId mode:mode maxMemberCount:maxMemberCount];
@@ -612,14 +803,9 @@ TL_CREATE_ASSERT_POINT(CALLKIT_INCONSISTENCY, 4108);
 - (void)onJoinCallRoomWithRequestId:(int64_t)requestId callRoomId:(nonnull NSUUID *)callRoomId memberId:(nonnull NSString *)memberId members:(nonnull NSArray<TLPeerCallMemberInfo *> *)members {
     DDLogVerbose(@"%@ onJoinCallRoomWithRequestId: %lld callRoomId: %@ memberId: %@ members: %@", LOG_TAG, requestId, callRoomId, memberId, members);
 
-    CallStateOperation *request;
-    NSNumber *lRequestId = [NSNumber numberWithLongLong:requestId];
-    @synchronized (self.service.callStateRequestIds) {
-        request = self.service.callStateRequestIds[lRequestId];
-        if (!request) {
-            return;
-        }
-        [self.service.callStateRequestIds removeObjectForKey:lRequestId];
+    CallStateOperation *request = [self.service.requests removeWithRequestId:requestId kind:[CallStateOperation class]];
+    if (!request) {
+        return;
     }
 
     [self.service onJoinCallRoomWithCall:request.call callRoomId:callRoomId memberId:memberId members:members];
@@ -630,6 +816,43 @@ TL_CREATE_ASSERT_POINT(CALLKIT_INCONSISTENCY, 4108);
 
 }
 
+- (void)releaseOutgoingConnectionWithConnection:(nonnull CallConnection *)callConnection {
+    DDLogVerbose(@"%@ releaseOutgoingConnectionWithConnection: %@", LOG_TAG, callConnection);
+
+    BOOL admitted;
+    @synchronized (self.pendingOutgoingConnections) {
+        [self.pendingOutgoingConnections removeObject:callConnection];
+        admitted = [self.admittedOutgoingConnections containsObject:callConnection];
+        [self.admittedOutgoingConnections removeObject:callConnection];
+    }
+    if (admitted) {
+        [self startPendingOutgoingConnections];
+    }
+}
+
+- (void)releaseOutgoingConnectionsWithCall:(nonnull CallState *)call {
+    DDLogVerbose(@"%@ releaseOutgoingConnectionsWithCall: %@", LOG_TAG, call);
+
+    BOOL admitted = NO;
+    @synchronized (self.pendingOutgoingConnections) {
+        NSIndexSet *pending = [self.pendingOutgoingConnections indexesOfObjectsPassingTest:^BOOL(CallConnection *connection, NSUInteger index, BOOL *stop) {
+            return connection.call == call;
+        }];
+        [self.pendingOutgoingConnections removeObjectsAtIndexes:pending];
+        for (CallConnection *connection in [self.admittedOutgoingConnections allObjects]) {
+            if (connection.call == call) {
+                [self.admittedOutgoingConnections removeObject:connection];
+                admitted = YES;
+            }
+        }
+    }
+
+    // The slots of the terminated call are given to the connections of the other call.
+    if (admitted) {
+        [self startPendingOutgoingConnections];
+    }
+}
+
 - (void)onMemberJoinCallRoomWithCallRoomId:(nonnull NSUUID *)callRoomId memberId:(nonnull NSString *)memberId p2pSessionId:(nullable NSUUID *)p2pSessionId status:(TLMemberStatus)status {
     DDLogVerbose(@"%@ onMemberJoinCallRoomWithCallRoomId: %@ memberId: %@ p2pSessionId: %@ status: %u", LOG_TAG, callRoomId, memberId, p2pSessionId, status);
 
@@ -678,14 +901,9 @@ TL_CREATE_ASSERT_POINT(CALLKIT_INCONSISTENCY, 4108);
 - (void)onPushDescriptorRequestId:(int64_t)requestId conversation:(nonnull id<TLConversation>)conversation descriptor:(nonnull TLDescriptor *)descriptor {
     DDLogVerbose(@"%@ onPushDescriptorRequestId: %lld conversation: %@ objectDescriptor: %@", LOG_TAG, requestId, conversation, descriptor);
     
-    CallStateOperation *request;
-    NSNumber *lRequestId = [NSNumber numberWithLongLong:requestId];
-    @synchronized (self.service.callStateRequestIds) {
-        request = self.service.callStateRequestIds[lRequestId];
-        if (!request) {
-            return;
-        }
-        [self.service.callStateRequestIds removeObjectForKey:lRequestId];
+    CallStateOperation *request = [self.service.requests removeWithRequestId:requestId kind:[CallStateOperation class]];
+    if (!request) {
+        return;
     }
     
     request.call.descriptorId = descriptor.descriptorId;
@@ -700,14 +918,9 @@ TL_CREATE_ASSERT_POINT(CALLKIT_INCONSISTENCY, 4108);
 - (void)onPopDescriptorWithRequestId:(int64_t)requestId conversation:(nonnull id <TLConversation>)conversation descriptor:(nonnull TLDescriptor *)descriptor {
     DDLogVerbose(@"%@ onPopDescriptorWithRequestId: %lld conversation: %@ objectDescriptor: %@", LOG_TAG, requestId, conversation, descriptor);
     
-    CallStateOperation *request;
-    NSNumber *lRequestId = [NSNumber numberWithLongLong:requestId];
-    @synchronized (self.service.callStateRequestIds) {
-        request = self.service.callStateRequestIds[lRequestId];
-        if (!request) {
-            return;
-        }
-        [self.service.callStateRequestIds removeObjectForKey:lRequestId];
+    CallStateOperation *request = [self.service.requests removeWithRequestId:requestId kind:[CallStateOperation class]];
+    if (!request) {
+        return;
     }
     
     request.call.descriptorId = descriptor.descriptorId;
@@ -722,14 +935,9 @@ TL_CREATE_ASSERT_POINT(CALLKIT_INCONSISTENCY, 4108);
 - (void)onUpdateDescriptorWithRequestId:(int64_t)requestId conversation:(nonnull id <TLConversation>)conversation descriptor:(nonnull TLDescriptor *)descriptor updateType:(TLConversationServiceUpdateType)updateType {
     DDLogVerbose(@"%@ onUpdateDescriptorWithRequestId: %lld conversation: %@ objectDescriptor: %@ updateType: %u", LOG_TAG, requestId, conversation, descriptor, updateType);
     
-    CallStateOperation *request;
-    NSNumber *lRequestId = [NSNumber numberWithLongLong:requestId];
-    @synchronized (self.service.callStateRequestIds) {
-        request = self.service.callStateRequestIds[lRequestId];
-        if (!request) {
-            return;
-        }
-        [self.service.callStateRequestIds removeObjectForKey:lRequestId];
+    CallStateOperation *request = [self.service.requests removeWithRequestId:requestId kind:[CallStateOperation class]];
+    if (!request) {
+        return;
     }
     
     if (request.operation == ACCEPTED_CALL) {
@@ -743,28 +951,14 @@ TL_CREATE_ASSERT_POINT(CALLKIT_INCONSISTENCY, 4108);
 - (void)onErrorWithRequestId:(int64_t)requestId errorCode:(TLBaseServiceErrorCode)errorCode errorParameter:(nullable NSString *)errorParameter {
     DDLogVerbose(@"%@ onErrorWithRequestId: %lld errorCode: %d errorParameter: %@", LOG_TAG, requestId, errorCode, errorParameter);
 
-    NSNumber *lRequestId = [NSNumber numberWithLongLong:requestId];
-    
-    ConnectionOperation *connectionRequest;
-    @synchronized(self.service.connectionRequestIds) {
-        connectionRequest = self.service.connectionRequestIds[lRequestId];
-        if (connectionRequest) {
-            [self.service.connectionRequestIds removeObjectForKey:lRequestId];
-        }
-    }
-    if (connectionRequest) {
+    CallOperation *request = [self.service.requests removeWithRequestId:requestId kind:[CallOperation class]];
+    if ([request isKindOfClass:[ConnectionOperation class]]) {
+        ConnectionOperation *connectionRequest = (ConnectionOperation *)request;
         [self.service onErrorWithConnection:connectionRequest.callConnection operationId:connectionRequest.operation errorCode:errorCode errorParameter:errorParameter];
-    }
-    
-    CallStateOperation* callRequest;
-    @synchronized(self.service.callStateRequestIds) {
-        callRequest = self.service.callStateRequestIds[lRequestId];
-        if (callRequest) {
-            [self.service.callStateRequestIds removeObjectForKey:lRequestId];
-        }
-    }
-    if (callRequest) {
-        [self.service onErrorWithCall:callRequest.call operationId:connectionRequest.operation errorCode:errorCode errorParameter:errorParameter];
+
+    } else if ([request isKindOfClass:[CallStateOperation class]]) {
+        CallStateOperation *callRequest = (CallStateOperation *)request;
+        [self.service onErrorWithCall:callRequest.call operationId:callRequest.operation errorCode:errorCode errorParameter:errorParameter];
     }
 }
 
@@ -791,8 +985,9 @@ TL_CREATE_ASSERT_POINT(CALLKIT_INCONSISTENCY, 4108);
         _connected = [_twinmeContext isConnected];
         _inBackground = YES;
         _isTwinlifeReady = NO;
-        _connectionRequestIds = [[NSMutableDictionary alloc] init];
-        _callStateRequestIds = [[NSMutableDictionary alloc] init];
+        _requests = [[CallRequestTable alloc] init];
+        _pendingOutgoingConnections = [[NSMutableArray alloc] init];
+        _admittedOutgoingConnections = [[NSMutableSet alloc] init];
         _restarted = NO;
         _callkitCalls = [[NSMutableDictionary alloc] init];
         _peers = [[NSMutableDictionary alloc] init];
@@ -802,6 +997,8 @@ TL_CREATE_ASSERT_POINT(CALLKIT_INCONSISTENCY, 4108);
         _conversationServiceDelegate = [[CallServiceConversationServiceDelegate alloc] initWithService:self];
         _notificationCenter = twinmeApplication.notificationCenter;
         _nextParticipantId = 0;
+        _stateQueue = dispatch_queue_create("callServiceStateQueue", DISPATCH_QUEUE_SERIAL);
+        _serviceState = [[CallServiceState alloc] initWithActiveCall:nil holdCall:nil localVideoTrack:nil cameraMuteOn:NO];
         [_twinmeContext addDelegate:self.twinmeContextDelegate];
 
         // Setup default WebRTC audio session configuration (category is AVAudioSessionCategoryPlayAndRecord)
@@ -1286,6 +1483,8 @@ TL_CREATE_ASSERT_POINT(CALLKIT_INCONSISTENCY, 4108);
         return;
     }
 
+    [call.setupTracer markWithPhase:CallSetupPhaseIncomingCall];
+
     // If this connection is auto-accepted, change to the ACCEPTED state and setup the corresponding timer.
     if (autoAccept && connection) {
         DDLogInfo(@"%@ auto accept %@ for call %@", LOG_TAG, peerConnectionId, call);
@@ -1323,6 +1522,7 @@ TL_CREATE_ASSERT_POINT(CALLKIT_INCONSISTENCY, 4108);
                     }
                 } else if (strongSelf) {
                     DDLogVerbose(@"%@ completion: reportNewIncomingCallWithUUID: %@", LOG_TAG, peerConnectionId);
+                    [call.setupTracer markWithPhase:CallSetupPhaseCallKitReport];
                     
                     // Remember this was a successfull CallKit invocation so that we close it.
                     long callCount;
@@ -1570,90 +1770,75 @@ TL_CREATE_ASSERT_POINT(CALLKIT_INCONSISTENCY, 4108);
 - (BOOL)isCameraMuted {
     DDLogVerbose(@"%@ isCameraMuted", LOG_TAG);
 
-    @synchronized (self) {
-        // If there is no active call, the camera is muted.
-        CallState *call = self.activeCall;
-        if (!call) {
-            return YES;
-        }
+    CallServiceState *state = self.serviceState;
 
-        // If the current call does not use the video, the camera is muted.
-        if (!call.videoSourceOn) {
-            return YES;
-        }
+    // If there is no active call, the camera is muted.
+    CallState *call = state.activeCall;
+    if (!call) {
+        return YES;
     }
 
-    return self.cameraMuteOn;
+    // If the current call does not use the video, the camera is muted.
+    if (!call.videoSourceOn) {
+        return YES;
+    }
+
+    return state.cameraMuteOn;
 }
 
 - (BOOL)isFrontCamera {
     DDLogVerbose(@"%@ isFrontCamera", LOG_TAG);
 
-    @synchronized (self) {
-        if (self.activeCall) {
-            return self.activeCall.frontCameraOn;
-        }
-        return YES;
+    CallState *call = self.serviceState.activeCall;
+    if (call) {
+        return call.frontCameraOn;
     }
+    return YES;
 }
 
 - (CallStatus)callStatus {
     DDLogVerbose(@"%@ callStatus", LOG_TAG);
     
-    @synchronized (self) {
-        CallState *call = self.activeCall;
-        if (!call) {
-            return CallStatusNone;
-        }
-
-        return [call status];
+    CallState *call = self.serviceState.activeCall;
+    if (!call) {
+        return CallStatusNone;
     }
+
+    return [call status];
 }
 
 - (NSTimeInterval)duration {
     
-    NSTimeInterval startTime;
-    @synchronized (self) {
-        CallState *call = self.activeCall;
-        if (!call) {
-            return 0.0;
-        }
+    CallState *call = self.serviceState.activeCall;
+    if (!call) {
+        return 0.0;
+    }
 
-        CallStatus callStatus = [call status];
-        if (!CALL_IS_ACTIVE(callStatus) && !CALL_IS_ON_HOLD((callStatus))) {
-            return 0.0;
-        }
-        startTime = call.connectionStartTime;
+    CallStatus callStatus = [call status];
+    if (!CALL_IS_ACTIVE(callStatus) && !CALL_IS_ON_HOLD((callStatus))) {
+        return 0.0;
     }
     
-    return [[NSDate date] timeIntervalSince1970] - startTime;
+    return [[NSDate date] timeIntervalSince1970] - call.connectionStartTime;
 }
 
 - (nullable CallState *)currentCall {
     DDLogVerbose(@"%@ currentCall", LOG_TAG);
 
-    @synchronized (self) {
-        
-        return self.activeCall;
-    }
+    return self.serviceState.activeCall;
 }
 
 - (nullable CallState *)currentHoldCall {
     DDLogVerbose(@"%@ currentHoldCall", LOG_TAG);
 
-    @synchronized (self) {
-        
-        return self.holdCall;
-    }
+    return self.serviceState.holdCall;
 }
 
 - (nullable RTC_OBJC_TYPE(RTCVideoTrack) *)localVideoTrack {
     DDLogVerbose(@"%@ localVideoTrack", LOG_TAG);
     
-    @synchronized (self) {
-        CallState *callState = self.activeCall;
-        return callState ? self.currentLocalVideoTrack : nil;
-    }
+    CallServiceState *state = self.serviceState;
+    return state.activeCall ? state.localVideoTrack : nil;
 }
 
 - (void)startRingtoneWithNotificationSoundType:(NotificationSoundType)type {
@@ -1794,6 +1979,44 @@ TL_CREATE_ASSERT_POINT(CALLKIT_INCONSISTENCY, 4108);
     return [call startStreamingWithMediaItem:mediaItem];
 }
 
+- (BOOL)startStreamingWithMediaItems:(nonnull NSArray<MPMediaItem *> *)mediaItems {
+    DDLogVerbose(@"%@ startStreamingWithMediaItems: %@", LOG_TAG, mediaItems);
+
+    CallState *call;
+    @synchronized (self) {
+        call = self.activeCall;
+        if (!call) {
+            return NO;
+        }
+
+        CallStatus status = [call status];
+        if (!CALL_IS_ACTIVE(status)) {
+            return NO;
+        }
+    }
+
+    return [call startStreamingWithMediaItems:mediaItems];
+}
+
+- (BOOL)startInteractiveStreamingWithMediaItem:(nonnull MPMediaItem *)mediaItem {
+    DDLogVerbose(@"%@ startInteractiveStreamingWithMediaItem: %@", LOG_TAG, mediaItem);
+
+    CallState *call;
+    @synchronized (self) {
+        call = self.activeCall;
+        if (!call) {
+            return NO;
+        }
+
+        CallStatus status = [call status];
+        if (!CALL_IS_ACTIVE(status)) {
+            return NO;
+        }
+    }
+
+    return [call startInteractiveStreamingWithMediaItem:mediaItem];
+}
+
 - (void)stopStreaming {
     DDLogVerbose(@"%@ stopStreaming", LOG_TAG);
 
@@ -1842,6 +2065,7 @@ TL_CREATE_ASSERT_POINT(CALLKIT_INCONSISTENCY, 4108);
     if (call.callRoomId) {
         [call leaveCallRoomWithRequestId:[self.twinmeContext newRequestId]];
     }
+    [self releaseOutgoingConnectionsWithCall:call];
 
     // This is a CallKit call, we have to terminate it through the performEndCallAction().
     if (connections) {
@@ -2173,9 +2397,7 @@ TL_CREATE_ASSERT_POINT(CALLKIT_INCONSISTENCY, 4108);
     
     int64_t requestId = [self.twinmeContext newRequestId];
     CallStateOperation *operation = [[CallStateOperation alloc] initWithCallState:call operationId:operationId];
-    @synchronized (self.callStateRequestIds) {
-        self.callStateRequestIds[[NSNumber numberWithLongLong:requestId]] = operation;
-    }
+    [self.requests putWithRequestId:requestId operation:operation];
     return requestId;
 }
 
@@ -2184,9 +2406,7 @@ TL_CREATE_ASSERT_POINT(CALLKIT_INCONSISTENCY, 4108);
     
     int64_t requestId = [self.twinmeContext newRequestId];
     ConnectionOperation *operation = [[ConnectionOperation alloc] initWithConnection:connection operationId:operationId];
-    @synchronized (self.connectionRequestIds) {
-        self.connectionRequestIds[[NSNumber numberWithLongLong:requestId]] = operation;
-    }
+    [self.requests putWithRequestId:requestId operation:operation];
     return requestId;
 }
 
@@ -2612,12 +2832,14 @@ TL_CREATE_ASSERT_POINT(CALLKIT_INCONSISTENCY, 4108);
     [call updateCallRoomWithMemberId:memberId];
 
     CallStatus callStatus = call.videoSourceOn ? CallStatusOutgoingVideoCall : CallStatusOutgoingCall;
+    NSMutableArray<CallConnection *> *outgoingConnections = [[NSMutableArray alloc] init];
     for (TLPeerCallMemberInfo *member in members) {
         if (member.status != TLMemberStatusNewNeedSession) {
             CallConnection *callConnection = [self findConnectionWithPeerConnectionId:member.p2pSessionId];
             if (callConnection) {
                 // We have a P2P connection with this member, make sure we don't invite it again.
                 callConnection.callRoomMemberId = member.memberId;
+                [call updatePeerWithConnection:callConnection];
                 [callConnection checkOperation:INVITE_CALL_ROOM];
             }
             
@@ -2654,26 +2876,88 @@ TL_CREATE_ASSERT_POINT(CALLKIT_INCONSISTENCY, 4108);
             continue;
         }
 
-        TLOffer *offer = [[TLOffer alloc] initWithAudio:YES video:CALL_IS_VIDEO(callStatus) videoBell:NO data:YES];
-        offer.group = YES;
-        TLOfferToReceive *offerToReceive = [[TLOfferToReceive alloc] initWithAudio:YES video:CALL_IS_VIDEO(callStatus) data:YES];
-        
-        TLNotificationContent* notification;
-        if (!CALL_IS_VIDEO(callStatus)) {
-            notification = [[TLNotificationContent alloc] initWithPriority:TLPeerConnectionServiceNotificationPriorityHigh operation:TLPeerConnectionServiceNotificationOperationAudioCall timeToLive:0];
-        } else if (callStatus == CallStatusOutgoingVideoBell) {
-            notification = [[TLNotificationContent alloc] initWithPriority:TLPeerConnectionServiceNotificationPriorityHigh operation:TLPeerConnectionServiceNotificationOperationVideoBell timeToLive:0];
-        } else {
-            notification = [[TLNotificationContent alloc] initWithPriority:TLPeerConnectionServiceNotificationPriorityHigh operation:TLPeerConnectionServiceNotificationOperationVideoCall timeToLive:0];
+        [outgoingConnections addObject:callConnection];
+    }
+
+    // The participants are known, the peer connections are created in parallel.
+    [self admitOutgoingConnections:outgoingConnections];
+}
+
+- (void)admitOutgoingConnections:(nonnull NSArray<CallConnection *> *)connections {
+    DDLogVerbose(@"%@ admitOutgoingConnections: %@", LOG_TAG, connections);
+
+    if (connections.count == 0) {
+        return;
+    }
+
+    @synchronized (self.pendingOutgoingConnections) {
+        for (CallConnection *connection in connections) {
+            // The transfer target replaces a participant that is already seen and heard: connect it first.
+            // The call room does not tell us who speaks or uses the video, the other members keep the room order.
+            CallState *call = connection.call;
+            if (call.transferToMemberId && [call.transferToMemberId isEqualToString:connection.callRoomMemberId]) {
+                [self.pendingOutgoingConnections insertObject:connection atIndex:0];
+            } else {
+                [self.pendingOutgoingConnections addObject:connection];
+            }
         }
-        notification.timeToLive = OUTGOING_CALL_TIMEOUT * 1000L;
+    }
+    [self startPendingOutgoingConnections];
+}
 
-        [[self.twinmeContext getPeerConnectionService] createOutgoingPeerConnectionWithPeerId:member.memberId offer:offer offerToReceive:offerToReceive notificationContent:notification dataChannelDelegate:callConnection delegate:self withBlock:^(TLBaseServiceErrorCode errorCode, NSUUID *peerConnectionId) {
-            [self onCreateOutgoingPeerConnectionWithConnection:callConnection errorCode:errorCode peerConnectionId:peerConnectionId];
-        }];
+- (void)startPendingOutgoingConnections {
+    DDLogVerbose(@"%@ startPendingOutgoingConnections", LOG_TAG);
+
+    NSMutableArray<CallConnection *> *connections = [[NSMutableArray alloc] init];
+    @synchronized (self.pendingOutgoingConnections) {
+        while (self.pendingOutgoingConnections.count > 0 && self.admittedOutgoingConnections.count < MAX_PARALLEL_OUTGOING_CONNECTIONS) {
+            CallConnection *connection = self.pendingOutgoingConnections[0];
+            [self.pendingOutgoingConnections removeObjectAtIndex:0];
+
+            // The call was terminated or the member left while the connection was waiting.
+            CallState *call = connection.call;
+            if (!call || call.terminateReason != TLPeerConnectionServiceTerminateReasonUnknown || ![[call getConnections] containsObject:connection]) {
+                continue;
+            }
+            [self.admittedOutgoingConnections addObject:connection];
+            [connections addObject:connection];
+        }
+    }
+    for (CallConnection *connection in connections) {
+        [self createOutgoingPeerConnectionWithConnection:connection];
     }
 }
 
+- (void)createOutgoingPeerConnectionWithConnection:(nonnull CallConnection *)callConnection {
+    DDLogVerbose(@"%@ createOutgoingPeerConnectionWithConnection: %@", LOG_TAG, callConnection);
+
+    CallState *call = callConnection.call;
+    NSString *memberId = callConnection.callRoomMemberId;
+    if (!call || !memberId) {
+        [self releaseOutgoingConnectionWithConnection:callConnection];
+        return;
+    }
+
+    CallStatus callStatus = call.videoSourceOn ? CallStatusOutgoingVideoCall : CallStatusOutgoingCall;
+    TLOffer *offer = [[TLOffer alloc] initWithAudio:YES video:CALL_IS_VIDEO(callStatus) videoBell:NO data:YES];
+    offer.group = YES;
+    TLOfferToReceive *offerToReceive = [[TLOfferToReceive alloc] initWithAudio:YES video:CALL_IS_VIDEO(callStatus) data:YES];
+    
+    TLNotificationContent* notification;
+    if (!CALL_IS_VIDEO(callStatus)) {
+        notification = [[TLNotificationContent alloc] initWithPriority:TLPeerConnectionServiceNotificationPriorityHigh operation:TLPeerConnectionServiceNotificationOperationAudioCall timeToLive:0];
+    } else if (callStatus == CallStatusOutgoingVideoBell) {
+        notification = [[TLNotificationContent alloc] initWithPriority:TLPeerConnectionServiceNotificationPriorityHigh operation:TLPeerConnectionServiceNotificationOperationVideoBell timeToLive:0];
+    } else {
+        notification = [[TLNotificationContent alloc] initWithPriority:TLPeerConnectionServiceNotificationPriorityHigh operation:TLPeerConnectionServiceNotificationOperationVideoCall timeToLive:0];
+    }
+    notification.timeToLive = OUTGOING_CALL_TIMEOUT * 1000L;
+
+    [[self.twinmeContext getPeerConnectionService] createOutgoingPeerConnectionWithPeerId:memberId offer:offer offerToReceive:offerToReceive notificationContent:notification dataChannelDelegate:callConnection delegate:self withBlock:^(TLBaseServiceErrorCode errorCode, NSUUID *peerConnectionId) {
+        [self onCreateOutgoingPeerConnectionWithConnection:callConnection errorCode:errorCode peerConnectionId:peerConnectionId];
+    }];
+}
+
 - (void)onMemberJoinCallRoomWithCallRoomId:(nonnull NSUUID *)callRoomId memberId:(nonnull NSString *)memberId p2pSessionId:(nullable NSUUID *)p2pSessionId status:(TLMemberStatus)status {
     DDLogVerbose(@"%@ onMemberJoinCallRoomWithCallRoomId: %@ memberId: %@ p2pSessionId: %@ status: %u", LOG_TAG, callRoomId, memberId, p2pSessionId, status);
 
@@ -2804,11 +3088,13 @@ TL_CREATE_ASSERT_POINT(CALLKIT_INCONSISTENCY, 4108);
     DDLogVerbose(@"%@ onCreateOutgoingPeerConnectionWithConnection: %@ errorCode: %d", LOG_TAG, peerConnectionId, errorCode);
     
     CallState *call = connection.call;
+    [self releaseOutgoingConnectionWithConnection:connection];
     [connection checkOperation:CREATE_OUTGOING_PEER_CONNECTION_DONE];
     [connection checkOperation:CREATED_PEER_CONNECTION];
     BOOL firstOutgoing = [call checkOperation:CREATE_OUTGOING_PEER_CONNECTION_DONE];
 
     if (errorCode == TLBaseServiceErrorCodeSuccess && peerConnectionId) {
+        [call.setupTracer markWithPhase:CallSetupPhaseOfferSent];
         BOOL isCallkitCall;
         @synchronized (self) {
             self.peers[peerConnectionId] = connection;
@@ -2848,6 +3134,7 @@ TL_CREATE_ASSERT_POINT(CALLKIT_INCONSISTENCY, 4108);
         return;
     }
     
+    [callConnection.call.setupTracer markWithPhase:CallSetupPhaseAccepted];
     [callConnection setPeerVersionWithVersion:offer.version];
     [callConnection setTimerWithStatus:CALL_TO_ACCEPTED([callConnection status]) delay:CONNECT_TIMEOUT];
 }
@@ -2894,6 +3181,9 @@ TL_CREATE_ASSERT_POINT(CALLKIT_INCONSISTENCY, 4108);
     }
     
     CallConnectionUpdateState updateState = [call updateConnectionWithConnection:connection state:state];
+    if (state == TLPeerConnectionServiceConnectionStateConnected) {
+        [call.setupTracer markWithPhase:CallSetupPhaseConnected];
+    }
 
     // Report to CallKit that the outgoing call is now connected.
     CallStatus callStatus = [connection status];
@@ -2967,6 +3257,9 @@ TL_CREATE_ASSERT_POINT(CALLKIT_INCONSISTENCY, 4108);
         [self.notificationCenter missedCallNotificationWithOriginator:call.originator video:CALL_IS_VIDEO(callStatus)];
     }
     
+    // A connection terminated before its creation completed must not keep its slot.
+    [self releaseOutgoingConnectionWithConnection:connection];
+
     IncomingCallNotification *notification;
     TLDescriptorId *callDescriptor;
     NSUUID *twincodeOutboundId;
@@ -3004,6 +3297,7 @@ TL_CREATE_ASSERT_POINT(CALLKIT_INCONSISTENCY, 4108);
         [self sendMessageWithCall:call message:CallEventMessageConnectionState];
         return;
     }
+    [self releaseOutgoingConnectionsWithCall:call];
 
     // Update the call descriptor to record the terminate reason.
     if (callDescriptor && twincodeOutboundId) {
@@ -3085,6 +3379,7 @@ TL_CREATE_ASSERT_POINT(CALLKIT_INCONSISTENCY, 4108);
         return;
     }
     
+    [connection.call.setupTracer markWithPhase:CallSetupPhaseFirstMedia];
     NSString *event = [connection onAddRemoteTrackWithTrack:mediaTrack];
     if (event) {
         [self sendMessageWithCall:connection.call message:event];
@@ -3364,8 +3659,7 @@ TL_CREATE_ASSERT_POINT(CALLKIT_INCONSISTENCY, 4108);
         call = self.activeCall;
         hold = self.holdCall;
         if (hold) {
-            self.activeCall = hold;
-            self.holdCall = call;
+            [self setActiveCall:hold holdCall:call];
         }
     }
 
@@ -3503,19 +3797,108 @@ TL_CREATE_ASSERT_POINT(CALLKIT_INCONSISTENCY, 4108);
     }
 }
 
+- (nullable CallState *)activeCall {
+
+    return self.serviceState.activeCall;
+}
+
+- (nullable CallState *)holdCall {
+
+    return self.serviceState.holdCall;
+}
+
+- (nullable RTC_OBJC_TYPE(RTCVideoTrack) *)currentLocalVideoTrack {
+
+    return self.serviceState.localVideoTrack;
+}
+
+- (BOOL)cameraMuteOn {
+
+    return self.serviceState.cameraMuteOn;
+}
+
 - (void)setActiveCall:(CallState *)activeCall {
     DDLogVerbose(@"%@ setActiveCall: %@", LOG_TAG, activeCall);
 
-    if (activeCall != _activeCall) {
-        _activeCall = activeCall;
-        
-        if (activeCall) {
-            self.audioMuteOn = !activeCall.audioSourceOn;
-            self.cameraMuteOn = !activeCall.videoSourceOn;
+    __block BOOL changed = NO;
+    dispatch_sync(self.stateQueue, ^{
+        if (activeCall != self->_activeCall) {
+            changed = YES;
+            self->_activeCall = activeCall;
+            if (activeCall) {
+                self->_cameraMuteOn = !activeCall.videoSourceOn;
+            }
+            [self publishState];
         }
+    });
+
+    if (changed && activeCall) {
+        self.audioMuteOn = !activeCall.audioSourceOn;
     }
 }
 
+- (void)setHoldCall:(CallState *)holdCall {
+    DDLogVerbose(@"%@ setHoldCall: %@", LOG_TAG, holdCall);
+
+    dispatch_sync(self.stateQueue, ^{
+        if (holdCall != self->_holdCall) {
+            self->_holdCall = holdCall;
+            [self publishState];
+        }
+    });
+}
+
+- (void)setActiveCall:(nullable CallState *)activeCall holdCall:(nullable CallState *)holdCall {
+    DDLogVerbose(@"%@ setActiveCall: %@ holdCall: %@", LOG_TAG, activeCall, holdCall);
+
+    __block BOOL changed = NO;
+    dispatch_sync(self.stateQueue, ^{
+        if (activeCall == self->_activeCall && holdCall == self->_holdCall) {
+            return;
+        }
+        changed = activeCall != self->_activeCall;
+        self->_activeCall = activeCall;
+        self->_holdCall = holdCall;
+        if (changed && activeCall) {
+            self->_cameraMuteOn = !activeCall.videoSourceOn;
+        }
+        [self publishState];
+    });
+
+    if (changed && activeCall) {
+        self.audioMuteOn = !activeCall.audioSourceOn;
+    }
+}
+
+- (void)setCurrentLocalVideoTrack:(RTC_OBJC_TYPE(RTCVideoTrack) *)currentLocalVideoTrack {
+    DDLogVerbose(@"%@ setCurrentLocalVideoTrack: %@", LOG_TAG, currentLocalVideoTrack);
+
+    dispatch_sync(self.stateQueue, ^{
+        if (currentLocalVideoTrack != self->_currentLocalVideoTrack) {
+            self->_currentLocalVideoTrack = currentLocalVideoTrack;
+            [self publishState];
+        }
+    });
+}
+
+- (void)setCameraMuteOn:(BOOL)cameraMuteOn {
+    DDLogVerbose(@"%@ setCameraMuteOn: %d", LOG_TAG, cameraMuteOn);
+
+    dispatch_sync(self.stateQueue, ^{
+        if (cameraMuteOn != self->_cameraMuteOn) {
+            self->_cameraMuteOn = cameraMuteOn;
+            [self publishState];
+        }
+    });
+}
+
+- (void)publishState {
+    DDLogVerbose(@"%@ publishState", LOG_TAG);
+
+    // The ivars are only written from the stateQueue: the snapshot always has the latest values.
+    self.serviceState = [[CallServiceState alloc] initWithActiveCall:_activeCall holdCall:_holdCall localVideoTrack:_currentLocalVideoTrack cameraMuteOn:_cameraMuteOn];
+}
+
 #pragma mark - Private methods
 
 - (void)sendMessageWithCall:(nonnull CallState *)call message:(nonnull NSString *)message {
@@ -3626,8 +4009,7 @@ TL_CREATE_ASSERT_POINT(CALLKIT_INCONSISTENCY, 4108);
     @synchronized (self) {
         if (!self.activeCall && self.holdCall) {
             hold = self.holdCall;
-            self.activeCall = self.holdCall;
-            self.holdCall = nil;
+            [self setActiveCall:hold holdCall:nil];
         }
     }
    
@@ -3764,6 +4146,7 @@ TL_CREATE_ASSERT_POINT(CALLKIT_INCONSISTENCY, 4108);
 
         self.cxProvider.configuration = [self getCallkitConfiguration:action.video originator:call.originator];
         [self.cxProvider reportOutgoingCallWithUUID:action.callUUID startedConnectingAtDate:nil];
+        [call.setupTracer markWithPhase:CallSetupPhaseCallKitReport];
         [self.cxProvider reportCallWithUUID:call.callKitUUID updated:callUpdate];
         [action fulfill];
     } else {
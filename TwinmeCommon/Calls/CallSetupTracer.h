@@ -0,0 +1,50 @@
+/*
+ *  Copyright (c) 2026 twinlife SA.
+ *  SPDX-License-Identifier: AGPL-3.0-only
+ *
+ *  Contributors:
+ *   Stephane Carrez (Stephane.Carrez@twin.life)
+ */
+
+#import <Foundation/Foundation.h>
+
+/// The phases of a call setup, in the order they are expected to happen.
+typedef enum {
+    CallSetupPhaseCallKitReport,
+    CallSetupPhaseIncomingCall,
+    CallSetupPhaseOfferSent,
+    CallSetupPhaseAccepted,
+    CallSetupPhaseConnected,
+    CallSetupPhaseDataChannelOpen,
+    CallSetupPhaseFirstMedia,
+    CallSetupPhaseCount
+} CallSetupPhase;
+
+//
+// Interface: CallSetupTracer
+//
+
+/// Record when each phase of the call setup is reached (monotonic time since the creation of the call)
+/// and keep a rolling log of the last calls so that the time-to-ring and time-to-media can be compared between releases.
+@interface CallSetupTracer : NSObject
+
+- (nonnull instancetype)init;
+
+/// Record the phase, only the first time it is reached is kept.
+- (void)markWithPhase:(CallSetupPhase)phase;
+
+/// Get the time (ms) from the creation of the call to the phase, or -1 if the phase was not reached.
+- (int64_t)elapsedWithPhase:(CallSetupPhase)phase;
+
+/// Get the time (ms) of each phase that was reached, indexed by the phase name.
+- (nonnull NSDictionary<NSString *, NSNumber *> *)breakdown;
+
+/// Append the breakdown to the rolling log of the last calls (written in the background).
+- (void)saveWithIncoming:(BOOL)incoming video:(BOOL)video;
+
+/// Get the entries of the rolling log, the oldest first.
++ (nonnull NSArray<NSDictionary<NSString *, id> *> *)loadLog;
+
++ (nonnull NSString *)nameWithPhase:(CallSetupPhase)phase;
+
+@end
@@ -0,0 +1,200 @@
+/*
+ *  Copyright (c) 2026 twinlife SA.
+ *  SPDX-License-Identifier: AGPL-3.0-only
+ *
+ *  Contributors:
+ *   Stephane Carrez (Stephane.Carrez@twin.life)
+ */
+
+#import <CocoaLumberjack.h>
+#include <time.h>
+
+#import "CallSetupTracer.h"
+
+#if 0
+static const int ddLogLevel = DDLogLevelVerbose;
+#else
+static const int ddLogLevel = DDLogLevelWarning;
+#endif
+
+#define CALL_SETUP_LOG_SIZE  50
+#define CALL_SETUP_LOG_FILE  @"call-setup.json"
+
+static dispatch_queue_t callSetupLogQueue(void) {
+    static dispatch_queue_t queue;
+    static dispatch_once_t onceToken;
+    dispatch_once(&onceToken, ^{
+        queue = dispatch_queue_create("callSetupLogQueue", DISPATCH_QUEUE_SERIAL);
+    });
+    return queue;
+}
+
+static NSString *callSetupLogPath(void) {
+
+    return [NSSearchPathForDirectoriesInDomains(NSCachesDirectory, NSUserDomainMask, YES)[0] stringByAppendingPathComponent:CALL_SETUP_LOG_FILE];
+}
+
+//
+// Interface: CallSetupTracer ()
+//
+
+@interface CallSetupTracer ()
+{
+    uint64_t _phaseTimes[CallSetupPhaseCount];
+}
+
+/// Monotonic time (ns) when the call was created.
+@property (nonatomic, readonly) uint64_t startTime;
+
+/// Read the rolling log (must be called from the callSetupLogQueue).
++ (nonnull NSMutableArray<NSDictionary<NSString *, id> *> *)readLog;
+
+@end
+
+//
+// Implementation: CallSetupTracer
+//
+
+#undef LOG_TAG
+#define LOG_TAG @"CallSetupTracer"
+
+@implementation CallSetupTracer
+
+- (nonnull instancetype)init {
+    DDLogVerbose(@"%@ init", LOG_TAG);
+
+    self = [super init];
+    if (self) {
+        _startTime = clock_gettime_nsec_np(CLOCK_UPTIME_RAW);
+        memset(_phaseTimes, 0, sizeof(_phaseTimes));
+    }
+    return self;
+}
+
+- (void)markWithPhase:(CallSetupPhase)phase {
+    DDLogVerbose(@"%@ markWithPhase: %d", LOG_TAG, phase);
+
+    if (phase < 0 || phase >= CallSetupPhaseCount) {
+        return;
+    }
+
+    uint64_t now = clock_gettime_nsec_np(CLOCK_UPTIME_RAW);
+    @synchronized (self) {
+        if (_phaseTimes[phase] == 0) {
+            _phaseTimes[phase] = now;
+        }
+    }
+}
+
+- (int64_t)elapsedWithPhase:(CallSetupPhase)phase {
+
+    if (phase < 0 || phase >= CallSetupPhaseCount) {
+        return -1;
+    }
+
+    @synchronized (self) {
+        if (_phaseTimes[phase] == 0) {
+            return -1;
+        }
+        return (int64_t)(_phaseTimes[phase] - self.startTime) / NSEC_PER_MSEC;
+    }
+}
+
+- (nonnull NSDictionary<NSString *, NSNumber *> *)breakdown {
+    DDLogVerbose(@"%@ breakdown", LOG_TAG);
+
+    NSMutableDictionary<NSString *, NSNumber *> *result = [[NSMutableDictionary alloc] init];
+    for (int phase = 0; phase < CallSetupPhaseCount; phase++) {
+        int64_t elapsed = [self elapsedWithPhase:phase];
+        if (elapsed >= 0) {
+            result[[CallSetupTracer nameWithPhase:phase]] = [NSNumber numberWithLongLong:elapsed];
+        }
+    }
+    return result;
+}
+
+- (void)saveWithIncoming:(BOOL)incoming video:(BOOL)video {
+    DDLogVerbose(@"%@ saveWithIncoming: %d video: %d", LOG_TAG, incoming, video);
+
+    NSDictionary<NSString *, NSNumber *> *breakdown = [self breakdown];
+    if (breakdown.count == 0) {
+        return;
+    }
+
+    // The release is saved with the entry to find the regressions between versions.
+    NSString *version = [[NSBundle mainBundle] objectForInfoDictionaryKey:@"CFBundleShortVersionString"];
+    NSDictionary<NSString *, id> *entry = @{ @"date": [NSNumber numberWithLongLong:(int64_t)[[NSDate date] timeIntervalSince1970]],
+                                              @"version": version ? version : @"",
+                                              @"incoming": [NSNumber numberWithBool:incoming],
+                                              @"video": [NSNumber numberWithBool:video],
+                                              @"phases": breakdown };
+    dispatch_async(callSetupLogQueue(), ^{
+        NSMutableArray<NSDictionary<NSString *, id> *> *log = [CallSetupTracer readLog];
+        [log addObject:entry];
+        if (log.count > CALL_SETUP_LOG_SIZE) {
+            [log removeObjectsInRange:NSMakeRange(0, log.count - CALL_SETUP_LOG_SIZE)];
+        }
+
+        NSError *error;
+        NSData *content = [NSJSONSerialization dataWithJSONObject:log options:0 error:&error];
+        if (!content || ![content writeToFile:callSetupLogPath() options:NSDataWritingAtomic error:&error]) {
+            DDLogError(@"%@ cannot write the call setup log: %@", LOG_TAG, error);
+        }
+    });
+}
+
++ (nonnull NSArray<NSDictionary<NSString *, id> *> *)loadLog {
+    DDLogVerbose(@"%@ loadLog", LOG_TAG);
+
+    __block NSArray<NSDictionary<NSString *, id> *> *result;
+    dispatch_sync(callSetupLogQueue(), ^{
+        result = [CallSetupTracer readLog];
+    });
+    return result;
+}
+
++ (nonnull NSMutableArray<NSDictionary<NSString *, id> *> *)readLog {
+    DDLogVerbose(@"%@ readLog", LOG_TAG);
+
+    NSData *content = [NSData dataWithContentsOfFile:callSetupLogPath()];
+    if (!content) {
+        return [[NSMutableArray alloc] init];
+    }
+
+    id log = [NSJSONSerialization JSONObjectWithData:content options:NSJSONReadingMutableContainers error:nil];
+    if (![log isKindOfClass:[NSMutableArray class]]) {
+        return [[NSMutableArray alloc] init];
+    }
+    return log;
+}
+
++ (nonnull NSString *)nameWithPhase:(CallSetupPhase)phase {
+
+    switch (phase) {
+        case CallSetupPhaseCallKitReport:
+            return @"callkit";
+
+        case CallSetupPhaseIncomingCall:
+            return @"incoming";
+
+        case CallSetupPhaseOfferSent:
+            return @"offer";
+
+        case CallSetupPhaseAccepted:
+            return @"accept";
+
+        case CallSetupPhaseConnected:
+            return @"connected";
+
+        case CallSetupPhaseDataChannelOpen:
+            return @"data-channel";
+
+        case CallSetupPhaseFirstMedia:
+            return @"media";
+
+        default:
+            return @"unknown";
+    }
+}
+
+@end
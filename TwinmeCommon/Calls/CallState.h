@@ -47,6 +47,9 @@ typedef enum {
 @class CallConnection;
 @class CallEventMessage;
 @class Streamer;
+@class StreamingStats;
+@class StreamingRecorder;
+@class CallSetupTracer;
 @class TLDescriptorId;
 @class MPMediaItem;
 @class TLGeolocationDescriptor;
@@ -93,6 +96,14 @@ typedef enum {
 @property (nonatomic) BOOL peerConnected;
 @property (nonatomic) TLPeerConnectionServiceTerminateReason terminateReason;
 @property (nonatomic, nullable) Streamer *currentStreamer;
+/// The next stream of the streaming queue, exported and prefetched by the peers while the current one plays.
+@property (nonatomic, nullable) Streamer *nextStreamer;
+/// When set, the streaming IQs sent and received by the call connections are recorded.
+@property (nullable) StreamingRecorder *streamingRecorder;
+/// Records when each phase of the call setup is reached, it is saved in the rolling log when the last connection
+/// of the call is removed with the direction and media the call was created with.  A call terminated before any
+/// connection was added (a group call left before a member joined) is not logged.
+@property (nonatomic, readonly, nonnull) CallSetupTracer *setupTracer;
 
 @property (nonatomic, nullable) CallConnection *transferFromConnection;
 @property (nonatomic, nullable) NSString *transferToMemberId;
@@ -166,6 +177,9 @@ typedef enum {
 /// Add a new peer connection to the call.
 - (void)addPeerWithConnection:(nonnull CallConnection *)connection;
 
+/// Index the peer connection again after its peer connection id or its call room member id was assigned.
+- (void)updatePeerWithConnection:(nonnull CallConnection *)connection;
+
 /// Update the connection state.  Returns the update state of this connection.
 - (CallConnectionUpdateState)updateConnectionWithConnection:(nonnull CallConnection *)connection state:(TLPeerConnectionServiceConnectionState)state;
 
@@ -202,9 +216,39 @@ typedef enum {
 /// Returns YES if the streaming started and NO if there was some problem.
 - (BOOL)startStreamingWithMediaItem:(nonnull MPMediaItem *)mediaItem;
 
+/// Start streaming the media items one after the other.  The next item is exported and announced
+/// to the peers while the current one plays so that they continue without a start-up stall.
+/// Returns YES if the streaming started and NO if there was some problem.
+- (BOOL)startStreamingWithMediaItems:(nonnull NSArray<MPMediaItem *> *)mediaItems;
+
+/// Add the media item at the end of the streaming queue.
+- (void)enqueueStreamingWithMediaItem:(nonnull MPMediaItem *)mediaItem;
+
+/// Stop the current stream and start the next one of the queue.
+/// Returns NO if the queue is empty.
+- (BOOL)streamNextMediaItem;
+
+/// Start an interactive stream (a short sound, a voice clip) that the peers play along with the current stream.
+/// Its data is sent before the data of the current stream which continues at a lower rate.
+/// Returns YES if the streaming started and NO if there was some problem.
+- (BOOL)startInteractiveStreamingWithMediaItem:(nonnull MPMediaItem *)mediaItem;
+
+/// Stop the interactive stream and notify the peers to stop its player.
+- (void)stopInteractiveStreamingWithIdent:(int64_t)ident;
+
+/// Stop the interactive stream and release it, the peers are notified only when notify is YES
+/// (it is NO when the stream has completed and the peers stop their player by themselves).
+- (void)stopInteractiveStreamingWithIdent:(int64_t)ident notify:(BOOL)notify;
+
+/// Get the streamer of the current, the next or an interactive stream.
+- (nullable Streamer *)streamerWithIdent:(int64_t)ident;
+
 /// Stop streaming content, notify the peers to stop their player and release all resources.
 - (void)stopStreaming;
 
+/// Get the streaming metrics of the stream we are sending (if any) and of the streams we are playing.
+- (nonnull NSArray<StreamingStats *> *)streamingStats;
+
 /// An event occurred on the streamer.
 - (void)onStreamingEventWithParticipant:(nullable CallParticipant *)participent event:(StreamingEvent)event;
 
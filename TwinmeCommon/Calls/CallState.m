@@ -23,8 +23,10 @@
 #import "CallState.h"
 #import "CallConnection.h"
 #import "CallParticipant.h"
+#import "CallSetupTracer.h"
 #import "Streaming/Streamer.h"
 #import "Streaming/StreamPlayer.h"
+#import "Streaming/StreamingStats.h"
 
 #if 0
 static const int ddLogLevel = DDLogLevelInfo;
@@ -34,6 +36,25 @@ static const int ddLogLevel = DDLogLevelWarning;
 
 #define MAX_MEMBER_UI_SUPPORTED 8
 
+//
+// Interface: CallPeers
+//
+
+/// Immutable snapshot of the call peer connections indexed by peer connection id and by call room member id.
+/// A new snapshot is published each time the peers change so that readers don't have to lock the call.
+@interface CallPeers : NSObject
+
+/// The peer connections in the order they were added (the first one is the initial connection).
+@property (nonatomic, readonly, nonnull) NSArray<CallConnection *> *connections;
+@property (nonatomic, readonly, nonnull) NSDictionary<NSUUID *, CallConnection *> *connectionsById;
+@property (nonatomic, readonly, nonnull) NSDictionary<NSString *, CallConnection *> *connectionsByMemberId;
+/// The peer connection ids hidden from the participants during a transfer.
+@property (nonatomic, readonly, nonnull) NSSet<NSUUID *> *pendingCallRoomMembers;
+
+- (nonnull instancetype)initWithConnections:(nonnull NSArray<CallConnection *> *)connections pendingCallRoomMembers:(nonnull NSSet<NSUUID *> *)pendingCallRoomMembers;
+
+@end
+
 //
 // Interface: CallState ()
 //
@@ -42,7 +63,11 @@ static const int ddLogLevel = DDLogLevelWarning;
 
 @property (nonatomic) int state;
 @property (nonatomic, readonly, nonnull) NSMutableArray<CallConnection *> *peers;
+/// The snapshot of the peers, it is replaced (atomically) under the lock of the call.
+@property (atomic, nonnull) CallPeers *peerSnapshot;
 @property (nonatomic) int64_t lastStreamIdent;
+@property (nonatomic, readonly, nonnull) NSMutableArray<MPMediaItem *> *streamingQueue;
+@property (nonatomic, readonly, nonnull) NSMutableDictionary<NSNumber *, Streamer *> *interactiveStreamers;
 @property (nonatomic) atomic_llong requestCounter;
 /// Used for click-to-call group calls: if several participants start the call at the same time, the first one will be processed while the others will be added to this Set in handleIncomingCallDuringExistingCall().
 /// If the call is accepted we resume them in onChangeConnectionState(). If the call is rejected they will be terminated.
@@ -55,6 +80,52 @@ static const int ddLogLevel = DDLogLevelWarning;
 @property (nonatomic, nonnull) NSMutableSet<NSUUID *> *pendingPrepareTransfer;
 ///During a transfer, contains the new incoming connections initiated after receiving PrepareTransferIQ.
 @property (nonatomic, nonnull) NSMutableSet<NSUUID *> *pendingCallRoomMembers;
+/// The direction and media of the call when it was created, they are saved with the setup trace.
+@property (nonatomic) BOOL setupRecorded;
+@property (nonatomic) BOOL setupIncoming;
+@property (nonatomic) BOOL setupVideo;
+
+/// Create the next streamer from the streaming queue and prepare it when there is none.
+- (void)prepareNextStreamer;
+
+/// Publish a new snapshot of the peers (must be called with the call lock held).
+- (void)publishPeers;
+
+@end
+
+//
+// Implementation: CallPeers
+//
+
+#undef LOG_TAG
+#define LOG_TAG @"CallPeers"
+
+@implementation CallPeers
+
+- (nonnull instancetype)initWithConnections:(nonnull NSArray<CallConnection *> *)connections pendingCallRoomMembers:(nonnull NSSet<NSUUID *> *)pendingCallRoomMembers {
+    DDLogVerbose(@"%@ initWithConnections: %@", LOG_TAG, connections);
+
+    self = [super init];
+    if (self) {
+        NSMutableDictionary<NSUUID *, CallConnection *> *connectionsById = [[NSMutableDictionary alloc] initWithCapacity:connections.count];
+        NSMutableDictionary<NSString *, CallConnection *> *connectionsByMemberId = [[NSMutableDictionary alloc] initWithCapacity:connections.count];
+        for (CallConnection *connection in connections) {
+            NSUUID *peerConnectionId = connection.peerConnectionId;
+            if (peerConnectionId && !connectionsById[peerConnectionId]) {
+                connectionsById[peerConnectionId] = connection;
+            }
+            NSString *memberId = connection.callRoomMemberId;
+            if (memberId && !connectionsByMemberId[memberId]) {
+                connectionsByMemberId[memberId] = connection;
+            }
+        }
+        _connections = connections;
+        _connectionsById = connectionsById;
+        _connectionsByMemberId = connectionsByMemberId;
+        _pendingCallRoomMembers = pendingCallRoomMembers;
+    }
+    return self;
+}
 
 @end
 
@@ -76,7 +147,9 @@ static const int ddLogLevel = DDLogLevelWarning;
         _originatorId = originator.uuid;
         _identityName = originator.identityName;
         _identityDescription = originator.identityDescription;
+        _setupTracer = [[CallSetupTracer alloc] init];
         _peers = [[NSMutableArray alloc] init];
+        _peerSnapshot = [[CallPeers alloc] initWithConnections:@[] pendingCallRoomMembers:[NSSet set]];
         _peerCallService = peerCallService;
         _terminateReason = TLPeerConnectionServiceTerminateReasonUnknown;
         _zoomableByPeer = [originator.identityCapabilities zoomable];
@@ -84,6 +157,8 @@ static const int ddLogLevel = DDLogLevelWarning;
         _maxMemberCount = MAX_MEMBER_UI_SUPPORTED;
         _callService = callService;
         _lastStreamIdent = 0;
+        _streamingQueue = [[NSMutableArray alloc] init];
+        _interactiveStreamers = [[NSMutableDictionary alloc] init];
         _requestCounter = 0;
         _sequenceCounter = 0;
         _callKitUUID = callKitUUID ? callKitUUID : [NSUUID UUID];
@@ -158,36 +233,35 @@ static const int ddLogLevel = DDLogLevelWarning;
     DDLogVerbose(@"%@ status", LOG_TAG);
     
     CallStatus result;
-    @synchronized (self) {
-        if (self.terminateReason != TLPeerConnectionServiceTerminateReasonUnknown) {
-            result = CallStatusTerminated;
-        } else if (self.peers.count == 0) {
-            result = CallStatusTerminated;
-        } else {
-            BOOL allPeersOnHold = YES;
-            CallStatus relevantStatus = [self.peers[0] callStatus];
-            result = relevantStatus;
-            for (CallConnection *connection in self.peers) {
-                CallStatus status = [connection callStatus];
-                if (CALL_IS_PEER_ON_HOLD(status)) {
-                    continue;
-                }
-                allPeersOnHold = NO;
-                if (CALL_IS_ACTIVE(status)) {
-                    result = status;
-                    break;
-                }
-                if (CALL_IS_ACCEPTED(status)) {
-                    relevantStatus = status;
-                }
+    NSArray<CallConnection *> *connections = self.peerSnapshot.connections;
+    if (self.terminateReason != TLPeerConnectionServiceTerminateReasonUnknown) {
+        result = CallStatusTerminated;
+    } else if (connections.count == 0) {
+        result = CallStatusTerminated;
+    } else {
+        BOOL allPeersOnHold = YES;
+        CallStatus relevantStatus = [connections[0] callStatus];
+        result = relevantStatus;
+        for (CallConnection *connection in connections) {
+            CallStatus status = [connection callStatus];
+            if (CALL_IS_PEER_ON_HOLD(status)) {
+                continue;
             }
-            if (allPeersOnHold) {
-                result = relevantStatus | CALL_PEER_ON_HOLD;
+            allPeersOnHold = NO;
+            if (CALL_IS_ACTIVE(status)) {
+                result = status;
+                break;
             }
-            if (self.onHold) {
-                result |= CALL_ON_HOLD;
+            if (CALL_IS_ACCEPTED(status)) {
+                relevantStatus = status;
             }
         }
+        if (allPeersOnHold) {
+            result = relevantStatus | CALL_PEER_ON_HOLD;
+        }
+        if (self.onHold) {
+            result |= CALL_ON_HOLD;
+        }
     }
     
     DDLogVerbose(@"%@ status: %d", LOG_TAG, result);
@@ -196,6 +270,14 @@ static const int ddLogLevel = DDLogLevelWarning;
 }
 
 - (void)setAudioVideoStateWithCallStatus:(CallStatus)status {
+    @synchronized (self) {
+        if (!self.setupRecorded) {
+            self.setupRecorded = YES;
+            self.setupIncoming = CALL_IS_INCOMING(status) != 0;
+            self.setupVideo = CALL_IS_VIDEO(status) != 0;
+        }
+    }
+
     switch (status) {
         case CallStatusOutgoingVideoBell:
             self.audioSourceOn = NO;
@@ -232,17 +314,13 @@ static const int ddLogLevel = DDLogLevelWarning;
 
 - (BOOL)isOneOnOneVideoCall {
     
-    @synchronized (self) {
-        return self.peers.count == 1 && self.videoSourceOn && !self.peers[0].mainParticipant.isVideoMute;
-    }
+    NSArray<CallConnection *> *connections = self.peerSnapshot.connections;
+    return connections.count == 1 && self.videoSourceOn && !connections[0].mainParticipant.isVideoMute;
 }
 
 - (BOOL)isGroupCall {
     
-    BOOL result;
-    @synchronized (self) {
-        result = self.callRoomId != nil || self.peers.count > 1;
-    }
+    BOOL result = self.callRoomId != nil || self.peerSnapshot.connections.count > 1;
     
     DDLogVerbose(@"%@ isGroupCall: %d", LOG_TAG, result);
     
@@ -262,63 +340,46 @@ static const int ddLogLevel = DDLogLevelWarning;
     
     CallStatus callStatus;
     TLPeerConnectionServiceConnectionState state;
-    @synchronized (self) {
-        if (self.peers.count == 0) {
-            callStatus = CallStatusTerminated;
-            state = TLPeerConnectionServiceConnectionStateChecking;
-        } else {
-            CallConnection *callConnection = self.peers[0];
-            callStatus = self.status;
-            state = callConnection.connectionState;
-        }
+    NSArray<CallConnection *> *connections = self.peerSnapshot.connections;
+    if (connections.count == 0) {
+        callStatus = CallStatusTerminated;
+        state = TLPeerConnectionServiceConnectionStateChecking;
+    } else {
+        CallConnection *callConnection = connections[0];
+        callStatus = self.status;
+        state = callConnection.connectionState;
     }
     
     return [[CallEventMessage alloc] initWithCallId:self.uuid callStatus:callStatus state:state];
 }
 
 - (BOOL)hasConnectionWithCallMemberId:(nonnull NSString *)callMemberId {
-    DDLogVerbose(@"%@ getConnections", LOG_TAG);
-    
-    @synchronized (self) {
-        for (CallConnection *connection in self.peers) {
-            if ([callMemberId isEqual:connection.callRoomMemberId]) {
-                return YES;
-            }
-        }
-    }
+    DDLogVerbose(@"%@ hasConnectionWithCallMemberId: %@", LOG_TAG, callMemberId);
     
-    return NO;
+    return self.peerSnapshot.connectionsByMemberId[callMemberId] != nil;
 }
 
 - (nonnull NSArray<CallConnection *> *)getConnections {
     DDLogVerbose(@"%@ getConnections", LOG_TAG);
     
-    NSArray<CallConnection *> *result;
-    @synchronized (self) {
-        result = [[NSArray alloc] initWithArray:self.peers];
-    }
-    
-    return result;
+    // The snapshot is immutable: no need to copy it.
+    return self.peerSnapshot.connections;
 }
 
 - (nonnull NSArray<TLPeerSessionInfo *> *)getConnectionIds {
 
-    NSMutableArray<TLPeerSessionInfo *> *result;
-    @synchronized (self) {
-        result = [[NSMutableArray alloc] init];
-        
-        for (CallConnection *connection in self.peers) {
-            NSUUID *peerConnectionId = connection.peerConnectionId;
-            if (peerConnectionId) {
-                NSString *peerId = connection.callRoomMemberId;
-                if (!peerId) {
-                    NSUUID *twincodeOut = connection.peerTwincodeOutboundId;
-                    if (twincodeOut) {
-                        peerId = [twincodeOut toString];
-                    }
+    NSMutableArray<TLPeerSessionInfo *> *result = [[NSMutableArray alloc] init];
+    for (CallConnection *connection in self.peerSnapshot.connections) {
+        NSUUID *peerConnectionId = connection.peerConnectionId;
+        if (peerConnectionId) {
+            NSString *peerId = connection.callRoomMemberId;
+            if (!peerId) {
+                NSUUID *twincodeOut = connection.peerTwincodeOutboundId;
+                if (twincodeOut) {
+                    peerId = [twincodeOut toString];
                 }
-                [result addObject:[[TLPeerSessionInfo alloc] initWithSessionId:peerConnectionId peerId:peerId]];
             }
+            [result addObject:[[TLPeerSessionInfo alloc] initWithSessionId:peerConnectionId peerId:peerId]];
         }
     }
     return result;
@@ -327,21 +388,22 @@ static const int ddLogLevel = DDLogLevelWarning;
 - (void)clearConnections {
     @synchronized (self) {
         [self.peers removeAllObjects];
+        [self publishPeers];
     }
 }
 
 - (nonnull NSArray<CallParticipant *> *)getParticipants {
     DDLogVerbose(@"%@ getParticipants", LOG_TAG);
     
+    CallPeers *peers = self.peerSnapshot;
     NSMutableArray<CallParticipant *> *result = [[NSMutableArray alloc] init];
-    @synchronized (self) {
-        for (CallConnection *connection in self.peers) {
-            // Connection in pendingPrepareTransfer => it's either the transfer target, or another participant who joined the call during the transfer process.
-            // We don't want to display them until we know which connection is the transfer target
-            // (otherwise we'll briefly see both the transferred participant and the transfer target as separate participants)
-            if (![self.pendingCallRoomMembers containsObject:connection.peerConnectionId]) {
-                [connection appendParticipantsWithList:result];
-            }
+    for (CallConnection *connection in peers.connections) {
+        // Connection in pendingPrepareTransfer => it's either the transfer target, or another participant who joined the call during the transfer process.
+        // We don't want to display them until we know which connection is the transfer target
+        // (otherwise we'll briefly see both the transferred participant and the transfer target as separate participants)
+        NSUUID *peerConnectionId = connection.peerConnectionId;
+        if (!peerConnectionId || ![peers.pendingCallRoomMembers containsObject:peerConnectionId]) {
+            [connection appendParticipantsWithList:result];
         }
     }
     return result;
@@ -350,31 +412,13 @@ static const int ddLogLevel = DDLogLevelWarning;
 - (nullable CallConnection *)initialConnection {
     DDLogVerbose(@"%@ initialConnection", LOG_TAG);
     
-    CallConnection *callConnection;
-    @synchronized (self) {
-        if (self.peers.count == 0) {
-            callConnection = nil;
-        } else {
-            callConnection = self.peers[0];
-        }
-    }
-    
-    return callConnection;
+    return self.peerSnapshot.connections.firstObject;
 }
 
 - (nullable CallParticipant *)mainParticipant {
     DDLogVerbose(@"%@ mainParticipant", LOG_TAG);
     
-    CallConnection *callConnection;
-    @synchronized (self) {
-        if (self.peers.count == 0) {
-            return nil;
-        } else {
-            callConnection = self.peers[0];
-            
-            return [callConnection mainParticipant];
-        }
-    }
+    return [self.peerSnapshot.connections.firstObject mainParticipant];
 }
 
 - (nullable TLGeolocationDescriptor *)currentGeolocation {
@@ -405,19 +449,47 @@ static const int ddLogLevel = DDLogLevelWarning;
                 [self performTransferWithParticipant:connection.mainParticipant];
             }
         }
+        [self publishPeers];
     }
 }
 
+- (void)updatePeerWithConnection:(nonnull CallConnection *)connection {
+    DDLogVerbose(@"%@ updatePeerWithConnection: %@", LOG_TAG, connection);
+
+    @synchronized (self) {
+        if ([self.peers containsObject:connection]) {
+            [self publishPeers];
+        }
+    }
+}
+
+- (void)publishPeers {
+    DDLogVerbose(@"%@ publishPeers", LOG_TAG);
+
+    self.peerSnapshot = [[CallPeers alloc] initWithConnections:[[NSArray alloc] initWithArray:self.peers] pendingCallRoomMembers:[[NSSet alloc] initWithSet:self.pendingCallRoomMembers]];
+}
+
 - (BOOL)removeWithConnection:(nonnull CallConnection *)connection terminateReason:(TLPeerConnectionServiceTerminateReason)terminateReason {
     DDLogVerbose(@"%@ removeWithConnection: %@", LOG_TAG, connection);
     
+    BOOL lastConnection;
+    BOOL incoming;
+    BOOL video;
     @synchronized (self) {
         [self.peers removeObject:connection];
-        if (self.peers.count == 0) {
+        [self publishPeers];
+        lastConnection = self.peers.count == 0;
+        if (lastConnection) {
             self.terminateReason = terminateReason;
         }
-        return self.peers.count == 0;
+        incoming = self.setupIncoming;
+        video = self.setupVideo;
+    }
+
+    if (lastConnection) {
+        [self.setupTracer saveWithIncoming:incoming video:video];
     }
+    return lastConnection;
 }
 
 - (CallConnectionUpdateState)updateConnectionWithConnection:(nonnull CallConnection *)connection state:(TLPeerConnectionServiceConnectionState)state {
@@ -546,33 +618,209 @@ static const int ddLogLevel = DDLogLevelWarning;
 - (BOOL)startStreamingWithMediaItem:(nonnull MPMediaItem *)mediaItem {
     DDLogVerbose(@"%@ startStreamingWithMediaItem: %@", LOG_TAG, mediaItem);
     
+    return [self startStreamingWithMediaItems:@[mediaItem]];
+}
+
+- (BOOL)startStreamingWithMediaItems:(nonnull NSArray<MPMediaItem *> *)mediaItems {
+    DDLogVerbose(@"%@ startStreamingWithMediaItems: %@", LOG_TAG, mediaItems);
+
+    if (mediaItems.count == 0) {
+        return NO;
+    }
+
     Streamer *oldStreamer;
+    Streamer *oldNextStreamer;
     Streamer *newStreamer;
     @synchronized (self) {
         self.lastStreamIdent++;
         oldStreamer = self.currentStreamer;
-        self.currentStreamer = newStreamer = [[Streamer alloc] initWithCall:self ident:self.lastStreamIdent mediaItem:mediaItem];
+        oldNextStreamer = self.nextStreamer;
+        self.nextStreamer = nil;
+        [self.streamingQueue removeAllObjects];
+        [self.streamingQueue addObjectsFromArray:[mediaItems subarrayWithRange:NSMakeRange(1, mediaItems.count - 1)]];
+        self.currentStreamer = newStreamer = [[Streamer alloc] initWithCall:self ident:self.lastStreamIdent mediaItem:mediaItems[0]];
+    }
+    if (oldNextStreamer) {
+        [oldNextStreamer stopStreamingWithNotify:YES];
     }
     if (oldStreamer) {
         [oldStreamer stopStreamingWithNotify:YES];
     }
     
     [newStreamer startStreaming];
+    [self prepareNextStreamer];
     return YES;
 }
 
+- (void)enqueueStreamingWithMediaItem:(nonnull MPMediaItem *)mediaItem {
+    DDLogVerbose(@"%@ enqueueStreamingWithMediaItem: %@", LOG_TAG, mediaItem);
+
+    @synchronized (self) {
+        [self.streamingQueue addObject:mediaItem];
+    }
+    [self prepareNextStreamer];
+}
+
+- (BOOL)streamNextMediaItem {
+    DDLogVerbose(@"%@ streamNextMediaItem", LOG_TAG);
+
+    Streamer *oldStreamer;
+    Streamer *newStreamer;
+    BOOL prepared;
+    @synchronized (self) {
+        newStreamer = self.nextStreamer;
+        prepared = newStreamer != nil;
+        if (!newStreamer && self.streamingQueue.count > 0) {
+            self.lastStreamIdent++;
+            newStreamer = [[Streamer alloc] initWithCall:self ident:self.lastStreamIdent mediaItem:self.streamingQueue[0]];
+            [self.streamingQueue removeObjectAtIndex:0];
+        }
+        if (!newStreamer) {
+            return NO;
+        }
+        oldStreamer = self.currentStreamer;
+        self.currentStreamer = newStreamer;
+        self.nextStreamer = nil;
+    }
+
+    // The peers replace their player when they receive the start of the new stream.
+    if (oldStreamer) {
+        [oldStreamer stopStreamingWithNotify:NO];
+    }
+    if (prepared) {
+        [newStreamer activateStreaming];
+    } else {
+        [newStreamer startStreaming];
+    }
+    [self prepareNextStreamer];
+    return YES;
+}
+
+- (void)prepareNextStreamer {
+    DDLogVerbose(@"%@ prepareNextStreamer", LOG_TAG);
+
+    Streamer *nextStreamer = nil;
+    @synchronized (self) {
+        if (!self.nextStreamer && self.currentStreamer && self.streamingQueue.count > 0) {
+            self.lastStreamIdent++;
+            self.nextStreamer = nextStreamer = [[Streamer alloc] initWithCall:self ident:self.lastStreamIdent mediaItem:self.streamingQueue[0]];
+            [self.streamingQueue removeObjectAtIndex:0];
+        }
+    }
+    if (nextStreamer) {
+        [nextStreamer prepareStreaming];
+    }
+}
+
+- (BOOL)startInteractiveStreamingWithMediaItem:(nonnull MPMediaItem *)mediaItem {
+    DDLogVerbose(@"%@ startInteractiveStreamingWithMediaItem: %@", LOG_TAG, mediaItem);
+
+    Streamer *streamer;
+    @synchronized (self) {
+        self.lastStreamIdent++;
+        streamer = [[Streamer alloc] initWithCall:self ident:self.lastStreamIdent mediaItem:mediaItem priority:StreamingPriorityInteractive];
+        self.interactiveStreamers[[NSNumber numberWithLongLong:streamer.ident]] = streamer;
+    }
+
+    [streamer startStreaming];
+    return YES;
+}
+
+- (void)stopInteractiveStreamingWithIdent:(int64_t)ident {
+    DDLogVerbose(@"%@ stopInteractiveStreamingWithIdent: %lld", LOG_TAG, ident);
+
+    [self stopInteractiveStreamingWithIdent:ident notify:YES];
+}
+
+- (void)stopInteractiveStreamingWithIdent:(int64_t)ident notify:(BOOL)notify {
+    DDLogVerbose(@"%@ stopInteractiveStreamingWithIdent: %lld notify: %d", LOG_TAG, ident, notify);
+
+    Streamer *streamer;
+    @synchronized (self) {
+        NSNumber *key = [NSNumber numberWithLongLong:ident];
+        streamer = self.interactiveStreamers[key];
+        [self.interactiveStreamers removeObjectForKey:key];
+    }
+    if (streamer) {
+        [streamer stopStreamingWithNotify:notify];
+    }
+}
+
+- (nullable Streamer *)streamerWithIdent:(int64_t)ident {
+    DDLogVerbose(@"%@ streamerWithIdent: %lld", LOG_TAG, ident);
+
+    @synchronized (self) {
+        if (self.currentStreamer && self.currentStreamer.ident == ident) {
+            return self.currentStreamer;
+        }
+        if (self.nextStreamer && self.nextStreamer.ident == ident) {
+            return self.nextStreamer;
+        }
+        return self.interactiveStreamers[[NSNumber numberWithLongLong:ident]];
+    }
+}
+
 - (void)stopStreaming {
     DDLogVerbose(@"%@ stopStreaming", LOG_TAG);
     
-    if (self.currentStreamer) {
-        [self.currentStreamer stopStreamingWithNotify:YES];
+    Streamer *streamer;
+    Streamer *nextStreamer;
+    NSArray<Streamer *> *interactiveStreamers;
+    @synchronized (self) {
+        streamer = self.currentStreamer;
+        nextStreamer = self.nextStreamer;
+        interactiveStreamers = [self.interactiveStreamers allValues];
         self.currentStreamer = nil;
+        self.nextStreamer = nil;
+        [self.streamingQueue removeAllObjects];
+        [self.interactiveStreamers removeAllObjects];
+    }
+    for (Streamer *interactiveStreamer in interactiveStreamers) {
+        [interactiveStreamer stopStreamingWithNotify:YES];
+    }
+    if (nextStreamer) {
+        [nextStreamer stopStreamingWithNotify:YES];
+    }
+    if (streamer) {
+        [streamer stopStreamingWithNotify:YES];
+    }
+}
+
+- (nonnull NSArray<StreamingStats *> *)streamingStats {
+    DDLogVerbose(@"%@ streamingStats", LOG_TAG);
+
+    NSMutableArray<StreamingStats *> *result = [[NSMutableArray alloc] init];
+    Streamer *streamer;
+    NSArray<Streamer *> *interactiveStreamers;
+    @synchronized (self) {
+        streamer = self.currentStreamer;
+        interactiveStreamers = [self.interactiveStreamers allValues];
     }
+    if (streamer) {
+        [result addObject:streamer.stats];
+    }
+    for (Streamer *interactiveStreamer in interactiveStreamers) {
+        [result addObject:interactiveStreamer.stats];
+    }
+
+    for (CallConnection *connection in [self getConnections]) {
+        for (StreamPlayer *streamPlayer in [connection allStreamPlayers]) {
+            if (![result containsObject:streamPlayer.stats]) {
+                [result addObject:streamPlayer.stats];
+            }
+        }
+    }
+    return result;
 }
 
 - (void)onStreamingEventWithParticipant:(nullable CallParticipant *)participant event:(StreamingEvent)event {
     DDLogVerbose(@"%@ onStreamingEventWithParticipant: %@ event: %d", LOG_TAG, participant, event);
     
+    // Our local player completed the current stream: continue with the next one of the queue.
+    if (!participant && event == StreamingEventCompleted && [self streamNextMediaItem]) {
+        return;
+    }
+
     id<CallParticipantDelegate> observer = [self.callService callParticipantDelegate];
     if (observer) {
         dispatch_async(dispatch_get_main_queue(), ^{
@@ -701,13 +949,9 @@ static const int ddLogLevel = DDLogLevelWarning;
     @synchronized (self) {
         self.transferToMemberId = memberId;
         [self.pendingCallRoomMembers removeAllObjects];
-        
-        for (CallConnection *connection in self.peers) {
-            if (connection.callRoomMemberId && [connection.callRoomMemberId isEqualToString:memberId]) {
-                transferTarget = connection.mainParticipant;
-                break;
-            }
-        }
+        [self publishPeers];
+
+        transferTarget = self.peerSnapshot.connectionsByMemberId[memberId].mainParticipant;
     }
     
     [self performTransferWithParticipant:transferTarget];
@@ -728,14 +972,8 @@ static const int ddLogLevel = DDLogLevelWarning;
 }
 
 - (nullable CallConnection *)getConnectionWithId:(nonnull NSUUID *)connectionId {
-    @synchronized (self) {
-        for (CallConnection *connection in self.peers) {
-            if ([connection.peerConnectionId isEqual:connectionId]) {
-                return connection;
-            }
-        }
-    }
-    return nil;
+    
+    return self.peerSnapshot.connectionsById[connectionId];
 }
 
 - (TransferDirection)getTransferDirection {
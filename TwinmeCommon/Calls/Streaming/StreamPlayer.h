@@ -6,11 +6,16 @@
  *   Stephane Carrez (Stephane.Carrez@twin.life)
  */
 
+#import "StreamingControlIQ.h"
+
 @class CallConnection;
 @class CallState;
 @class Streamer;
+@class StreamingStats;
 @class StreamingDataIQ;
+@class StreamingParityIQ;
 @class StreamingControlIQ;
+@class AVPlayer;
 
 //
 // Interface: StreamPlayer
@@ -27,12 +32,24 @@
 @property (nonatomic, readonly) int64_t duration;
 @property (nonatomic, readonly, nullable) CallConnection *connection;
 @property (nonatomic, readonly, nullable) Streamer *streamer;
+@property (nonatomic, readonly, nonnull) StreamingStats *stats;
+@property (nonatomic, readonly, nullable) AVPlayer *videoPlayer;
+/// A background player keeps a small request window while an interactive stream plays on the same connection.
+@property (nonatomic) StreamingPriority priority;
 
-- (nonnull instancetype)initWithIdent:(int64_t)ident size:(int64_t)size video:(BOOL)video call:(nonnull CallState *)call connection:(nullable CallConnection *)connection streamer:(nullable Streamer *)streamer;
+/// Create the player for a stream, the size and the number of audio packets are 0 when they are not known.
+- (nonnull instancetype)initWithIdent:(int64_t)ident size:(int64_t)size packetCount:(int64_t)packetCount video:(BOOL)video call:(nonnull CallState *)call connection:(nullable CallConnection *)connection streamer:(nullable Streamer *)streamer;
 
 /// Start the stream player.
 - (void)start;
 
+/// Start the stream player in prefetch mode: the first blocks are requested and queued but
+/// the playback only starts with startPlayback.
+- (void)prefetch;
+
+/// Start playing the stream that was prefetched.
+- (void)startPlayback;
+
 /// Pause the stream player (local only, internal operation).
 - (void)pauseWithDelay:(dispatch_time_t)delay;
 
@@ -66,6 +83,9 @@
 /// Receive a block of data from the peer.
 - (void)onStreamingDataWithIQ:(nonnull StreamingDataIQ *)iq;
 
+/// Receive the parity of a group of data blocks and rebuild the block that is missing (if any).
+- (void)onStreamingParityWithIQ:(nonnull StreamingParityIQ *)iq;
+
 /// Set the information that describes what is being streamed.
 - (void)setInformationWithTitle:(nonnull NSString *)title album:(nullable NSString *)album artist:(nullable NSString *)album artwork:(nullable UIImage *)artwork duration:(int64_t)duration;
 
@@ -7,7 +7,9 @@
  */
 
 #import <CocoaLumberjack.h>
+#import <stdatomic.h>
 #include <AudioToolbox/AudioToolbox.h>
+#import <AVFoundation/AVFoundation.h>
 #import <WebRTC/RTCAudioSession.h>
 #import <WebRTC/RTCDispatcher.h>
 
@@ -18,6 +20,10 @@
 #import "StreamingControlIQ.h"
 #import "StreamingRequestIQ.h"
 #import "StreamingDataIQ.h"
+#import "StreamingParityIQ.h"
+#import "StreamingStats.h"
+#import "StreamingClock.h"
+#import "StreamingReorderBuffer.h"
 
 #if 0
 static const int ddLogLevel = DDLogLevelVerbose;
@@ -29,17 +35,261 @@ static const int ddLogLevel = DDLogLevelWarning;
 
 #define OUTPUT_BUFFER_SIZE           16384*4 // *4*4
 #define STREAM_BUFFER_SIZE           8192 // *4*4
-#define STREAM_BUFFER_QUEUE_SIZE     (128*1024)
-#define STREAM_MIN_BUFFER_QUEUE_SIZE (128*1024)
+
+// The AudioQueue buffers are sized from the stream format to hold that duration of audio.
+#define AUDIO_QUEUE_BUFFER_DURATION  0.25
+#define AUDIO_QUEUE_MIN_PACKETS      4
+#define AUDIO_QUEUE_MAX_PACKETS      256
+
+// The read-ahead window is the amount of compressed data we want to have either received and not
+// yet decoded or requested and not yet received.  It starts at STREAM_INITIAL_WINDOW_SIZE and
+// adapts to the RTT, the stream bitrate and the rate at which the AudioQueue drains the packets.
+// It must stay above OUTPUT_BUFFER_SIZE since we wait for that amount of data before decoding.
+#define STREAM_INITIAL_WINDOW_SIZE   (128*1024)
+#define STREAM_MIN_WINDOW_SIZE       (OUTPUT_BUFFER_SIZE + 4*STREAM_BUFFER_SIZE)
+#define STREAM_MAX_WINDOW_SIZE       (1024*1024)
+
+// Number of RTT worth of audio that we want in flight, plus a fixed margin for the jitter.
+#define STREAM_WINDOW_RTT_FACTOR     4
+#define STREAM_WINDOW_MARGIN_TIME    500
+
+// Minimum period (ms) to measure the drain rate.
+#define STREAM_DRAIN_PERIOD          1000
 
 #define MAX_RTT_TIME    10000
 
-typedef struct AudioPacket {
-    UInt64 identifier;
-    AudioStreamPacketDescription desc;
-    struct AudioPacket *next;
-    char data[];
-} AudioPacket_t;
+// A video is played by AVPlayer which reads the stream through our resource loader: it asks for
+// byte ranges that we request to the streamer, we request at most the video window ahead of
+// each of its loading requests.
+#define STREAM_VIDEO_WINDOW_SIZE     (4*1024*1024)
+#define STREAM_VIDEO_SCHEME          @"twinme-stream"
+
+// Continuous drift correction: the drift with the streamer is absorbed by changing the play rate
+// so that it is corrected within STREAM_SYNC_CORRECTION_TIME without an audible pitch change.
+#define STREAM_SYNC_MIN_SAMPLES      4
+#define STREAM_SYNC_DEADBAND         20
+#define STREAM_SYNC_CORRECTION_TIME  10000
+#define STREAM_SYNC_MAX_RATE_DELTA   0.03
+
+// Initial and maximum size of the ring that holds the compressed audio packets waiting to be decoded.
+// We can hold at most the read-ahead window and the blocks that were in flight when it was reached.
+#define AUDIO_PACKET_RING_SIZE       (2*STREAM_INITIAL_WINDOW_SIZE)
+#define AUDIO_PACKET_RING_MAX_SIZE   (2*STREAM_MAX_WINDOW_SIZE)
+#define AUDIO_PACKET_RING_COUNT      1024
+
+// Number of audio packets between two entries of the seek index (~1.5s for AAC at 44.1kHz).
+#define STREAM_SEEK_INDEX_INTERVAL   64
+
+// Number of received data blocks that we keep to rebuild a missing block with the parity.
+#define STREAM_PARITY_KEEP_BLOCKS    (4*STREAMING_PARITY_GROUP_SIZE)
+
+/**
+ * Ring of compressed audio packets.
+ *
+ * - The packet data is stored contiguously in `data`, a packet never wraps at the end of the ring,
+ * - The packet descriptors are stored in the parallel `desc` array and their `mStartOffset`
+ *   gives the position of the packet in `data`,
+ * - Packets are consumed in order, the first packet is at `first` and we have `count` packets.
+ *
+ * When the ring is full, it is enlarged up to AUDIO_PACKET_RING_MAX_SIZE and the packets are
+ * moved at the beginning of the new ring.
+ */
+typedef struct AudioPacketRing {
+    char *data;
+    UInt32 dataSize;
+    UInt32 dataWrite;
+    AudioStreamPacketDescription *desc;
+    UInt32 descSize;
+    UInt32 first;
+    UInt32 count;
+} AudioPacketRing_t;
+
+static BOOL audioPacketRingResize(AudioPacketRing_t *ring, UInt32 dataSize, UInt32 descSize) {
+
+    char *data = (char *)malloc(dataSize);
+    AudioStreamPacketDescription *desc = (AudioStreamPacketDescription *)malloc(descSize * sizeof(AudioStreamPacketDescription));
+    if (!data || !desc) {
+        free(data);
+        free(desc);
+        return NO;
+    }
+
+    // Move the pending packets at the beginning of the new ring.
+    UInt32 pos = 0;
+    for (UInt32 i = 0; i < ring->count; i++) {
+        AudioStreamPacketDescription *packet = &ring->desc[(ring->first + i) % ring->descSize];
+        desc[i] = *packet;
+        desc[i].mStartOffset = pos;
+        memcpy(data + pos, ring->data + packet->mStartOffset, packet->mDataByteSize);
+        pos += packet->mDataByteSize;
+    }
+
+    free(ring->data);
+    free(ring->desc);
+    ring->data = data;
+    ring->dataSize = dataSize;
+    ring->dataWrite = pos;
+    ring->desc = desc;
+    ring->descSize = descSize;
+    ring->first = 0;
+    return YES;
+}
+
+static void audioPacketRingClear(AudioPacketRing_t *ring) {
+
+    ring->first = 0;
+    ring->count = 0;
+    ring->dataWrite = 0;
+}
+
+static void audioPacketRingFree(AudioPacketRing_t *ring) {
+
+    free(ring->data);
+    free(ring->desc);
+    memset(ring, 0, sizeof(AudioPacketRing_t));
+}
+
+/// Find a position in the ring to store a packet of the given size or return -1 if there is no room.
+static int64_t audioPacketRingReserve(AudioPacketRing_t *ring, UInt32 size) {
+
+    if (ring->count == 0) {
+        ring->first = 0;
+        ring->dataWrite = 0;
+        return size <= ring->dataSize ? 0 : -1;
+    }
+    if (ring->count == ring->descSize) {
+        return -1;
+    }
+
+    UInt32 readPos = (UInt32)ring->desc[ring->first].mStartOffset;
+    UInt32 lastPos = (UInt32)ring->desc[(ring->first + ring->count - 1) % ring->descSize].mStartOffset;
+    if (lastPos >= readPos) {
+        // Packets are in [readPos, dataWrite): use the end of the ring or wrap at the beginning.
+        if (ring->dataSize - ring->dataWrite >= size) {
+            return ring->dataWrite;
+        }
+        return size <= readPos ? 0 : -1;
+    } else {
+        // Packets are in [readPos, end) and [0, dataWrite).
+        return readPos - ring->dataWrite >= size ? (int64_t)ring->dataWrite : -1;
+    }
+}
+
+static BOOL audioPacketRingPush(AudioPacketRing_t *ring, const AudioStreamPacketDescription *packet, const char *data) {
+
+    UInt32 size = packet->mDataByteSize;
+    int64_t pos = audioPacketRingReserve(ring, size);
+    while (pos < 0) {
+        UInt32 dataSize = ring->dataSize;
+        UInt32 descSize = ring->descSize;
+        if (ring->count == descSize) {
+            descSize = descSize ? 2 * descSize : AUDIO_PACKET_RING_COUNT;
+        } else {
+            dataSize = dataSize ? 2 * dataSize : AUDIO_PACKET_RING_SIZE;
+            while (dataSize < ring->dataSize + size) {
+                dataSize = 2 * dataSize;
+            }
+        }
+        if (dataSize > AUDIO_PACKET_RING_MAX_SIZE) {
+            return NO;
+        }
+        if (!audioPacketRingResize(ring, dataSize, descSize)) {
+            return NO;
+        }
+        pos = audioPacketRingReserve(ring, size);
+    }
+
+    AudioStreamPacketDescription *desc = &ring->desc[(ring->first + ring->count) % ring->descSize];
+    *desc = *packet;
+    desc->mStartOffset = pos;
+    memcpy(ring->data + pos, data, size);
+    ring->dataWrite = (UInt32)pos + size;
+    ring->count++;
+    return YES;
+}
+
+/// Copy the first packets in the buffer, as many as the buffer and its packet descriptions can hold,
+/// and return the number of bytes copied.  Packets that are contiguous in the ring are copied at once.
+/// A packet that is bigger than the buffer is dropped and its size is reported in `dropped`.
+static UInt32 audioPacketRingRead(AudioPacketRing_t *ring, char *buffer, UInt32 capacity, AudioStreamPacketDescription *desc, UInt32 maxCount, UInt32 *count, UInt32 *dropped) {
+
+    UInt32 size = 0;
+    UInt32 n = 0;
+    *dropped = 0;
+    while (n < maxCount && ring->count > 0) {
+        UInt32 runStart = (UInt32)ring->desc[ring->first].mStartOffset;
+        UInt32 runSize = 0;
+        UInt32 runCount = 0;
+        while (n + runCount < maxCount && runCount < ring->count) {
+            const AudioStreamPacketDescription *packet = &ring->desc[(ring->first + runCount) % ring->descSize];
+            if (packet->mStartOffset != runStart + runSize || size + runSize + packet->mDataByteSize > capacity) {
+                break;
+            }
+            desc[n + runCount] = *packet;
+            desc[n + runCount].mStartOffset = size + runSize;
+            runSize += packet->mDataByteSize;
+            runCount++;
+        }
+        if (runCount == 0) {
+            if (n > 0) {
+                break;
+            }
+
+            // This packet can never fit in a buffer.
+            *dropped += ring->desc[ring->first].mDataByteSize;
+            ring->first = (ring->first + 1) % ring->descSize;
+            ring->count--;
+            continue;
+        }
+
+        memcpy(buffer + size, ring->data + runStart, runSize);
+        size += runSize;
+        n += runCount;
+        ring->first = (ring->first + runCount) % ring->descSize;
+        ring->count -= runCount;
+    }
+    *count = n;
+    return size;
+}
+
+/**
+ * Lock-free single producer/single consumer ring of the buffers given back by the AudioQueue.
+ *
+ * - The producer is the AudioQueue callback which pushes the buffer it has played,
+ * - The consumer is the processQueue which pops them to fill them again,
+ * - The ring can hold every buffer we allocated so that the push never fails.
+ */
+typedef struct AudioBufferRing {
+    AudioQueueBufferRef buffers[AUDIO_QUEUE_BUFFER_COUNT];
+    atomic_uint head;
+    atomic_uint tail;
+} AudioBufferRing_t;
+
+static BOOL audioBufferRingPush(AudioBufferRing_t *ring, AudioQueueBufferRef buffer) {
+
+    unsigned int tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    unsigned int head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    if (tail - head >= AUDIO_QUEUE_BUFFER_COUNT) {
+        return NO;
+    }
+
+    ring->buffers[tail % AUDIO_QUEUE_BUFFER_COUNT] = buffer;
+    atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+    return YES;
+}
+
+static AudioQueueBufferRef audioBufferRingPop(AudioBufferRing_t *ring) {
+
+    unsigned int head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    unsigned int tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    if (head == tail) {
+        return NULL;
+    }
+
+    AudioQueueBufferRef buffer = ring->buffers[head % AUDIO_QUEUE_BUFFER_COUNT];
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+    return buffer;
+}
 
 /**
  * Stream player implementation notes:
@@ -68,23 +318,42 @@ typedef enum {
 // Interface: StreamPlayer
 //
 
-@interface StreamPlayer ()
+@interface StreamPlayer () <AVAssetResourceLoaderDelegate>
 
 @property (readonly) int64_t size;
 @property (nonatomic, readonly) CallState *call;
+@property (nonatomic, readonly, nonnull) StreamingPeerStats *peerStats;
 @property (readonly, nonnull) void *processQueueTag;
 @property (nonatomic, nullable) dispatch_queue_t processQueue;
 @property (nonatomic) int64_t streamReadOffset;
-@property (nonatomic) int64_t streamReadAckOffset;
+@property (nonatomic, readonly) int64_t streamReadAckOffset;
+@property (nonatomic, readonly, nonnull) StreamingReorderBuffer *audioBlocks;
+@property (nonatomic, readonly, nonnull) NSMutableDictionary<NSNumber *, NSData *> *pendingBlocks;
+@property (nonatomic, readonly, nonnull) NSMutableDictionary<NSNumber *, NSData *> *parityBlocks;
+@property (nonatomic, readonly, nonnull) NSMutableArray<NSNumber *> *parityBlockOrder;
+@property (nonatomic, readonly, nonnull) NSMutableData *packetIndex;
+@property (nonatomic) int64_t packetNumber;
+@property (nonatomic) int64_t packetBytes;
+@property (nonatomic) int64_t positionBase;
+@property (nonatomic) Float64 positionSampleTime;
+@property (nonatomic) BOOL positionResync;
 @property (nonatomic) int lastRTT;
+@property (nonatomic) int64_t windowSize;
+@property (nonatomic) int64_t drainRate;
+@property (nonatomic) int64_t drainBytes;
+@property (nonatomic) int64_t drainStartTime;
+@property (nonatomic) int64_t lastUnderrunTime;
 @property (nonatomic) int64_t lastStreamerPosition;
 @property (nonatomic) int64_t lastStreamerPositionTime;
+@property (nonatomic, readonly, nonnull) StreamingClock *clock;
+@property (nonatomic) BOOL timePitchEnabled;
+@property (nonatomic) Float32 playRate;
 @property (nonatomic) BOOL endOfStream;
-@property (nonatomic) AudioPacket_t *firstPacket;
-@property (nonatomic) AudioPacket_t *lastPacket;
-@property (nonatomic) AudioPacket_t *readPacket;
+@property (nonatomic, readonly) int64_t packetCount;
+@property (nonatomic, readonly) BOOL exactEnd;
+@property (nonatomic) int64_t streamEndOffset;
+@property (nonatomic) AudioPacketRing_t *packetRing;
 @property (nullable) AudioQueueRef audioQueue;
-@property (nonatomic) UInt64 packetIdentifier;
 @property (nonatomic) BOOL audioSessionActive;
 @property (nonatomic) BOOL discontinuous;
 @property (nonatomic) AudioFileStreamID audioFileStream;
@@ -98,7 +367,16 @@ typedef enum {
 @property (nonatomic) AudioQueueState audioQueueState;
 @property (nonatomic) AudioQueueBufferRef *audioQueueBuffer; // [AUDIO_QUEUE_BUFFER_COUNT];
 @property (nonatomic) int audioQueueBufferIndex;
+@property (nonatomic) AudioBufferRing_t *audioBufferRing;
+@property (nonatomic, nullable) dispatch_source_t audioBufferSource;
+@property (nonatomic) UInt32 audioQueueBufferSize;
+@property (nonatomic) UInt32 audioQueueBufferPackets;
 @property (nonatomic) int audioReadPendingSize;
+@property (nonatomic, nullable) AVPlayer *videoPlayer;
+@property (nonatomic) BOOL prefetching;
+@property (nonatomic, nullable) id videoEndObserver;
+@property (nonatomic, readonly, nonnull) NSMutableArray<AVAssetResourceLoadingRequest *> *videoLoadingRequests;
+@property (nonatomic, readonly, nonnull) NSMutableIndexSet *videoRequestedRanges;
 
 /// Send the player streaming status or ask request to the peer.
 - (void)sendStreamControlWithMode:(StreamingControlMode)mode offset:(int64_t)offset;
@@ -106,9 +384,44 @@ typedef enum {
 /// Called from the processQueue when we received a data block from the peer.
 - (void)audioWriteWithData:(nonnull NSData *)data offset:(int64_t)offset;
 
+/// Keep the received data block in case it is necessary to rebuild another block of its parity group.
+- (void)parityKeepWithData:(nonnull NSData *)data offset:(int64_t)offset;
+
+/// Rebuild the data block of the parity group if it is the only one we have not received.
+- (void)parityRecoverWithIQ:(nonnull StreamingParityIQ *)iq;
+
+/// Called from the processQueue to flush the AudioQueue and restart the stream at the given position.
+- (void)audioSeekWithPosition:(int64_t)position;
+
+/// Find the packet to play at the given position and its offset from the start of the audio data.
+- (BOOL)audioSeekOffsetWithPosition:(int64_t)position packet:(nonnull int64_t *)packet offset:(nonnull int64_t *)offset;
+
+/// Create the AVPlayer that reads the video stream through the resource loader.
+- (void)videoStart;
+
+/// Called from the processQueue when we received a data block for the video.
+- (void)videoWriteWithData:(nonnull NSData *)data offset:(int64_t)offset;
+
+/// Give the data blocks we have to the AVPlayer loading requests, drop the blocks we don't need
+/// and request the missing ranges.
+- (void)videoProcessLoadingRequests;
+
+/// Get the end offset of the range asked by the loading request.
+- (int64_t)videoEndWithDataRequest:(nonnull AVAssetResourceLoadingDataRequest *)dataRequest;
+
+/// Change the play rate of the AudioQueue to correct the drift with the streamer position.
+- (void)updatePlayRateWithTime:(int64_t)now;
+
 /// Check if we have enough audio packet and request more to the peer if needed.
 - (void)requestFillBuffers;
 
+/// Get the maximum length of a coalesced request (it must be a multiple of STREAM_BUFFER_SIZE).
+- (int64_t)maxRequestSize;
+
+/// Update the read-ahead window from the last RTT, the bitrate and the drain rate.
+/// The window is doubled when the decoder runs out of data.
+- (void)updateWindowWithUnderrun:(BOOL)underrun;
+
 /// Called from audioWriteWithData through the call to AudioFileStreamParseBytes when some audio property is extracted from the stream.
 - (void)audioPropertyValueWithPropertyID:(AudioFileStreamPropertyID)propertyID ioFlags:(UInt32 *)ioFlags;
 
@@ -124,11 +437,15 @@ typedef enum {
 /// Must be called from the processQueue to pick a free buffer and handle the audio decode by calling audioDecodePacketWithBuffer if we have enough audio packets.
 - (void)audioDecodePackets;
 
+/// Called from the processQueue when the AudioQueue gave back some buffers.
+- (void)audioReclaimBuffers;
+
 - (OSStatus)audioDecodePacketWithBuffer:(AudioQueueBufferRef)buffer;
 
 - (void)audioQueueIsRunningWithProperty:(AudioQueuePropertyID)property;
 
-- (OSStatus)encoderDataWithNumber:(nonnull UInt32 *)numberDataPackets data:(nonnull AudioBufferList *)data packetDescription:(AudioStreamPacketDescription **)packetDescription;
+/// Compute the size and the number of packets of the AudioQueue buffers from the source format.
+- (void)audioQueueBufferSizeWithMaxPacketSize:(UInt32)maxPacketSize;
 
 @end
 
@@ -153,9 +470,13 @@ static void audioQueueIsRunningCallback(void *inClientData, AudioQueueRef inAQ,
 static void audioQueueInputCallback(void *inClientData, AudioQueueRef inAQ, AudioQueueBufferRef buffer) {
     StreamPlayer *player = (__bridge StreamPlayer *)inClientData;
 
-    dispatch_async(player.processQueue, ^{
-        [player audioDecodePacketWithBuffer:buffer];
-    });
+    // Hand over the buffer to the processQueue without allocating: the dispatch source coalesces
+    // the wake-ups and audioReclaimBuffers collects every buffer that was pushed.
+    AudioBufferRing_t *ring = player.audioBufferRing;
+    dispatch_source_t source = player.audioBufferSource;
+    if (ring && source && audioBufferRingPush(ring, buffer)) {
+        dispatch_source_merge_data(source, 1);
+    }
 }
 
 //
@@ -167,8 +488,8 @@ static void audioQueueInputCallback(void *inClientData, AudioQueueRef inAQ, Audi
 
 @implementation StreamPlayer
 
-- (nonnull instancetype)initWithIdent:(int64_t)ident size:(int64_t)size video:(BOOL)video call:(nonnull CallState *)call connection:(nullable CallConnection *)connection streamer:(nullable Streamer *)streamer {
-    DDLogVerbose(@"%@ initWithIdent: %lld size: %lld video: %d connection: %@ streamer: %@", LOG_TAG, ident, size, video, connection, streamer);
+- (nonnull instancetype)initWithIdent:(int64_t)ident size:(int64_t)size packetCount:(int64_t)packetCount video:(BOOL)video call:(nonnull CallState *)call connection:(nullable CallConnection *)connection streamer:(nullable Streamer *)streamer {
+    DDLogVerbose(@"%@ initWithIdent: %lld size: %lld packetCount: %lld video: %d connection: %@ streamer: %@", LOG_TAG, ident, size, packetCount, video, connection, streamer);
 
     self = [super init];
     if (self) {
@@ -180,21 +501,60 @@ static void audioQueueInputCallback(void *inClientData, AudioQueueRef inAQ, Audi
         _processQueue = dispatch_queue_create("streamQueue", attr);
         dispatch_queue_set_specific(_processQueue, _processQueueTag, _processQueueTag, NULL);
         _size = size;
+        _packetCount = packetCount;
+        _dataPacketCount = packetCount > 0 ? (UInt64)packetCount : 0;
         _video = video;
         _connection = connection;
         _streamer = streamer;
+        if (streamer) {
+            _stats = streamer.stats;
+            _peerStats = [_stats peerStatsWithId:nil];
+        } else {
+            _stats = [[StreamingStats alloc] initWithIdent:ident];
+            _peerStats = [_stats peerStatsWithId:[connection peerConnectionId]];
+        }
         _streamReadOffset = 0;
-        _streamReadAckOffset = 0;
+        _audioBlocks = [[StreamingReorderBuffer alloc] init];
+        _pendingBlocks = [[NSMutableDictionary alloc] init];
+        _parityBlocks = [[NSMutableDictionary alloc] init];
+        _parityBlockOrder = [[NSMutableArray alloc] init];
+        _packetIndex = [[NSMutableData alloc] init];
+        _packetNumber = 0;
+        _packetBytes = 0;
+        _positionBase = 0;
+        _positionSampleTime = 0;
+        _positionResync = NO;
         _lastRTT = 0;
+        _windowSize = STREAM_INITIAL_WINDOW_SIZE;
+        _drainRate = 0;
+        _drainBytes = 0;
+        _drainStartTime = 0;
+        _lastUnderrunTime = 0;
         _lastStreamerPosition = 0;
         _lastStreamerPositionTime = 0;
+        _clock = [[StreamingClock alloc] init];
+        _videoLoadingRequests = [[NSMutableArray alloc] init];
+        _videoRequestedRanges = [[NSMutableIndexSet alloc] init];
+        _timePitchEnabled = NO;
+        _playRate = 1.0;
         _audioReadPendingSize = 0;
         _endOfStream = NO;
+        // The local streamer and the peers with the "stream-eof" capability tell us the last block,
+        // we guess it from the block size only with older peers.
+        _exactEnd = size > 0 || streamer != nil || [connection isStreamingEndSupported];
+        _streamEndOffset = size > 0 ? size : -1;
         _discontinuous = NO;
         _audioQueueBufferIndex = 0;
+        _audioQueueBufferSize = OUTPUT_BUFFER_SIZE;
+        _audioQueueBufferPackets = 32;
         _audioQueueState = AudioQueueStateIdle;
         _audioSessionActive = NO;
         _audioQueueBuffer = (AudioQueueBufferRef *)calloc(AUDIO_QUEUE_BUFFER_COUNT, sizeof(AudioQueueBufferRef));
+        _packetRing = (AudioPacketRing_t *)calloc(1, sizeof(AudioPacketRing_t));
+        _audioBufferRing = (AudioBufferRing_t *)calloc(1, sizeof(AudioBufferRing_t));
+        if (!audioPacketRingResize(_packetRing, AUDIO_PACKET_RING_SIZE, AUDIO_PACKET_RING_COUNT)) {
+            DDLogError(@"%@ cannot allocate the audio packet ring", LOG_TAG);
+        }
         _dstFormat.mSampleRate = 44100; // Use same WebRTC sample rate ?
         _dstFormat.mFormatID = kAudioFormatLinearPCM;
         _dstFormat.mFormatFlags = kLinearPCMFormatFlagIsSignedInteger | kAudioFormatFlagIsPacked;
@@ -210,31 +570,77 @@ static void audioQueueInputCallback(void *inClientData, AudioQueueRef inAQ, Audi
 - (void)start {
     DDLogVerbose(@"%@ start", LOG_TAG);
 
+    if (self.video) {
+        dispatch_async(self.processQueue, ^{
+            [self videoStart];
+        });
+        return;
+    }
+
     AudioFileStreamID audioFileStream = 0;
     OSStatus result = AudioFileStreamOpen((__bridge void *)self, audioPropertyValueCallback, audioStreamDataCallback, 0, &audioFileStream);
 
     DDLogVerbose(@"%@ opened audio file stream: %d", LOG_TAG, result);
     self.audioFileStream = audioFileStream;
+
+    __weak StreamPlayer *weakSelf = self;
+    self.audioBufferSource = dispatch_source_create(DISPATCH_SOURCE_TYPE_DATA_ADD, 0, 0, self.processQueue);
+    dispatch_source_set_event_handler(self.audioBufferSource, ^{
+        [weakSelf audioReclaimBuffers];
+    });
+    dispatch_resume(self.audioBufferSource);
     self.streamReadOffset = 0;
-    self.streamReadAckOffset = 0;
+    [self.audioBlocks resetWithOffset:0];
     self.endOfStream = NO;
 
     // Ask the first buffers to the peer.
     dispatch_async(self.processQueue, ^{
-        int64_t offset = 0;
-        while (offset < STREAM_BUFFER_QUEUE_SIZE) {
-            [self sendStreamRequestWithOffset:offset length:STREAM_BUFFER_SIZE];
-            offset += STREAM_BUFFER_SIZE;
+        [self requestFillBuffers];
+    });
+}
+
+- (void)prefetch {
+    DDLogVerbose(@"%@ prefetch", LOG_TAG);
+
+    dispatch_async(self.processQueue, ^{
+        self.prefetching = YES;
+    });
+    [self start];
+}
+
+- (void)startPlayback {
+    DDLogVerbose(@"%@ startPlayback", LOG_TAG);
+
+    dispatch_async(self.processQueue, ^{
+        if (!self.prefetching) {
+            return;
+        }
+        self.prefetching = NO;
+        if (self.videoPlayer) {
+            [self.videoPlayer play];
+            [self updateQueueWithState:AudioQueueStateRunning notify:true];
+            return;
+        }
+        if (self.audioQueueState != AudioQueueStateReady) {
+            return;
+        }
+
+        // Start the queue with the buffers that were prefetched or wait for the first ones.
+        if (self.audioQueueBufferIndex < AUDIO_QUEUE_BUFFER_COUNT - 1) {
+            OSStatus err = AudioQueueStart(self.audioQueue, nil);
+            DDLogVerbose(@"%@AudioQueueStart result: %d", LOG_TAG, err);
+            [self updateQueueWithState:err ? AudioQueueStateError : AudioQueueStateRunning notify:true];
+        } else {
+            [self audioDecodePackets];
         }
-        self.streamReadOffset = offset;
     });
 }
 
 - (void)sendStreamRequestWithOffset:(int64_t)offset length:(int64_t)length {
     DDLogVerbose(@"%@ sendStreamRequestWithOffset: %lld", LOG_TAG, offset);
 
+    int64_t now = [[NSDate date] timeIntervalSince1970] * 1000;
     if (self.connection) {
-        int64_t now = [[NSDate date] timeIntervalSince1970] * 1000;
         int64_t playerPosition = [self playerPosition];
 
         int64_t deltaPosition;
@@ -245,14 +651,20 @@ static void audioQueueInputCallback(void *inClientData, AudioQueueRef inAQ, Audi
             deltaPosition = 0;
         }
         DDLogVerbose(@"%@ sendStreamRequest: offset: %lld pos: %lld streamer: %lld delta: %lldd", LOG_TAG, offset, playerPosition, self.lastStreamerPosition, deltaPosition);
+        [self.peerStats updateWithQueueDepth:self.audioReadPendingSize drift:deltaPosition];
+        [self.peerStats recordRequest];
 
         StreamingRequestIQ *requestIQ = [[StreamingRequestIQ alloc] initWithSerializer:[CallConnection STREAMING_REQUEST_SERIALIZER] requestId:[self.call allocateRequestId] ident:self.ident offset:offset length:length playerPosition:playerPosition timestamp:now lastRTT:self.lastRTT];
         
-        [self.connection sendMessageWithIQ:requestIQ statType:TLPeerConnectionServiceStatTypeIqSetPushObject];
+        [self.connection sendStreamingIQ:requestIQ];
 
     } else if (self.streamer) {
+        [self.peerStats updateWithQueueDepth:self.audioReadPendingSize drift:0];
+        [self.peerStats recordRequest];
         [self.streamer readAsyncBlockWithOffset:offset length:length withBlock:^(NSData *data) {
-            [self writeWithData:data offset:offset];
+            [self.peerStats recordWithBytes:data.length latency:[[NSDate date] timeIntervalSince1970] * 1000 - now];
+            // The streamer gives less than what we asked only at the end of the stream.
+            [self writeWithData:data offset:offset endOfStream:(int64_t)data.length < length];
         }];
     }
 }
@@ -266,7 +678,7 @@ static void audioQueueInputCallback(void *inClientData, AudioQueueRef inAQ, Audi
         int latency = self.lastRTT / 2;
         StreamingControlIQ *requestIQ = [[StreamingControlIQ alloc] initWithSerializer:[CallConnection STREAMING_CONTROL_SERIALIZER] requestId:[self.call allocateRequestId] ident:self.ident mode:mode length:offset timestamp:now position:position latency:latency];
         
-        [self.connection sendMessageWithIQ:requestIQ statType:TLPeerConnectionServiceStatTypeIqSetPushObject];
+        [self.connection sendStreamingIQ:requestIQ];
         switch (mode) {
             case StreamingControlModeStatusPlaying:
                 [self.call onStreamingEventWithParticipant:[self.connection mainParticipant] event:StreamingEventPlaying];
@@ -313,9 +725,14 @@ static void audioQueueInputCallback(void *inClientData, AudioQueueRef inAQ, Audi
 
     dispatch_after(delay, self.processQueue, ^{
         // Check the audioQueue still exist because it could have been deleted while we wait.
-        if (self.audioQueue) {
+        if (self.audioQueue || self.videoPlayer) {
             DDLogVerbose(@"%@ calling AudioQueuePause", LOG_TAG);
-            AudioQueuePause(self.audioQueue);
+            if (self.videoPlayer) {
+                [self.videoPlayer pause];
+            } else {
+                AudioQueuePause(self.audioQueue);
+            }
+            [self.clock reset];
             if (self.connection) {
                 [self.call onStreamingEventWithParticipant:[self.connection mainParticipant] event:StreamingEventPaused];
                 [self sendStreamControlWithMode:StreamingControlModeStatusPaused offset:0];
@@ -337,9 +754,14 @@ static void audioQueueInputCallback(void *inClientData, AudioQueueRef inAQ, Audi
 
     dispatch_after(delay, self.processQueue, ^{
         // Check the audioQueue still exist because it could have been deleted while we wait.
-        if (self.audioQueue) {
+        if (self.audioQueue || self.videoPlayer) {
             DDLogVerbose(@"%@ calling AudioQueueStart", LOG_TAG);
-            AudioQueueStart(self.audioQueue, NULL);
+            if (self.videoPlayer) {
+                [self.videoPlayer play];
+            } else {
+                AudioQueueStart(self.audioQueue, NULL);
+            }
+            [self.clock reset];
             if (self.connection) {
                 [self.call onStreamingEventWithParticipant:[self.connection mainParticipant] event:StreamingEventPlaying];
                 [self sendStreamControlWithMode:StreamingControlModeStatusPlaying offset:0];
@@ -349,7 +771,17 @@ static void audioQueueInputCallback(void *inClientData, AudioQueueRef inAQ, Audi
 }
 
 - (void)seekWithPosition:(int64_t)position {
-    
+    DDLogVerbose(@"%@ seekWithPosition: %lld", LOG_TAG, position);
+
+    dispatch_async(self.processQueue, ^{
+        if (self.videoPlayer) {
+            // AVPlayer seeks on a keyframe and then asks for the ranges from that keyframe.
+            [self.clock reset];
+            [self.videoPlayer seekToTime:CMTimeMake(position, 1000)];
+        } else {
+            [self audioSeekWithPosition:position];
+        }
+    });
 }
 
 - (void)askPause {
@@ -383,6 +815,11 @@ static void audioQueueInputCallback(void *inClientData, AudioQueueRef inAQ, Audi
     // sample time from the source point of view (ie, 44100).  The AudioQueue itself can run
     // at a different output rate (48000).
     // Make sure we have a valid sample rate.
+    AVPlayer *videoPlayer = self.videoPlayer;
+    if (videoPlayer) {
+        CMTime time = [videoPlayer currentTime];
+        return CMTIME_IS_NUMERIC(time) ? (int64_t)(CMTimeGetSeconds(time) * 1000.0) : 0;
+    }
     Float64 sampleRate = self.srcFormat.mSampleRate;
     if (sampleRate <= 1.0) {
         return 0;
@@ -395,10 +832,15 @@ static void audioQueueInputCallback(void *inClientData, AudioQueueRef inAQ, Audi
 
     OSStatus err = AudioQueueGetCurrentTime(self.audioQueue, NULL, &queueTime, &discontinuity);
     if (err) {
-        return 0;
+        return self.positionBase;
     }
 
-    return (int64_t) (queueTime.mSampleTime / sampleRate * 1000.0);
+    // After a seek, the AudioQueue timeline is not reset: positionSampleTime is the sample time
+    // at which we enqueued the first buffer for the positionBase.
+    if (self.positionResync || queueTime.mSampleTime < self.positionSampleTime) {
+        return self.positionBase;
+    }
+    return self.positionBase + (int64_t) ((queueTime.mSampleTime - self.positionSampleTime) / sampleRate * 1000.0);
 }
 
 - (void)updateQueueWithState:(AudioQueueState)state notify:(BOOL)notify {
@@ -462,9 +904,28 @@ static void audioQueueInputCallback(void *inClientData, AudioQueueRef inAQ, Audi
 
     dispatch_async(self.processQueue, ^{
         self.audioQueueState = AudioQueueStateDeleted;
+        if (self.videoPlayer) {
+            [self.videoPlayer pause];
+            [self.videoPlayer replaceCurrentItemWithPlayerItem:nil];
+            self.videoPlayer = nil;
+        }
+        if (self.videoEndObserver) {
+            [[NSNotificationCenter defaultCenter] removeObserver:self.videoEndObserver];
+            self.videoEndObserver = nil;
+        }
+        for (AVAssetResourceLoadingRequest *loadingRequest in self.videoLoadingRequests) {
+            [loadingRequest finishLoadingWithError:[NSError errorWithDomain:NSURLErrorDomain code:NSURLErrorCancelled userInfo:nil]];
+        }
+        [self.videoLoadingRequests removeAllObjects];
+        [self.pendingBlocks removeAllObjects];
+        [self.audioBlocks resetWithOffset:0];
         AudioQueueFlush(self.audioQueue);
         AudioQueueRemovePropertyListener(self.audioQueue, kAudioQueueProperty_IsRunning, audioQueueIsRunningCallback, (__bridge void *)self);
         AudioQueueStop(self.audioQueue, YES);
+        if (self.audioBufferSource) {
+            dispatch_source_cancel(self.audioBufferSource);
+            self.audioBufferSource = nil;
+        }
         if (self.audioFileStream) {
             AudioFileStreamClose(self.audioFileStream);
             self.audioFileStream = 0;
@@ -474,19 +935,19 @@ static void audioQueueInputCallback(void *inClientData, AudioQueueRef inAQ, Audi
         free(self.audioQueueBuffer);
 
         // Free the audio packets if they are not consumed.
-        AudioPacket_t *packet = self.firstPacket;
-        while (packet) {
-            AudioPacket_t *next = packet->next;
-            free(packet);
-            packet = next;
-        }
+        audioPacketRingFree(self.packetRing);
+        free(self.packetRing);
 
-        self.firstPacket = 0;
+        self.packetRing = 0;
         self.audioQueueBuffer = 0;
         self.processQueue = nil;
 
         AudioQueueDispose(self.audioQueue, YES);
         self.audioQueue = 0;
+
+        // The AudioQueue callback can no longer be called.
+        free(self.audioBufferRing);
+        self.audioBufferRing = 0;
     });
 
     [self updateQueueWithState:AudioQueueStateIdle notify:notify];
@@ -535,23 +996,108 @@ static void audioQueueInputCallback(void *inClientData, AudioQueueRef inAQ, Audi
     if (requestTime > 0 && requestTime - (int64_t)iq.streamerLatency < MAX_RTT_TIME) {
         self.lastRTT = (int) requestTime - iq.streamerLatency;
     }
+    [self.peerStats recordWithBytes:iq.data.length latency:requestTime];
     
     self.lastStreamerPosition = iq.streamerPosition;
     self.lastStreamerPositionTime = now;
+
+    // The streamer position was taken when the data was sent: it is now ahead by the one-way delay.
+    int64_t roundTrip = requestTime - (int64_t)iq.streamerLatency;
+    if (!self.paused && requestTime > 0 && roundTrip >= 0 && roundTrip < MAX_RTT_TIME) {
+        int64_t offset = [self playerPosition] - (iq.streamerPosition + roundTrip / 2);
+        [self.clock addSampleWithOffset:offset roundTrip:roundTrip time:now];
+        dispatch_async(self.processQueue, ^{
+            [self updatePlayRateWithTime:now];
+        });
+    }
     
-    [self writeWithData:iq.data offset:iq.offset];
+    [self writeWithData:iq.data offset:iq.offset endOfStream:iq.endOfStream];
 }
 
-- (void)writeWithData:(nullable NSData *)data offset:(int64_t)offset {
-    DDLogVerbose(@"%@ writeWithData: offset: %lld", LOG_TAG, offset);
+- (void)writeWithData:(nullable NSData *)data offset:(int64_t)offset endOfStream:(BOOL)endOfStream {
+    DDLogVerbose(@"%@ writeWithData: offset: %lld endOfStream: %d", LOG_TAG, offset, endOfStream);
 
-    self.endOfStream = data.length < STREAM_BUFFER_SIZE;
-    if (data.length > 0) {
-        // Take into account the new data block from the process queue
-        // (current thread is the WebRTC signaling thread).
-        dispatch_async(self.processQueue, ^{
-            [self audioWriteWithData:data offset:offset];
-        });
+    // Take into account the new data block from the process queue (current thread is the WebRTC
+    // signaling thread).  An empty block is also passed because it marks the end of the stream.
+    NSData *block = data ? data : [NSData data];
+    dispatch_async(self.processQueue, ^{
+        if (endOfStream) {
+            self.streamEndOffset = offset + (int64_t)block.length;
+        }
+        if (self.connection && block.length > 0 && STREAMING_PARITY_GROUP_SIZE > 0 && [self.connection isStreamingParitySupported]) {
+            [self parityKeepWithData:block offset:offset];
+        }
+        if (self.video) {
+            [self videoWriteWithData:block offset:offset];
+        } else {
+            [self audioWriteWithData:block offset:offset];
+        }
+    });
+}
+
+- (void)onStreamingParityWithIQ:(nonnull StreamingParityIQ *)iq {
+    DDLogVerbose(@"%@ onStreamingParityWithIQ: %@ count: %lu", LOG_TAG, iq, (unsigned long)iq.offsets.count);
+
+    dispatch_async(self.processQueue, ^{
+        [self parityRecoverWithIQ:iq];
+    });
+}
+
+- (void)parityKeepWithData:(nonnull NSData *)data offset:(int64_t)offset {
+    DDLogVerbose(@"%@ parityKeepWithData: offset: %lld", LOG_TAG, offset);
+
+    NSAssert(dispatch_get_specific(self.processQueueTag), @"Invoked on incorrect queue");
+
+    NSNumber *key = [NSNumber numberWithLongLong:offset];
+    if (!self.parityBlocks[key]) {
+        [self.parityBlockOrder addObject:key];
+    }
+    self.parityBlocks[key] = data;
+    while (self.parityBlockOrder.count > STREAM_PARITY_KEEP_BLOCKS) {
+        [self.parityBlocks removeObjectForKey:self.parityBlockOrder[0]];
+        [self.parityBlockOrder removeObjectAtIndex:0];
+    }
+}
+
+- (void)parityRecoverWithIQ:(nonnull StreamingParityIQ *)iq {
+    DDLogVerbose(@"%@ parityRecoverWithIQ: %@", LOG_TAG, iq);
+
+    NSAssert(dispatch_get_specific(self.processQueueTag), @"Invoked on incorrect queue");
+
+    if (self.audioQueueState == AudioQueueStateDeleted || iq.offsets.count != iq.lengths.count) {
+        return;
+    }
+
+    // XOR parity can rebuild only one block: if several are missing we must wait for them.
+    NSMutableArray<NSData *> *blocks = [[NSMutableArray alloc] initWithCapacity:iq.offsets.count];
+    NSInteger missing = -1;
+    for (NSUInteger i = 0; i < iq.offsets.count; i++) {
+        NSData *block = self.parityBlocks[iq.offsets[i]];
+        if (block) {
+            [blocks addObject:block];
+        } else if (missing >= 0) {
+            return;
+        } else {
+            missing = (NSInteger)i;
+        }
+    }
+    if (missing < 0) {
+        return;
+    }
+
+    int64_t offset = iq.offsets[missing].longLongValue;
+    NSData *block = [iq recoverBlockAtIndex:missing blocks:blocks];
+    DDLogInfo(@"%@ rebuilt block at offset %lld length %lu with parity", LOG_TAG, offset, (unsigned long)block.length);
+
+    // The end of stream flag of the lost block is not known: it is the last one if it is short.
+    if (self.streamEndOffset < 0 && block.length < STREAM_BUFFER_SIZE) {
+        self.streamEndOffset = offset + (int64_t)block.length;
+    }
+    [self parityKeepWithData:block offset:offset];
+    if (self.video) {
+        [self videoWriteWithData:block offset:offset];
+    } else {
+        [self audioWriteWithData:block offset:offset];
     }
 }
 
@@ -564,46 +1110,474 @@ static void audioQueueInputCallback(void *inClientData, AudioQueueRef inAQ, Audi
     _duration = duration;
 }
 
+#pragma mark - AVAssetResourceLoaderDelegate
+
+- (BOOL)resourceLoader:(AVAssetResourceLoader *)resourceLoader shouldWaitForLoadingOfRequestedResource:(AVAssetResourceLoadingRequest *)loadingRequest {
+    DDLogVerbose(@"%@ resourceLoader: %@ shouldWaitForLoadingOfRequestedResource: %@", LOG_TAG, resourceLoader, loadingRequest);
+
+    int64_t size = self.streamer ? [self.streamer streamSize] : self.size;
+    if (size <= 0 || self.audioQueueState == AudioQueueStateDeleted) {
+        return NO;
+    }
+
+    AVAssetResourceLoadingContentInformationRequest *contentInformationRequest = loadingRequest.contentInformationRequest;
+    if (contentInformationRequest) {
+        contentInformationRequest.contentType = AVFileTypeMPEG4;
+        contentInformationRequest.contentLength = size;
+        contentInformationRequest.byteRangeAccessSupported = YES;
+    }
+    if (!loadingRequest.dataRequest) {
+        [loadingRequest finishLoading];
+        return YES;
+    }
+
+    [self.videoLoadingRequests addObject:loadingRequest];
+    [self videoProcessLoadingRequests];
+    return YES;
+}
+
+- (void)resourceLoader:(AVAssetResourceLoader *)resourceLoader didCancelLoadingRequest:(AVAssetResourceLoadingRequest *)loadingRequest {
+    DDLogVerbose(@"%@ resourceLoader: %@ didCancelLoadingRequest: %@", LOG_TAG, resourceLoader, loadingRequest);
+
+    [self.videoLoadingRequests removeObject:loadingRequest];
+    [self videoProcessLoadingRequests];
+}
+
 #pragma mark - Internal
 
+- (void)videoStart {
+    DDLogVerbose(@"%@ videoStart", LOG_TAG);
+
+    NSAssert(dispatch_get_specific(self.processQueueTag), @"Invoked on incorrect queue");
+
+    // Use our own scheme so that AVPlayer asks the data to the resource loader delegate.
+    NSURL *url = [NSURL URLWithString:[NSString stringWithFormat:@"%@://%lld/stream.mp4", STREAM_VIDEO_SCHEME, self.ident]];
+    AVURLAsset *asset = [AVURLAsset URLAssetWithURL:url options:nil];
+    [asset.resourceLoader setDelegate:self queue:self.processQueue];
+
+    AVPlayerItem *playerItem = [AVPlayerItem playerItemWithAsset:asset];
+    self.videoPlayer = [AVPlayer playerWithPlayerItem:playerItem];
+    self.videoEndObserver = [[NSNotificationCenter defaultCenter] addObserverForName:AVPlayerItemDidPlayToEndTimeNotification object:playerItem queue:nil usingBlock:^(NSNotification *notification) {
+        dispatch_async(self.processQueue, ^{
+            if (self.audioQueueState != AudioQueueStateDeleted) {
+                [self updateQueueWithState:AudioQueueStateCompleted notify:true];
+            }
+        });
+    }];
+
+    if (!self.prefetching) {
+        [self.videoPlayer play];
+        [self updateQueueWithState:AudioQueueStateRunning notify:true];
+    }
+}
+
+- (void)videoWriteWithData:(nonnull NSData *)data offset:(int64_t)offset {
+    DDLogVerbose(@"%@ videoWriteWithData: offset: %lld length: %lu", LOG_TAG, offset, data.length);
+
+    NSAssert(dispatch_get_specific(self.processQueueTag), @"Invoked on incorrect queue");
+
+    if (data.length == 0 || self.audioQueueState == AudioQueueStateDeleted) {
+        return;
+    }
+
+    self.pendingBlocks[[NSNumber numberWithLongLong:offset]] = data;
+    [self videoProcessLoadingRequests];
+}
+
+- (int64_t)videoEndWithDataRequest:(nonnull AVAssetResourceLoadingDataRequest *)dataRequest {
+
+    int64_t size = self.streamer ? [self.streamer streamSize] : self.size;
+    if (dataRequest.requestsAllDataToEndOfResource) {
+        return size;
+    }
+    return MIN(size, dataRequest.requestedOffset + (int64_t)dataRequest.requestedLength);
+}
+
+- (void)videoProcessLoadingRequests {
+    DDLogVerbose(@"%@ videoProcessLoadingRequests", LOG_TAG);
+
+    NSAssert(dispatch_get_specific(self.processQueueTag), @"Invoked on incorrect queue");
+
+    // Give the blocks we have to the loading requests, a request can be satisfied by several blocks.
+    NSMutableArray<AVAssetResourceLoadingRequest *> *finished = [[NSMutableArray alloc] init];
+    for (AVAssetResourceLoadingRequest *loadingRequest in self.videoLoadingRequests) {
+        AVAssetResourceLoadingDataRequest *dataRequest = loadingRequest.dataRequest;
+        int64_t end = [self videoEndWithDataRequest:dataRequest];
+        BOOL progress = YES;
+        while (progress && dataRequest.currentOffset < end) {
+            progress = NO;
+            int64_t current = dataRequest.currentOffset;
+            for (NSNumber *key in self.pendingBlocks) {
+                int64_t start = key.longLongValue;
+                NSData *block = self.pendingBlocks[key];
+                if (start <= current && current < start + (int64_t)block.length) {
+                    int64_t last = MIN(end, start + (int64_t)block.length);
+                    [dataRequest respondWithData:[block subdataWithRange:NSMakeRange((NSUInteger)(current - start), (NSUInteger)(last - current))]];
+                    progress = YES;
+                    break;
+                }
+            }
+        }
+        if (dataRequest.currentOffset >= end) {
+            [loadingRequest finishLoading];
+            [finished addObject:loadingRequest];
+        }
+    }
+    [self.videoLoadingRequests removeObjectsInArray:finished];
+
+    // Drop the blocks that the loading requests don't need when we hold too much data:
+    // they are requested again if AVPlayer asks for them later.
+    int64_t total = 0;
+    for (NSNumber *key in self.pendingBlocks) {
+        total += self.pendingBlocks[key].length;
+    }
+    if (total > STREAM_VIDEO_WINDOW_SIZE) {
+        NSMutableArray<NSNumber *> *unused = [[NSMutableArray alloc] init];
+        for (NSNumber *key in self.pendingBlocks) {
+            int64_t start = key.longLongValue;
+            int64_t blockEnd = start + (int64_t)self.pendingBlocks[key].length;
+            BOOL needed = NO;
+            for (AVAssetResourceLoadingRequest *loadingRequest in self.videoLoadingRequests) {
+                if (loadingRequest.dataRequest.currentOffset < blockEnd && [self videoEndWithDataRequest:loadingRequest.dataRequest] > start) {
+                    needed = YES;
+                    break;
+                }
+            }
+            if (!needed) {
+                [unused addObject:key];
+                [self.videoRequestedRanges removeIndexesInRange:NSMakeRange((NSUInteger)start, (NSUInteger)(blockEnd - start))];
+            }
+        }
+        [self.pendingBlocks removeObjectsForKeys:unused];
+    }
+
+    // Request what is missing in the window ahead of each loading request, the range at the current
+    // offset first since this is where AVPlayer is reading (after a seek, it starts on a keyframe).
+    int64_t maxRequestSize = [self maxRequestSize];
+    for (AVAssetResourceLoadingRequest *loadingRequest in self.videoLoadingRequests) {
+        AVAssetResourceLoadingDataRequest *dataRequest = loadingRequest.dataRequest;
+        int64_t current = dataRequest.currentOffset;
+        int64_t limit = MIN([self videoEndWithDataRequest:dataRequest], current + STREAM_VIDEO_WINDOW_SIZE);
+        if (current >= limit) {
+            continue;
+        }
+
+        NSMutableArray<NSValue *> *gaps = [[NSMutableArray alloc] init];
+        __block int64_t pos = current;
+        [self.videoRequestedRanges enumerateRangesInRange:NSMakeRange((NSUInteger)current, (NSUInteger)(limit - current)) options:0 usingBlock:^(NSRange range, BOOL *stop) {
+            if ((int64_t)range.location > pos) {
+                [gaps addObject:[NSValue valueWithRange:NSMakeRange((NSUInteger)pos, range.location - (NSUInteger)pos)]];
+            }
+            pos = MAX(pos, (int64_t)NSMaxRange(range));
+        }];
+        if (pos < limit) {
+            [gaps addObject:[NSValue valueWithRange:NSMakeRange((NSUInteger)pos, (NSUInteger)(limit - pos))]];
+        }
+
+        for (NSValue *gap in gaps) {
+            NSRange range = gap.rangeValue;
+            [self.videoRequestedRanges addIndexesInRange:range];
+            int64_t offset = range.location;
+            int64_t missing = range.length;
+            while (missing > 0) {
+                int64_t length = MIN(missing, maxRequestSize);
+                [self sendStreamRequestWithOffset:offset length:length];
+                offset += length;
+                missing -= length;
+            }
+        }
+    }
+}
+
 - (void)audioWriteWithData:(nonnull NSData *)data offset:(int64_t)offset {
     DDLogVerbose(@"%@ audioWriteWithData: offset: %lld length: %lu", LOG_TAG, offset, data.length);
 
     NSAssert(dispatch_get_specific(self.processQueueTag), @"Invoked on incorrect queue");
 
-    if (self.streamReadAckOffset < offset + data.length) {
-        self.streamReadAckOffset = offset + data.length;
+    // The streamer reads the blocks in parallel and they can be received out of order: keep them
+    // until we get the missing part.  A block that we don't expect anymore was requested before a seek.
+    if (![self.audioBlocks addWithData:data offset:offset limit:self.streamReadOffset]) {
+        DDLogVerbose(@"%@ dropping block at offset %lld", LOG_TAG, offset);
+        return;
     }
 
-    OSStatus result = AudioFileStreamParseBytes(self.audioFileStream, (UInt32) data.length, data.bytes, self.discontinuous ? kAudioFileStreamParseFlag_Discontinuity : 0);
-    if (result) {
-        DDLogError(@"%@ AudioFileStreamParseBytes: %d", LOG_TAG, result);
-        [self updateQueueWithState:AudioQueueStateError notify:true];
-        return;
+    int64_t readOffset = self.streamReadAckOffset;
+    int64_t blockOffset;
+    NSData *block;
+    while ((block = [self.audioBlocks popWithOffset:&blockOffset])) {
+        if (self.streamEndOffset >= 0) {
+            self.endOfStream = blockOffset + (int64_t)block.length >= self.streamEndOffset;
+        } else if (!self.exactEnd) {
+            // An older streamer does not tell the end: a block smaller than STREAM_BUFFER_SIZE is the last one.
+            self.endOfStream = block.length < STREAM_BUFFER_SIZE;
+        }
+
+        // The block can overlap what we already parsed if it was requested before a seek.
+        int64_t skip = readOffset - blockOffset;
+        if (skip > 0) {
+            block = [block subdataWithRange:NSMakeRange((NSUInteger)skip, block.length - (NSUInteger)skip)];
+        }
+        readOffset = self.streamReadAckOffset;
+        if (block.length == 0) {
+            continue;
+        }
+
+        OSStatus result = AudioFileStreamParseBytes(self.audioFileStream, (UInt32) block.length, block.bytes, self.discontinuous ? kAudioFileStreamParseFlag_Discontinuity : 0);
+        if (result) {
+            DDLogError(@"%@ AudioFileStreamParseBytes: %d", LOG_TAG, result);
+            [self updateQueueWithState:AudioQueueStateError notify:true];
+            return;
+        }
     }
 
     if (self.audioQueueState != AudioQueueStatePaused) {
+        [self updateWindowWithUnderrun:NO];
         [self requestFillBuffers];
     }
 }
 
+- (int64_t)streamReadAckOffset {
+
+    return self.audioBlocks.readOffset;
+}
+
+- (void)audioSeekWithPosition:(int64_t)position {
+    DDLogVerbose(@"%@ audioSeekWithPosition: %lld", LOG_TAG, position);
+
+    NSAssert(dispatch_get_specific(self.processQueueTag), @"Invoked on incorrect queue");
+
+    if (!self.audioQueue || !self.audioFileStream || !self.packetRing || self.audioQueueState == AudioQueueStateDeleted) {
+        return;
+    }
+
+    int64_t packet, offset;
+    if (![self audioSeekOffsetWithPosition:position packet:&packet offset:&offset]) {
+        DDLogWarn(@"%@ cannot seek to %lld", LOG_TAG, position);
+        return;
+    }
+
+    // Flush what is queued: the AudioQueue gives back the buffers through audioQueueInputCallback
+    // and they will be filled with the new packets (the audio queue is not stopped).
+    OSStatus err = AudioQueueReset(self.audioQueue);
+    if (err) {
+        DDLogError(@"%@ AudioQueueReset: %d", LOG_TAG, err);
+    }
+    audioPacketRingClear(self.packetRing);
+    self.audioReadPendingSize = 0;
+    self.drainStartTime = 0;
+
+    // Blocks received for the previous offsets are now dropped by audioWriteWithData.
+    self.streamReadOffset = self.dataOffset + offset;
+    [self.audioBlocks resetWithOffset:self.streamReadOffset];
+    self.packetNumber = packet;
+    self.packetBytes = offset;
+    self.positionBase = (int64_t)(packet * self.packetDuration * 1000.0);
+    self.positionResync = YES;
+    [self.clock reset];
+    self.endOfStream = NO;
+    self.discontinuous = YES;
+    if (self.audioQueueState == AudioQueueStateCompleted || self.audioQueueState == AudioQueueStateIdle) {
+        // The AudioQueue was stopped and its timeline starts again when it is restarted.
+        self.positionSampleTime = 0;
+        [self updateQueueWithState:AudioQueueStateReady notify:false];
+    }
+
+    DDLogVerbose(@"%@ seek to %lld: packet %lld at offset %lld", LOG_TAG, position, packet, self.streamReadOffset);
+
+    // Ask the full window at the new offset at once.
+    [self requestFillBuffers];
+}
+
+- (BOOL)audioSeekOffsetWithPosition:(int64_t)position packet:(nonnull int64_t *)packet offset:(nonnull int64_t *)offset {
+    DDLogVerbose(@"%@ audioSeekOffsetWithPosition: %lld", LOG_TAG, position);
+
+    if (self.packetDuration <= 0 || position < 0) {
+        return NO;
+    }
+
+    int64_t seekPacket = (int64_t)(position / (self.packetDuration * 1000.0));
+    if (self.dataPacketCount > 0 && seekPacket >= (int64_t)self.dataPacketCount) {
+        seekPacket = (int64_t)self.dataPacketCount - 1;
+    }
+
+    // The audio file stream knows the exact offset when the file has a packet table or constant packet
+    // sizes, it also needs to know the new packet to correctly parse the stream after the seek.
+    SInt64 seekOffset = 0;
+    AudioFileStreamSeekFlags flags = 0;
+    OSStatus err = AudioFileStreamSeek(self.audioFileStream, seekPacket, &seekOffset, &flags);
+    if (!err && !(flags & kAudioFileStreamSeekFlag_OffsetIsEstimated)) {
+        *packet = seekPacket;
+        *offset = seekOffset;
+        return YES;
+    }
+
+    // Otherwise, use our index of the packets that we have already parsed.
+    int64_t indexPos = seekPacket / STREAM_SEEK_INDEX_INTERVAL;
+    if (indexPos < (int64_t)(self.packetIndex.length / sizeof(int64_t))) {
+        const int64_t *index = (const int64_t *)self.packetIndex.bytes;
+        *packet = indexPos * STREAM_SEEK_INDEX_INTERVAL;
+        *offset = index[indexPos];
+        if (*packet != seekPacket) {
+            AudioFileStreamSeek(self.audioFileStream, *packet, &seekOffset, &flags);
+        }
+        return YES;
+    }
+
+    // Last resort, estimate the offset from the bitrate.
+    if (!err) {
+        *offset = seekOffset;
+    } else if (self.bitRate > 0) {
+        *offset = position * (int64_t)self.bitRate / 8000;
+    } else if (self.dataPacketCount > 0) {
+        *offset = (int64_t)(self.dataByteCount * seekPacket / self.dataPacketCount);
+    } else {
+        return NO;
+    }
+    if (self.dataByteCount > 0 && *offset >= (int64_t)self.dataByteCount) {
+        return NO;
+    }
+    *packet = seekPacket;
+    return YES;
+}
+
+- (void)updatePlayRateWithTime:(int64_t)now {
+    DDLogVerbose(@"%@ updatePlayRateWithTime: %lld", LOG_TAG, now);
+
+    NSAssert(dispatch_get_specific(self.processQueueTag), @"Invoked on incorrect queue");
+
+    if (!self.timePitchEnabled || !self.audioQueue || self.paused || self.audioQueueState != AudioQueueStateRunning
+        || self.clock.sampleCount < STREAM_SYNC_MIN_SAMPLES) {
+        return;
+    }
+
+    // A positive drift means we are ahead of the streamer and we must play slower.
+    // The skew (ms/s) is compensated even when the drift is within the deadband.
+    int64_t drift = [self.clock offsetWithTime:now];
+    double rate = 1.0 - self.clock.skew / 1000.0;
+    if (llabs(drift) > STREAM_SYNC_DEADBAND) {
+        rate -= (double)drift / STREAM_SYNC_CORRECTION_TIME;
+    }
+    rate = MAX(1.0 - STREAM_SYNC_MAX_RATE_DELTA, MIN(1.0 + STREAM_SYNC_MAX_RATE_DELTA, rate));
+    if (fabs(rate - self.playRate) < 0.001) {
+        return;
+    }
+
+    OSStatus err = AudioQueueSetParameter(self.audioQueue, kAudioQueueParam_PlayRate, (AudioQueueParameterValue)rate);
+    if (err) {
+        DDLogError(@"%@ AudioQueueSetParameter kAudioQueueParam_PlayRate: %d", LOG_TAG, err);
+        self.timePitchEnabled = NO;
+        return;
+    }
+    DDLogVerbose(@"%@ drift %lld ms skew %f play rate %f", LOG_TAG, drift, self.clock.skew, rate);
+    self.playRate = (Float32)rate;
+}
+
 - (void)requestFillBuffers {
     DDLogVerbose(@"%@ requestFillBuffers: %d stream: %lld", LOG_TAG, self.audioReadPendingSize, self.streamReadOffset - self.streamReadAckOffset);
 
     NSAssert(dispatch_get_specific(self.processQueueTag), @"Invoked on incorrect queue");
 
-    // Ask for more data blocks before we run out of packets for the AudioQueue.
-    long pendingRead = self.audioReadPendingSize - STREAM_MIN_BUFFER_QUEUE_SIZE;
+    // Ask for more data blocks before we run out of packets for the AudioQueue.  While an interactive
+    // stream plays on the connection, keep a small backlog of requests so that its blocks are not
+    // queued by the streamer behind ours.
+    int64_t windowSize = self.windowSize;
+    if (self.priority == StreamingPriorityBackground && [self.connection hasInteractiveStream]) {
+        windowSize = MIN(windowSize, STREAM_MIN_WINDOW_SIZE);
+    }
+    int64_t pendingRead = self.audioReadPendingSize - windowSize;
     int64_t offset = self.streamReadOffset;
     pendingRead += offset - self.streamReadAckOffset;
-    while (pendingRead < 0) {
-        [self sendStreamRequestWithOffset:offset length:STREAM_BUFFER_SIZE];
-        pendingRead += STREAM_BUFFER_SIZE;
-        offset = offset + STREAM_BUFFER_SIZE;
+    if (pendingRead >= 0) {
+        return;
+    }
+
+    // Coalesce the missing blocks in large requests: wait until we miss a quarter of the window
+    // (or a full request) so that we don't send a request for each block that was consumed.
+    int64_t maxRequestSize = [self maxRequestSize];
+    int64_t missing = ((-pendingRead + STREAM_BUFFER_SIZE - 1) / STREAM_BUFFER_SIZE) * STREAM_BUFFER_SIZE;
+
+    // When we know where the stream ends, ask exactly the tail and nothing after it.
+    BOOL tail = NO;
+    if (self.streamEndOffset >= 0) {
+        if (offset >= self.streamEndOffset) {
+            return;
+        }
+        if (missing >= self.streamEndOffset - offset) {
+            missing = self.streamEndOffset - offset;
+            tail = YES;
+        }
+    }
+    if (offset > 0 && !tail && missing < MIN(maxRequestSize, windowSize / 4)) {
+        return;
+    }
+    while (missing > 0) {
+        int64_t length = MIN(missing, maxRequestSize);
+        [self sendStreamRequestWithOffset:offset length:length];
+        missing -= length;
+        offset = offset + length;
         self.streamReadOffset = offset;
     }
 }
 
+- (int64_t)maxRequestSize {
+
+    if (self.connection) {
+        return [self.connection streamingMaxDataSize];
+    } else {
+        return STREAMING_DATA_MAX_SIZE;
+    }
+}
+
+- (void)updateWindowWithUnderrun:(BOOL)underrun {
+    DDLogVerbose(@"%@ updateWindowWithUnderrun: %d", LOG_TAG, underrun);
+
+    NSAssert(dispatch_get_specific(self.processQueueTag), @"Invoked on incorrect queue");
+
+    int64_t now = [[NSDate date] timeIntervalSince1970] * 1000;
+    int64_t windowSize = self.windowSize;
+    if (underrun) {
+        // We are late: grow quickly as the network could not keep up with the current window,
+        // but only once per RTT since the data we requested needs that time to arrive.
+        if (now - self.lastUnderrunTime < MAX(self.lastRTT, 100)) {
+            return;
+        }
+        self.lastUnderrunTime = now;
+        [self.peerStats recordUnderrun];
+        windowSize = 2 * windowSize;
+
+    } else {
+        if (self.drainStartTime == 0 || self.audioQueueState != AudioQueueStateRunning) {
+            self.drainStartTime = now;
+            self.drainBytes = 0;
+        } else if (now - self.drainStartTime >= STREAM_DRAIN_PERIOD) {
+            int64_t rate = (self.drainBytes * 1000) / (now - self.drainStartTime);
+            self.drainRate = (self.drainRate == 0) ? rate : (3 * self.drainRate + rate) / 4;
+            self.drainStartTime = now;
+            self.drainBytes = 0;
+        }
+
+        // Use the highest of the announced bitrate and the measured drain rate.
+        int64_t bytesPerSecond = MAX((int64_t)(self.bitRate / 8), self.drainRate);
+        if (bytesPerSecond == 0) {
+            return;
+        }
+
+        // Converge slowly to the target so that a single RTT sample does not shrink the window.
+        int64_t target = bytesPerSecond * (STREAM_WINDOW_RTT_FACTOR * (int64_t)self.lastRTT + STREAM_WINDOW_MARGIN_TIME) / 1000;
+        windowSize = windowSize + (target - windowSize) / 8;
+    }
+
+    if (windowSize < STREAM_MIN_WINDOW_SIZE) {
+        windowSize = STREAM_MIN_WINDOW_SIZE;
+    } else if (windowSize > STREAM_MAX_WINDOW_SIZE) {
+        windowSize = STREAM_MAX_WINDOW_SIZE;
+    }
+    if (windowSize != self.windowSize) {
+        DDLogVerbose(@"%@ read-ahead window %lld -> %lld (rtt: %d drain: %lld)", LOG_TAG, self.windowSize, windowSize, self.lastRTT, self.drainRate);
+        self.windowSize = windowSize;
+    }
+}
+
 - (void)audioPropertyValueWithPropertyID:(AudioFileStreamPropertyID)propertyID ioFlags:(UInt32 *)ioFlags {
     DDLogVerbose(@"%@ audioPropertyValueWithPropertyID: %u", LOG_TAG, propertyID);
 
@@ -669,7 +1643,7 @@ static void audioQueueInputCallback(void *inClientData, AudioQueueRef inAQ, Audi
             UInt32 byteCountSize = sizeof(dataByteCount);
             OSStatus err = AudioFileStreamGetProperty(self.audioFileStream, kAudioFileStreamProperty_AudioDataByteCount, &byteCountSize, &dataByteCount);
             if (err) {
-                self.dataByteCount = 0;
+                self.dataByteCount = self.size > self.dataOffset ? self.size - self.dataOffset : 0;
             } else {
                 self.dataByteCount = dataByteCount;
             }
@@ -683,7 +1657,8 @@ static void audioQueueInputCallback(void *inClientData, AudioQueueRef inAQ, Audi
             OSStatus err = AudioFileStreamGetProperty(self.audioFileStream, kAudioFileStreamProperty_AudioDataPacketCount, &packetCountSize, &dataPacketCount);
             DDLogVerbose(@"%@ got dataPacketCount error: %d", LOG_TAG, err);
             if (err) {
-                self.dataPacketCount = 0;
+                // The streamer counted the packets when the file does not give them (ADTS, MP3).
+                self.dataPacketCount = self.packetCount > 0 ? self.packetCount : 0;
             } else {
                 self.dataPacketCount = dataPacketCount;
             }
@@ -821,9 +1796,20 @@ static void audioQueueInputCallback(void *inClientData, AudioQueueRef inAQ, Audi
         }
     }
 
-    int maxPacketDescriptionCount = 32;
+    UInt32 maxPacketSize = 0;
+    size = sizeof(maxPacketSize);
+    err = AudioFileStreamGetProperty(self.audioFileStream, kAudioFileStreamProperty_PacketSizeUpperBound, &size, &maxPacketSize);
+    if (err || maxPacketSize == 0) {
+        size = sizeof(maxPacketSize);
+        err = AudioFileStreamGetProperty(self.audioFileStream, kAudioFileStreamProperty_MaximumPacketSize, &size, &maxPacketSize);
+        if (err) {
+            maxPacketSize = 0;
+        }
+    }
+    [self audioQueueBufferSizeWithMaxPacketSize:maxPacketSize];
+
     for (unsigned int i = 0; i < AUDIO_QUEUE_BUFFER_COUNT; ++i) {
-        err = AudioQueueAllocateBufferWithPacketDescriptions(self.audioQueue, OUTPUT_BUFFER_SIZE, maxPacketDescriptionCount, &self.audioQueueBuffer[i]);
+        err = AudioQueueAllocateBufferWithPacketDescriptions(self.audioQueue, self.audioQueueBufferSize, self.audioQueueBufferPackets, &self.audioQueueBuffer[i]);
         if (err) {
             (void)AudioQueueDispose(self.audioQueue, true);
             self.audioQueue = 0;
@@ -832,6 +1818,19 @@ static void audioQueueInputCallback(void *inClientData, AudioQueueRef inAQ, Audi
         }
     }
     
+    // The play rate of a remote player is changed to follow the streamer: this needs the time pitch
+    // algorithm which must be enabled before the queue is started.
+    if (self.connection) {
+        UInt32 enable = 1;
+        UInt32 algorithm = kAudioQueueTimePitchAlgorithm_Spectral;
+        if (AudioQueueSetProperty(self.audioQueue, kAudioQueueProperty_EnableTimePitch, &enable, sizeof(enable)) == noErr
+            && AudioQueueSetProperty(self.audioQueue, kAudioQueueProperty_TimePitchAlgorithm, &algorithm, sizeof(algorithm)) == noErr) {
+            self.timePitchEnabled = YES;
+        } else {
+            DDLogWarn(@"%@ cannot enable time pitch, drift correction is disabled", LOG_TAG);
+        }
+    }
+
     err = AudioQueueAddPropertyListener(self.audioQueue, kAudioQueueProperty_IsRunning, audioQueueIsRunningCallback, (__bridge void *)self);
     if (err) {
         DDLogError(@"%@error in AudioQueueAddPropertyListener: %d", LOG_TAG, err);
@@ -885,6 +1884,24 @@ static void audioQueueInputCallback(void *inClientData, AudioQueueRef inAQ, Audi
     }];
 }
 
+- (void)audioQueueBufferSizeWithMaxPacketSize:(UInt32)maxPacketSize {
+    DDLogVerbose(@"%@ audioQueueBufferSizeWithMaxPacketSize: %u", LOG_TAG, maxPacketSize);
+
+    // For constant bit rate streams, the packets we get are the data blocks given to the parser.
+    if (self.srcFormat.mBytesPerPacket != 0 || maxPacketSize == 0 || self.packetDuration <= 0) {
+        self.audioQueueBufferSize = OUTPUT_BUFFER_SIZE;
+        self.audioQueueBufferPackets = 32;
+        return;
+    }
+
+    UInt32 packets = (UInt32)ceil(AUDIO_QUEUE_BUFFER_DURATION / self.packetDuration);
+    packets = MAX(AUDIO_QUEUE_MIN_PACKETS, MIN(AUDIO_QUEUE_MAX_PACKETS, packets));
+    UInt32 bufferSize = MIN(packets * maxPacketSize, OUTPUT_BUFFER_SIZE);
+    self.audioQueueBufferSize = MAX(bufferSize, maxPacketSize);
+    self.audioQueueBufferPackets = packets;
+    DDLogVerbose(@"%@ audio queue buffers: %u bytes %u packets", LOG_TAG, self.audioQueueBufferSize, packets);
+}
+
 - (void)audioStreamDataWithNumberBytes:(UInt32)numberBytes numberPackets:(UInt32)numberPackets inputData:(const void *)inputData packetDescriptions:(AudioStreamPacketDescription *)packetDescriptions {
     DDLogVerbose(@"%@ audioStreamDataWithNumberBytes: %u numberPackets: %u", LOG_TAG, numberBytes, numberPackets);
 
@@ -901,32 +1918,28 @@ static void audioQueueInputCallback(void *inClientData, AudioQueueRef inAQ, Audi
     }
     for (int i = 0; i < numberPackets; i++) {
         UInt32 size = packetDescriptions[i].mDataByteSize;
-        AudioPacket_t *packet = (AudioPacket_t *) malloc(sizeof(AudioPacket_t) + size);
-
-        packet->identifier = self.packetIdentifier;
-        self.packetIdentifier++;
-
-        /* Prepare the packet */
-        packet->next = NULL;
-        packet->desc = packetDescriptions[i];
-        packet->desc.mStartOffset = 0;
-        memcpy(packet->data, (const char *)inputData + packetDescriptions[i].mStartOffset, size);
 
+        if (!audioPacketRingPush(self.packetRing, &packetDescriptions[i], (const char *)inputData + packetDescriptions[i].mStartOffset)) {
+            DDLogError(@"%@ audio packet ring is full: %u bytes pending", LOG_TAG, self.audioReadPendingSize);
+            [self updateQueueWithState:AudioQueueStateError notify:true];
+            break;
+        }
         total += size;
-        if (_firstPacket) {
-            _lastPacket->next = packet;
-            _lastPacket = packet;
-        } else {
-            _firstPacket = packet;
-            _readPacket = packet;
-            _lastPacket = packet;
+
+        // Record the offset of every STREAM_SEEK_INDEX_INTERVAL packets for the seek (the index
+        // only grows when we parse the packets in sequence from the beginning).
+        if (self.packetNumber % STREAM_SEEK_INDEX_INTERVAL == 0 && self.packetNumber / STREAM_SEEK_INDEX_INTERVAL == self.packetIndex.length / sizeof(int64_t)) {
+            int64_t packetOffset = self.packetBytes;
+            [self.packetIndex appendBytes:&packetOffset length:sizeof(packetOffset)];
         }
+        self.packetNumber++;
+        self.packetBytes += size;
     }
 
     self.audioReadPendingSize += total;
     DDLogVerbose(@"%@ Pending size: %d", LOG_TAG, self.audioReadPendingSize);
 
-    if (self.audioReadPendingSize > OUTPUT_BUFFER_SIZE) {
+    if (self.audioReadPendingSize > self.audioQueueBufferSize) {
         dispatch_async(self.processQueue, ^{
             [self audioDecodePackets];
         });
@@ -952,8 +1965,8 @@ static void audioQueueInputCallback(void *inClientData, AudioQueueRef inAQ, Audi
     }
 
     // If the audio queue is ready but not started and we added some audio data,
-    // start the audio queue.
-    if (self.audioQueueState == AudioQueueStateReady && queued > 0) {
+    // start the audio queue (a prefetched stream waits for startPlayback).
+    if (self.audioQueueState == AudioQueueStateReady && queued > 0 && !self.prefetching) {
         
         OSStatus err = AudioQueueStart(self.audioQueue, nil);
         DDLogVerbose(@"%@AudioQueueStart result: %d", LOG_TAG, err);
@@ -990,38 +2003,26 @@ static void audioQueueInputCallback(void *inClientData, AudioQueueRef inAQ, Audi
     }
 }
 
-- (OSStatus)encoderDataWithNumber:(nonnull UInt32 *)numberDataPackets data:(nonnull AudioBufferList *)data packetDescription:(AudioStreamPacketDescription **)packetDescription {
-    // DDLogVerbose(@"%@ encoderDataWithNumber", LOG_TAG);
-
-    AudioPacket_t *audioPacket = self.readPacket;
-    if (audioPacket) {
-        self.readPacket = audioPacket->next;
-        self.audioReadPendingSize -= audioPacket->desc.mDataByteSize;
-        *numberDataPackets = 1;
-        data->mBuffers[0].mData = audioPacket->data;
-        data->mBuffers[0].mDataByteSize = audioPacket->desc.mDataByteSize;
-        data->mBuffers[0].mNumberChannels = self.srcFormat.mChannelsPerFrame;
-        DDLogVerbose(@"%@ encoderDataWithNumber return packet with size %d", LOG_TAG, audioPacket->desc.mDataByteSize);
+- (void)audioReclaimBuffers {
+    DDLogVerbose(@"%@ audioReclaimBuffers", LOG_TAG);
 
-        if (packetDescription) {
-            *packetDescription = &audioPacket->desc;
-        }
-    } else {
-        *numberDataPackets = 0;
-        DDLogVerbose(@"%@ encoderDataWithNumber last packet found", LOG_TAG);
+    if (!self.audioQueueBuffer || !self.audioBufferRing) {
+        return;
     }
 
-    AudioPacket_t *freePacket = self.firstPacket;
-    if (freePacket) {
-        if (freePacket != audioPacket) {
-            self.firstPacket = freePacket->next;
-
-            // Release a previous packet which is not used now.
-            free((void*)freePacket);
-        }
+    AudioQueueBufferRef buffer;
+    int count = 0;
+    while ((buffer = audioBufferRingPop(self.audioBufferRing)) != NULL) {
+        self.audioQueueBuffer[self.audioQueueBufferIndex] = buffer;
+        self.audioQueueBufferIndex++;
+        count++;
     }
 
-    return noErr;
+    // Fill the buffers again with what we have: audioDecodePacketWithBuffer puts them back
+    // in the free list when there is not enough data.
+    if (count > 0) {
+        [self audioDecodePackets];
+    }
 }
 
 - (void)audioReleaseWithBuffer:(AudioQueueBufferRef)buffer {
@@ -1052,37 +2053,25 @@ static void audioQueueInputCallback(void *inClientData, AudioQueueRef inAQ, Audi
         return -1;
     }
 
-    if (self.audioReadPendingSize < OUTPUT_BUFFER_SIZE && !self.endOfStream) {
+    if (self.audioReadPendingSize < self.audioQueueBufferSize && !self.endOfStream) {
         DDLogVerbose(@"%@ audioDecodePacket waiting more data (current: %d)", LOG_TAG, self.audioReadPendingSize);
 
+        // The AudioQueue is starving when it has no other buffer to play.
+        if (self.audioQueueState == AudioQueueStateRunning && self.audioQueueBufferIndex >= AUDIO_QUEUE_BUFFER_COUNT - 2) {
+            [self updateWindowWithUnderrun:YES];
+        }
         [self audioReleaseWithBuffer:buffer];
         return -1;
     }
 
-    AudioBufferList outputBufferList;
-    outputBufferList.mNumberBuffers = 1;
-    outputBufferList.mBuffers[0].mNumberChannels = self.dstFormat.mChannelsPerFrame;
-    outputBufferList.mBuffers[0].mDataByteSize = OUTPUT_BUFFER_SIZE;
-    outputBufferList.mBuffers[0].mData = buffer->mAudioData;
-
-    void* audioData = buffer->mAudioData;
-    UInt32 audioSize = 0;
+    // Copy the packets from the ring directly in the queue buffer and fill it as much as we can.
     UInt32 count = 0;
-    while (audioSize < STREAM_BUFFER_SIZE - 500 && count < 32) {
-        UInt32 numberDataPackets;
-        [self encoderDataWithNumber:&numberDataPackets data:&outputBufferList packetDescription:nil];
-        if (numberDataPackets > 0) {
-            memcpy(audioData, outputBufferList.mBuffers[0].mData, outputBufferList.mBuffers[0].mDataByteSize);
-            buffer->mPacketDescriptions[count].mStartOffset = audioSize;
-            buffer->mPacketDescriptions[count].mDataByteSize = outputBufferList.mBuffers[0].mDataByteSize;
-            buffer->mPacketDescriptions[count].mVariableFramesInPacket = 0;
-            audioData = audioData + outputBufferList.mBuffers[0].mDataByteSize;
-            audioSize += outputBufferList.mBuffers[0].mDataByteSize;
-            count++;
-        } else {
-            break;
-        }
+    UInt32 dropped = 0;
+    UInt32 audioSize = audioPacketRingRead(self.packetRing, (char *)buffer->mAudioData, buffer->mAudioDataBytesCapacity, buffer->mPacketDescriptions, buffer->mPacketDescriptionCapacity, &count, &dropped);
+    if (dropped > 0) {
+        DDLogError(@"%@ dropped %u bytes of packets larger than the queue buffer", LOG_TAG, dropped);
     }
+    self.audioReadPendingSize -= audioSize + dropped;
 
     if (audioSize == 0) {
         DDLogVerbose(@"%@ audioDecodePacket produced no data", LOG_TAG);
@@ -1091,6 +2080,7 @@ static void audioQueueInputCallback(void *inClientData, AudioQueueRef inAQ, Audi
         return -1;
     }
 
+    self.drainBytes += audioSize + dropped;
     buffer->mPacketDescriptionCount = count;
     buffer->mAudioDataByteSize = audioSize; // ioOutputDataPackets * self.dstFormat.mBytesPerPacket;
     DDLogVerbose(@"%@ AudioQueueEnqueueBuffer buffer size: %d packetCount: %d pendingSize: %d", LOG_TAG, buffer->mAudioDataByteSize, count, self.audioReadPendingSize);
@@ -1098,6 +2088,16 @@ static void audioQueueInputCallback(void *inClientData, AudioQueueRef inAQ, Audi
     if (err) {
         DDLogError(@"%@ AudioQueueEnqueueBuffer result: %d", LOG_TAG, err);
         [self audioReleaseWithBuffer:buffer];
+    } else if (self.positionResync) {
+        // First buffer after a seek: it starts playing now since the queue was flushed.
+        AudioTimeStamp queueTime;
+        Boolean discontinuity;
+
+        memset(&queueTime, 0, sizeof queueTime);
+        if (AudioQueueGetCurrentTime(self.audioQueue, NULL, &queueTime, &discontinuity) == noErr) {
+            self.positionSampleTime = queueTime.mSampleTime;
+        }
+        self.positionResync = NO;
     }
 
     if (!self.endOfStream) {
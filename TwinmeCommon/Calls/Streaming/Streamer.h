@@ -14,6 +14,7 @@
 @class StreamingRequestIQ;
 @class StreamingControlIQ;
 @class MPMediaItem;
+@class StreamingStats;
 
 //
 // Interface: Streamer
@@ -25,12 +26,25 @@
 @property (nonatomic, readonly) BOOL video;
 @property (nonatomic, readonly, nonnull) CallState *call;
 @property (nonatomic, nullable) StreamPlayer *localPlayer;
+@property (nonatomic, readonly, nonnull) StreamingStats *stats;
+@property (nonatomic, readonly) StreamingPriority priority;
 
 - (nonnull instancetype)initWithCall:(nonnull CallState *)call ident:(int64_t)ident mediaItem:(nonnull MPMediaItem *)mediaItem;
 
+/// Create a streamer with the given priority: an interactive stream plays with the current background
+/// stream of the call and its data blocks are sent first.
+- (nonnull instancetype)initWithCall:(nonnull CallState *)call ident:(int64_t)ident mediaItem:(nonnull MPMediaItem *)mediaItem priority:(StreamingPriority)priority;
+
 /// Start streaming to the connected peers.
 - (void)startStreaming;
 
+/// Prepare the stream as the next one of a queue: the media is exported and the peers are asked
+/// to prefetch the first blocks, the playback starts with activateStreaming.
+- (void)prepareStreaming;
+
+/// Start streaming a stream that was prepared.
+- (void)activateStreaming;
+
 /// Pause the streaming by sending a PAUSE_STREAMING message to each call participant.
 - (void)pauseStreaming;
 
@@ -53,6 +67,9 @@
 /// Handle the StreamingRequestIQ packet.
 - (void)onStreamingRequestWithConnection:(nonnull CallConnection *)connection iq:(nonnull StreamingRequestIQ *)iq;
 
+/// Get the size of the stream (it grows while the media is exported).
+- (int64_t)streamSize;
+
 /// Local player is requesting a given data block.
 - (void)readAsyncBlockWithOffset:(int64_t)offset length:(int64_t)length withBlock:(nonnull void (^)(NSData *_Nullable data))block;
 
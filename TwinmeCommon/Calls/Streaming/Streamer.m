@@ -10,6 +10,11 @@
 
 #import <AVFoundation/AVAsset.h>
 #import <AVFoundation/AVAssetExportSession.h>
+#import <AVFoundation/AVAssetReader.h>
+#import <AVFoundation/AVAssetReaderOutput.h>
+#import <AVFoundation/AVAssetTrack.h>
+#import <CoreMedia/CoreMedia.h>
+#import <AudioToolbox/AudioToolbox.h>
 #import <ImageIO/ImageIO.h>
 #import <Photos/Photos.h>
 #import <MediaPlayer/MPMediaItem.h>
@@ -23,6 +28,9 @@
 #import "StreamingRequestIQ.h"
 #import "StreamingInfoIQ.h"
 #import "StreamingDataIQ.h"
+#import "StreamingParityIQ.h"
+#import "StreamingStats.h"
+#import "StreamingClock.h"
 
 #if 0
 static const int ddLogLevel = DDLogLevelVerbose;
@@ -37,6 +45,34 @@ static const int ddLogLevel = DDLogLevelWarning;
 // Above 1s, such latency is ignored as a protection as it could delay the pause/resume too much.
 #define MAX_LATENCY  1000
 
+// Maximum time (s) an interactive streamer waits for its peers to complete once the local player has completed.
+#define INTERACTIVE_RELEASE_DELAY  10
+
+// Maximum length of a coalesced request that we accept to read at once.
+#define STREAMING_MAX_REQUEST_SIZE   (4*STREAMING_DATA_MAX_SIZE)
+
+// When the file is not memory mapped, it is read by aligned blocks and the last blocks are kept in a
+// LRU cache since the peers ask for overlapping ranges at slightly different times.
+#define STREAMER_CACHE_CHUNK_SIZE    STREAMING_DATA_MAX_SIZE
+#define STREAMER_CACHE_COUNT         32
+
+// Size of the ADTS header that we add to each AAC packet when we stream the file while it is exported.
+#define ADTS_HEADER_SIZE             7
+
+//
+// Interface: StreamerPendingRead
+//
+
+@interface StreamerPendingRead : NSObject
+
+@property (nonatomic, readonly) int64_t offset;
+@property (nonatomic, readonly) int64_t length;
+@property (nonatomic, readonly, nonnull) NSMutableArray<void (^)(NSData *_Nullable data)> *requesters;
+
+- (nonnull instancetype)initWithOffset:(int64_t)offset length:(int64_t)length;
+
+@end
+
 //
 // Interface: RemotePlayerInfo
 //
@@ -47,9 +83,28 @@ static const int ddLogLevel = DDLogLevelWarning;
 @property (nonatomic) int64_t lastDate;
 @property (nonatomic) int latency;
 @property (nonatomic) BOOL paused;
+@property (nonatomic) BOOL completed;
+@property (nonatomic) int64_t pendingBytes;
+@property (nonatomic, readonly, nonnull) StreamingClock *clock;
+@property (nonatomic, nullable) NSMutableData *parityData;
+@property (nonatomic, nullable) NSMutableArray<NSNumber *> *parityOffsets;
+@property (nonatomic, nullable) NSMutableArray<NSNumber *> *parityLengths;
+@property (nonatomic) int64_t nextRequestSequence;
+@property (nonatomic) int64_t nextSendSequence;
+@property (nonatomic, readonly, nonnull) NSMutableDictionary<NSNumber *, void (^)(void)> *readySends;
 
 - (int64_t)positionWithTime:(int64_t)now;
 
+/// Allocate the sequence of a request received from the peer.
+- (int64_t)allocateSequence;
+
+/// Queue the send of the request with the given sequence and run the sends that are ready in the order
+/// the requests were received: the blocks are read in parallel but the peer must get them in order.
+- (void)sendWithSequence:(int64_t)sequence block:(nonnull void (^)(void))block;
+
+/// Add the data block sent to the peer in the current parity group and return the number of blocks in the group.
+- (NSUInteger)addParityWithData:(nonnull NSData *)data start:(int32_t)start length:(int32_t)length offset:(int64_t)offset;
+
 @end
 
 //
@@ -59,25 +114,89 @@ static const int ddLogLevel = DDLogLevelWarning;
 @interface Streamer ()
 
 @property (nonatomic, readonly, nonnull) MPMediaItem *mediaItem;
-@property (nonatomic, readonly, nonnull) NSString *temporaryFile;
+@property (nonnull) NSString *temporaryFile;
 @property (nonatomic, readonly, nonnull) dispatch_queue_t readQueue;
 @property (nonatomic, readonly, nonnull) NSMutableDictionary<NSUUID *, RemotePlayerInfo*> *remotePlayers;
 @property (nonatomic, nullable) AVAssetExportSession *exportSession;
-@property (nonatomic, nullable) NSFileHandle *fileHandle;
+@property (nullable) NSData *mappedData;
+@property (nullable) NSFileHandle *fileHandle;
+@property (nonatomic, readonly, nonnull) NSMutableDictionary<NSNumber *, NSData *> *chunkCache;
+@property (nonatomic, readonly, nonnull) NSMutableArray<NSNumber *> *chunkCacheOrder;
+@property (nonatomic, readonly, nonnull) NSMutableDictionary<NSNumber *, StreamerPendingRead *> *pendingReads;
+@property (nonatomic, readonly, nonnull) NSMutableArray<StreamerPendingRead *> *parkedReads;
+@property (nullable) AVAssetReader *assetReader;
+@property (nonatomic) BOOL exporting;
 @property (nonatomic) int64_t position;
-@property (nonatomic) int64_t lastPosition;
+@property int64_t lastPosition;
+@property (nonatomic) int64_t packetCount;
 @property (nonatomic) int64_t startTime;
+@property (nullable) NSData *artwork;
+@property BOOL artworkReady;
+@property BOOL streamStarted;
+@property BOOL infoSent;
+@property BOOL preparing;
+@property BOOL mediaReady;
+@property BOOL prefetched;
+@property BOOL localCompleted;
 
 /// Start streaming with a local file path.
 - (void)startStreamingWithPath:(nonnull NSString *)path;
 
+/// Extract the audio packets from the asset in the temporary file and start streaming while
+/// they are written.  Returns NO if the audio format cannot be streamed in that way.
+- (BOOL)startProgressiveExportWithAsset:(nonnull AVAsset *)asset;
+
+/// Get the number of audio packets of the exported file (0 if it is not known).
+- (int64_t)packetCountWithPath:(nonnull NSString *)path;
+
+/// Write the audio packets in the temporary file and publish the written size (called on a background queue).
+- (void)exportWithReader:(nonnull AVAssetReader *)reader output:(nonnull AVAssetReaderTrackOutput *)output fileHandle:(nonnull NSFileHandle *)fileHandle adtsHeader:(nullable NSData *)adtsHeader;
+
+/// Publish the size of the exported file and run the reads that are now satisfied.
+- (void)exportWithPosition:(int64_t)position completed:(BOOL)completed;
+
+/// Read the aligned block for the pending read, keep it in the cache and give it to its requesters.
+- (void)readWithPendingRead:(nonnull StreamerPendingRead *)pendingRead;
+
+/// Build the range from the aligned blocks that were read for it (a block is NSNull when it could not be read).
++ (nullable NSData *)sliceWithBlocks:(nonnull NSArray<id> *)blocks blockOffset:(int64_t)blockOffset offset:(int64_t)offset length:(int64_t)length;
+
 /// Send a stream start IQ to each peer that is connected through the current call.
 - (void)sendStreamStart;
 
+/// Render and encode the media item artwork (called on a background queue).
+- (void)prepareArtwork;
+
+/// Report a streaming event of the local streamer.
+- (void)postWithEvent:(StreamingEvent)event;
+
+/// Release the interactive streamer once the local player and every peer have completed: the peers are not
+/// notified since they stop their player at the end of the stream.
+- (void)releaseInteractiveIfCompleted;
+
+/// Send the stream info IQ to the peers once the stream is started and the artwork is encoded.
+- (void)sendStreamInfo;
+
+/// Ask each peer connected through the current call to prefetch the stream (and prefetch the local player).
+- (void)sendStreamPrepare;
+
+/// Create the information of the remote player unless the peer already has one: a started stream keeps
+/// the sequence of the prefetch reads, the clock samples and the parity group of its prepare.
+- (void)addRemotePlayerWithPeerConnectionId:(nonnull NSUUID *)peerConnectionId;
+
 /// Send a stream control IQ to each peer that is connected through the current call.
 - (void)sendStreamControlWithMode:(StreamingControlMode)mode length:(int64_t)length timestamp:(int64_t)timestamp streamerPosition:(int64_t)streamerPosition;
 
+/// Send the data read for the request to the peer, split in frames that do not exceed its maximum data size.
+- (void)sendDataWithConnection:(nonnull CallConnection *)connection playerInfo:(nonnull RemotePlayerInfo *)playerInfo iq:(nonnull StreamingRequestIQ *)iq length:(int64_t)length receiveTime:(int64_t)receiveTime peerStats:(nonnull StreamingPeerStats *)peerStats data:(nullable NSData *)data;
+
+/// Add the data block sent to the peer in its parity group and send the parity when the group is complete
+/// (the endOffset is the size of the stream or -1 while it is exported).
+- (void)sendParityWithConnection:(nonnull CallConnection *)connection playerInfo:(nonnull RemotePlayerInfo *)playerInfo data:(nonnull NSData *)data start:(int32_t)start length:(int32_t)length offset:(int64_t)offset endOffset:(int64_t)endOffset;
+
 /// Read the data block at the given offset (this method must be called from the readQueue).
+/// When the file is memory mapped, the returned data is a no-copy slice of the mapping and
+/// several blocks can be read in parallel.
 - (nullable NSData *)readBlockWithOffset:(int64_t)offset length:(int64_t)length request:(int64_t)request;
 
 @end
@@ -91,6 +210,18 @@ static const int ddLogLevel = DDLogLevelWarning;
 
 @implementation RemotePlayerInfo
 
+- (nonnull instancetype)init {
+
+    self = [super init];
+    if (self) {
+        _clock = [[StreamingClock alloc] init];
+        _readySends = [[NSMutableDictionary alloc] init];
+        _nextRequestSequence = 0;
+        _nextSendSequence = 0;
+    }
+    return self;
+}
+
 - (int64_t)positionWithTime:(int64_t)now {
     
     if (self.paused) {
@@ -100,6 +231,74 @@ static const int ddLogLevel = DDLogLevelWarning;
     }
 }
 
+- (int64_t)allocateSequence {
+
+    @synchronized (self) {
+        return self.nextRequestSequence++;
+    }
+}
+
+- (void)sendWithSequence:(int64_t)sequence block:(nonnull void (^)(void))block {
+
+    // The sends are made with the lock held so that two read completions cannot interleave their frames.
+    @synchronized (self) {
+        self.readySends[[NSNumber numberWithLongLong:sequence]] = block;
+        while (YES) {
+            NSNumber *key = [NSNumber numberWithLongLong:self.nextSendSequence];
+            void (^send)(void) = self.readySends[key];
+            if (!send) {
+                break;
+            }
+            [self.readySends removeObjectForKey:key];
+            self.nextSendSequence++;
+            send();
+        }
+    }
+}
+
+- (NSUInteger)addParityWithData:(nonnull NSData *)data start:(int32_t)start length:(int32_t)length offset:(int64_t)offset {
+
+    if (!self.parityData) {
+        self.parityData = [[NSMutableData alloc] initWithCapacity:length];
+        self.parityOffsets = [[NSMutableArray alloc] initWithCapacity:STREAMING_PARITY_GROUP_SIZE];
+        self.parityLengths = [[NSMutableArray alloc] initWithCapacity:STREAMING_PARITY_GROUP_SIZE];
+    }
+    if (self.parityData.length < length) {
+        self.parityData.length = length;
+    }
+
+    uint8_t *dst = self.parityData.mutableBytes;
+    const uint8_t *src = (const uint8_t *)data.bytes + start;
+    for (int32_t i = 0; i < length; i++) {
+        dst[i] ^= src[i];
+    }
+    [self.parityOffsets addObject:[NSNumber numberWithLongLong:offset]];
+    [self.parityLengths addObject:[NSNumber numberWithInt:length]];
+    return self.parityOffsets.count;
+}
+
+@end
+
+//
+// Implementation: StreamerPendingRead
+//
+
+#undef LOG_TAG
+#define LOG_TAG @"StreamerPendingRead"
+
+@implementation StreamerPendingRead
+
+- (nonnull instancetype)initWithOffset:(int64_t)offset length:(int64_t)length {
+
+    self = [super init];
+    if (self) {
+        _offset = offset;
+        _length = length;
+        _requesters = [[NSMutableArray alloc] init];
+    }
+    return self;
+}
+
 @end
 
 //
@@ -112,44 +311,121 @@ static const int ddLogLevel = DDLogLevelWarning;
 @implementation Streamer
 
 - (nonnull instancetype)initWithCall:(nonnull CallState *)call ident:(int64_t)ident mediaItem:(nonnull MPMediaItem *)mediaItem {
-    DDLogVerbose(@"%@ initWithCall: %@ ident: %lld mediaItem: %@", LOG_TAG, call, ident, mediaItem);
+
+    return [self initWithCall:call ident:ident mediaItem:mediaItem priority:StreamingPriorityBackground];
+}
+
+- (nonnull instancetype)initWithCall:(nonnull CallState *)call ident:(int64_t)ident mediaItem:(nonnull MPMediaItem *)mediaItem priority:(StreamingPriority)priority {
+    DDLogVerbose(@"%@ initWithCall: %@ ident: %lld mediaItem: %@ priority: %d", LOG_TAG, call, ident, mediaItem, priority);
     
     self = [super init];
     if (self) {
         _call = call;
+        _priority = priority;
         _mediaItem = mediaItem;
-        _video = NO;
+        // A video is exported in a MP4 file with the metadata first so that the player can start
+        // with the first blocks and read the others by range.
+        _video = (mediaItem.mediaType & MPMediaTypeAnyVideo) != 0;
         _remotePlayers = [[NSMutableDictionary alloc] init];
-        _temporaryFile = [NSTemporaryDirectory() stringByAppendingPathComponent:@"streaming.caf"];
+        _stats = [[StreamingStats alloc] initWithIdent:ident];
+        _chunkCache = [[NSMutableDictionary alloc] init];
+        _chunkCacheOrder = [[NSMutableArray alloc] init];
+        _pendingReads = [[NSMutableDictionary alloc] init];
+        _parkedReads = [[NSMutableArray alloc] init];
+        _exporting = NO;
+        // The next stream of a queue is exported while the current one is playing: each one has its file.
+        NSString *fileName = [NSString stringWithFormat:_video ? @"streaming-%lld.mp4" : @"streaming-%lld.caf", ident];
+        _temporaryFile = [NSTemporaryDirectory() stringByAppendingPathComponent:fileName];
         NSFileManager *fileMgr = [NSFileManager defaultManager];
         if ([fileMgr fileExistsAtPath:_temporaryFile]) {
             [fileMgr removeItemAtPath:self.temporaryFile error:nil];
         }
         _position = 0;
         _ident = ident;
-        _readQueue = dispatch_queue_create("streamReadQueue", DISPATCH_QUEUE_SERIAL);
-        _localPlayer = [[StreamPlayer alloc] initWithIdent:ident size:0 video:_video call:call connection:nil streamer:self];
+        dispatch_queue_attr_t attr;
+        attr = dispatch_queue_attr_make_with_qos_class(DISPATCH_QUEUE_CONCURRENT, priority == StreamingPriorityInteractive ? QOS_CLASS_USER_INTERACTIVE : QOS_CLASS_USER_INITIATED, 0);
+        _readQueue = dispatch_queue_create("streamReadQueue", attr);
+        _localPlayer = [[StreamPlayer alloc] initWithIdent:ident size:0 packetCount:0 video:_video call:call connection:nil streamer:self];
+        _localPlayer.priority = priority;
+        _artworkReady = NO;
+        _streamStarted = NO;
+        _infoSent = NO;
         if (mediaItem) {
-            UIImage *artworkImage = [mediaItem.artwork imageWithSize:CGSizeMake(STREAMER_IMAGE_SIZE, STREAMER_IMAGE_SIZE)];
-            [_localPlayer setInformationWithTitle:mediaItem.title album:mediaItem.albumTitle artist:mediaItem.artist artwork:artworkImage duration:mediaItem.playbackDuration];
+            [_localPlayer setInformationWithTitle:mediaItem.title album:mediaItem.albumTitle artist:mediaItem.artist artwork:nil duration:mediaItem.playbackDuration];
+
+            // Rendering and compressing the artwork is slow: do it while the media is exported.
+            dispatch_async(dispatch_get_global_queue(QOS_CLASS_UTILITY, 0), ^{
+                [self prepareArtwork];
+            });
         }
-        
     }
     return self;
 }
 
++ (nonnull NSCache<NSNumber *, NSData *> *)artworkCache {
+
+    static NSCache<NSNumber *, NSData *> *artworkCache = nil;
+    static dispatch_once_t onceToken;
+    dispatch_once(&onceToken, ^{
+        artworkCache = [[NSCache alloc] init];
+        artworkCache.countLimit = 16;
+    });
+    return artworkCache;
+}
+
+- (void)prepareArtwork {
+    DDLogVerbose(@"%@ prepareArtwork", LOG_TAG);
+
+    // The encoded artwork is cached for the media item since the same item is often streamed again.
+    NSNumber *key = [NSNumber numberWithUnsignedLongLong:self.mediaItem.persistentID];
+    NSData *artwork = [[Streamer artworkCache] objectForKey:key];
+    UIImage *artworkImage = nil;
+    if (artwork) {
+        artworkImage = [UIImage imageWithData:artwork];
+    } else {
+        MPMediaItemArtwork *artworkItem = [self.mediaItem valueForProperty:MPMediaItemPropertyArtwork];
+        artworkImage = [artworkItem imageWithSize:CGSizeMake(STREAMER_IMAGE_SIZE, STREAMER_IMAGE_SIZE)];
+        if (artworkImage) {
+            artwork = UIImageJPEGRepresentation(artworkImage, IMAGE_JPEG_QUALITY);
+            if (artwork) {
+                [[Streamer artworkCache] setObject:artwork forKey:key];
+            }
+        }
+    }
+
+    // The player information is read by the UI: update it from the main thread.
+    if (artworkImage) {
+        StreamPlayer *localPlayer = self.localPlayer;
+        MPMediaItem *mediaItem = self.mediaItem;
+        dispatch_async(dispatch_get_main_queue(), ^{
+            [localPlayer setInformationWithTitle:mediaItem.title album:mediaItem.albumTitle artist:mediaItem.artist artwork:artworkImage duration:mediaItem.playbackDuration];
+        });
+    }
+    @synchronized (self) {
+        self.artwork = artwork;
+        self.artworkReady = YES;
+    }
+    [self sendStreamInfo];
+}
+
 - (void)startStreaming {
     DDLogVerbose(@"%@ startStreaming", LOG_TAG);
     
-    [self.call onStreamingEventWithParticipant:nil event:StreamingEventStart];
+    if (!self.preparing) {
+        [self postWithEvent:StreamingEventStart];
+    }
     NSURL *assetURL = [self.mediaItem assetURL];
     if ([assetURL isFileURL]) {
         [self startStreamingWithPath:[assetURL path]];
     } else {
         AVAsset *asset = [AVAsset assetWithURL:assetURL];
+        if (!self.video && [self startProgressiveExportWithAsset:asset]) {
+            return;
+        }
+
         self.exportSession = [[AVAssetExportSession alloc] initWithAsset:asset presetName:AVAssetExportPresetPassthrough];
         self.exportSession.outputURL = [NSURL fileURLWithPath:self.temporaryFile];
-        self.exportSession.outputFileType = AVFileTypeCoreAudioFormat;
+        self.exportSession.outputFileType = self.video ? AVFileTypeMPEG4 : AVFileTypeCoreAudioFormat;
         self.exportSession.shouldOptimizeForNetworkUse = YES;
         [self.exportSession exportAsynchronouslyWithCompletionHandler:^{
             switch ([self.exportSession status]) {
@@ -163,7 +439,7 @@ static const int ddLogLevel = DDLogLevelWarning;
                 default: {
                     NSError *error = [self.exportSession error];
                     DDLogError(@"%@ startStreaming export failed: %@", LOG_TAG, error);
-                    [self.call onStreamingEventWithParticipant:nil event:StreamingEventError];
+                    [self postWithEvent:StreamingEventError];
                     break;
                 }
             }
@@ -172,17 +448,253 @@ static const int ddLogLevel = DDLogLevelWarning;
     }
 }
 
+- (void)prepareStreaming {
+    DDLogVerbose(@"%@ prepareStreaming", LOG_TAG);
+
+    @synchronized (self) {
+        self.preparing = YES;
+    }
+    [self startStreaming];
+}
+
+- (void)activateStreaming {
+    DDLogVerbose(@"%@ activateStreaming", LOG_TAG);
+
+    BOOL mediaReady;
+    @synchronized (self) {
+        self.preparing = NO;
+        mediaReady = self.mediaReady;
+    }
+    [self postWithEvent:StreamingEventStart];
+
+    // When the media is not ready, the start is sent at the end of its export.
+    if (mediaReady) {
+        [self sendStreamStart];
+    }
+}
+
 - (void)startStreamingWithPath:(nonnull NSString *)path {
     DDLogVerbose(@"%@ startStreamingWithPath: %@", LOG_TAG, path);
 
-    self.fileHandle = [NSFileHandle fileHandleForReadingAtPath:path];
-    [self.fileHandle seekToEndOfFile];
-    self.lastPosition = [self.fileHandle offsetInFile];
+    // Map the file in memory so that data blocks are served without copy and without
+    // serializing the peer requests on a single file position.
+    NSError *error = nil;
+    self.mappedData = [NSData dataWithContentsOfFile:path options:NSDataReadingMappedAlways error:&error];
+    if (self.mappedData) {
+        self.lastPosition = self.mappedData.length;
+    } else {
+        DDLogWarn(@"%@ startStreamingWithPath cannot map file: %@", LOG_TAG, error);
+        self.fileHandle = [NSFileHandle fileHandleForReadingAtPath:path];
+        [self.fileHandle seekToEndOfFile];
+        self.lastPosition = [self.fileHandle offsetInFile];
+    }
     self.position = self.lastPosition;
+    if (!self.video) {
+        self.packetCount = [self packetCountWithPath:path];
+    }
     
     [self sendStreamStart];
 }
 
+- (int64_t)packetCountWithPath:(nonnull NSString *)path {
+    DDLogVerbose(@"%@ packetCountWithPath: %@", LOG_TAG, path);
+
+    AudioFileID audioFile;
+    OSStatus err = AudioFileOpenURL((__bridge CFURLRef)[NSURL fileURLWithPath:path], kAudioFileReadPermission, 0, &audioFile);
+    if (err) {
+        DDLogWarn(@"%@ packetCountWithPath cannot open file: %d", LOG_TAG, err);
+        return 0;
+    }
+
+    UInt64 packetCount = 0;
+    UInt32 size = sizeof(packetCount);
+    err = AudioFileGetProperty(audioFile, kAudioFilePropertyAudioDataPacketCount, &size, &packetCount);
+    AudioFileClose(audioFile);
+    return err ? 0 : (int64_t)packetCount;
+}
+
+- (BOOL)startProgressiveExportWithAsset:(nonnull AVAsset *)asset {
+    DDLogVerbose(@"%@ startProgressiveExportWithAsset: %@", LOG_TAG, asset);
+
+    AVAssetTrack *track = [[asset tracksWithMediaType:AVMediaTypeAudio] firstObject];
+    if (!track || track.formatDescriptions.count == 0) {
+        return NO;
+    }
+
+    // The passthrough CAF export cannot be parsed before it is finished because the packet sizes
+    // are known at the end.  We can stream while exporting only the formats with self-framed packets:
+    // MP3 frames are written as is and AAC packets are written with an ADTS header.
+    CMAudioFormatDescriptionRef format = (__bridge CMAudioFormatDescriptionRef)track.formatDescriptions[0];
+    const AudioStreamBasicDescription *asbd = CMAudioFormatDescriptionGetStreamBasicDescription(format);
+    if (!asbd) {
+        return NO;
+    }
+
+    NSData *adtsHeader = nil;
+    if (asbd->mFormatID == kAudioFormatMPEG4AAC) {
+        static const int sampleRates[] = { 96000, 88200, 64000, 48000, 44100, 32000, 24000, 22050, 16000, 12000, 11025, 8000, 7350 };
+        int rateIndex = -1;
+        for (int i = 0; i < sizeof(sampleRates) / sizeof(sampleRates[0]); i++) {
+            if (sampleRates[i] == (int)asbd->mSampleRate) {
+                rateIndex = i;
+                break;
+            }
+        }
+        UInt32 channels = asbd->mChannelsPerFrame;
+        if (rateIndex < 0 || channels == 0 || channels > 7) {
+            return NO;
+        }
+
+        // AAC-LC, MPEG-4, no CRC: the frame length is set for each packet.
+        uint8_t header[ADTS_HEADER_SIZE];
+        header[0] = 0xFF;
+        header[1] = 0xF1;
+        header[2] = (uint8_t)((1 << 6) | (rateIndex << 2) | (channels >> 2));
+        header[3] = (uint8_t)((channels & 3) << 6);
+        header[4] = 0;
+        header[5] = 0x1F;
+        header[6] = 0xFC;
+        adtsHeader = [NSData dataWithBytes:header length:ADTS_HEADER_SIZE];
+
+    } else if (asbd->mFormatID != kAudioFormatMPEGLayer3) {
+        return NO;
+    }
+
+    NSError *error = nil;
+    AVAssetReader *reader = [[AVAssetReader alloc] initWithAsset:asset error:&error];
+    if (!reader) {
+        DDLogWarn(@"%@ startProgressiveExportWithAsset cannot read asset: %@", LOG_TAG, error);
+        return NO;
+    }
+    AVAssetReaderTrackOutput *output = [[AVAssetReaderTrackOutput alloc] initWithTrack:track outputSettings:nil];
+    if (![reader canAddOutput:output]) {
+        return NO;
+    }
+    [reader addOutput:output];
+
+    // The file contains the ADTS or MP3 frames and not a CAF: its extension must match for the audio file parsers.
+    self.temporaryFile = [[self.temporaryFile stringByDeletingPathExtension] stringByAppendingPathExtension:adtsHeader ? @"aac" : @"mp3"];
+    NSFileManager *fileMgr = [NSFileManager defaultManager];
+    if (![fileMgr createFileAtPath:self.temporaryFile contents:nil attributes:nil]) {
+        return NO;
+    }
+    NSFileHandle *writeHandle = [NSFileHandle fileHandleForWritingAtPath:self.temporaryFile];
+    NSFileHandle *readHandle = [NSFileHandle fileHandleForReadingAtPath:self.temporaryFile];
+    if (!writeHandle || !readHandle || ![reader startReading]) {
+        [writeHandle closeFile];
+        [readHandle closeFile];
+        [fileMgr removeItemAtPath:self.temporaryFile error:nil];
+        return NO;
+    }
+
+    // The file grows while we stream: it is read through the file handle and the requests
+    // above the exported size are parked until the data is written.
+    self.assetReader = reader;
+    self.fileHandle = readHandle;
+    self.position = 0;
+    @synchronized (self.pendingReads) {
+        self.lastPosition = 0;
+        self.exporting = YES;
+    }
+    dispatch_async(dispatch_get_global_queue(QOS_CLASS_USER_INITIATED, 0), ^{
+        [self exportWithReader:reader output:output fileHandle:writeHandle adtsHeader:adtsHeader];
+    });
+
+    [self sendStreamStart];
+    return YES;
+}
+
+- (void)exportWithReader:(nonnull AVAssetReader *)reader output:(nonnull AVAssetReaderTrackOutput *)output fileHandle:(nonnull NSFileHandle *)fileHandle adtsHeader:(nullable NSData *)adtsHeader {
+    DDLogVerbose(@"%@ exportWithReader: %@", LOG_TAG, reader);
+
+    int64_t position = 0;
+    BOOL failed = NO;
+    while (!failed && reader.status == AVAssetReaderStatusReading) {
+        CMSampleBufferRef sampleBuffer = [output copyNextSampleBuffer];
+        if (!sampleBuffer) {
+            break;
+        }
+
+        CMBlockBufferRef blockBuffer = CMSampleBufferGetDataBuffer(sampleBuffer);
+        size_t length = blockBuffer ? CMBlockBufferGetDataLength(blockBuffer) : 0;
+        NSMutableData *content = [[NSMutableData alloc] initWithLength:length];
+        if (length > 0 && CMBlockBufferCopyDataBytes(blockBuffer, 0, length, content.mutableBytes) != kCMBlockBufferNoErr) {
+            content.length = 0;
+        }
+
+        const AudioStreamPacketDescription *packets = NULL;
+        size_t packetCount = 0;
+        NSData *data = content;
+        if (adtsHeader && content.length > 0 && (CMSampleBufferGetAudioStreamPacketDescriptionsPtr(sampleBuffer, &packets, &packetCount) != noErr || !packets)) {
+            // Without the packet boundaries we cannot frame the AAC packets and the peers could not parse raw packets.
+            DDLogError(@"%@ exportWithReader: no packet descriptions for the ADTS stream", LOG_TAG);
+            failed = YES;
+            data = nil;
+        } else if (adtsHeader && packets) {
+            NSMutableData *frames = [[NSMutableData alloc] initWithCapacity:content.length + packetCount * ADTS_HEADER_SIZE];
+            uint8_t header[ADTS_HEADER_SIZE];
+            [adtsHeader getBytes:header length:ADTS_HEADER_SIZE];
+            for (size_t i = 0; i < packetCount; i++) {
+                UInt32 size = packets[i].mDataByteSize;
+                UInt32 frameLength = size + ADTS_HEADER_SIZE;
+                if (packets[i].mStartOffset + size > content.length || frameLength > 0x1FFF) {
+                    continue;
+                }
+                header[3] = (uint8_t)((header[3] & 0xC0) | (frameLength >> 11));
+                header[4] = (uint8_t)((frameLength >> 3) & 0xFF);
+                header[5] = (uint8_t)(((frameLength & 7) << 5) | 0x1F);
+                [frames appendBytes:header length:ADTS_HEADER_SIZE];
+                [frames appendBytes:(const char *)content.bytes + packets[i].mStartOffset length:size];
+            }
+            data = frames;
+        }
+        CFRelease(sampleBuffer);
+
+        if (data.length > 0) {
+            @try {
+                [fileHandle writeData:data];
+            } @catch (NSException *exception) {
+                DDLogError(@"%@ exportWithReader write failed: %@", LOG_TAG, exception);
+                failed = YES;
+                break;
+            }
+            position += data.length;
+            [self exportWithPosition:position completed:NO];
+        }
+    }
+    [fileHandle closeFile];
+
+    if (failed || reader.status == AVAssetReaderStatusFailed) {
+        DDLogError(@"%@ exportWithReader failed: %@", LOG_TAG, reader.error);
+        [reader cancelReading];
+        [self postWithEvent:StreamingEventError];
+    }
+    [self exportWithPosition:position completed:YES];
+    self.assetReader = nil;
+}
+
+- (void)exportWithPosition:(int64_t)position completed:(BOOL)completed {
+    DDLogVerbose(@"%@ exportWithPosition: %lld completed: %d", LOG_TAG, position, completed);
+
+    NSMutableArray<StreamerPendingRead *> *readyReads = [[NSMutableArray alloc] init];
+    @synchronized (self.pendingReads) {
+        self.lastPosition = position;
+        if (completed) {
+            self.exporting = NO;
+        }
+        for (StreamerPendingRead *pendingRead in self.parkedReads) {
+            if (completed || pendingRead.offset + pendingRead.length <= position) {
+                [readyReads addObject:pendingRead];
+            }
+        }
+        [self.parkedReads removeObjectsInArray:readyReads];
+    }
+
+    for (StreamerPendingRead *pendingRead in readyReads) {
+        [self readWithPendingRead:pendingRead];
+    }
+}
+
 - (void)pauseStreaming {
     DDLogVerbose(@"%@ pauseStreaming", LOG_TAG);
 
@@ -215,7 +727,7 @@ static const int ddLogLevel = DDLogLevelWarning;
     }
 
     [self sendStreamControlWithMode:StreamingControlModePause length:maxPosition timestamp:now streamerPosition:streamerPosition];
-    [self.call onStreamingEventWithParticipant:nil event:StreamingEventPaused];
+    [self postWithEvent:StreamingEventPaused];
     if (self.localPlayer) {
         int64_t delay = maxPosition + (int64_t)minLatency - streamerPosition;
         if (delay < 0) {
@@ -257,7 +769,7 @@ static const int ddLogLevel = DDLogLevelWarning;
     }
 
     [self sendStreamControlWithMode:StreamingControlModeResume length:minPosition timestamp:now streamerPosition:streamerPosition];
-    [self.call onStreamingEventWithParticipant:nil event:StreamingEventPlaying];
+    [self postWithEvent:StreamingEventPlaying];
     if (self.localPlayer) {
         int64_t delay = streamerPosition - minPosition + (int64_t)minLatency;
         if (delay < 0) {
@@ -285,6 +797,7 @@ static const int ddLogLevel = DDLogLevelWarning;
     if (self.exportSession) {
         [self.exportSession cancelExport];
     }
+    [self.assetReader cancelReading];
 
     if (notify) {
         [self sendStreamControlWithMode:StreamingControlModeStop length:0 timestamp:0 streamerPosition:0];
@@ -295,12 +808,21 @@ static const int ddLogLevel = DDLogLevelWarning;
         self.localPlayer = nil;
     }
 
-    if (self.fileHandle) {
-        [self.fileHandle closeFile];
-        self.fileHandle = nil;
+    // Blocks being sent still hold a reference on the mapping.
+    self.mappedData = nil;
+    NSFileHandle *fileHandle = self.fileHandle;
+    if (fileHandle) {
+        @synchronized (fileHandle) {
+            [fileHandle closeFile];
+            self.fileHandle = nil;
+        }
+    }
+    @synchronized (self.pendingReads) {
+        [self.chunkCache removeAllObjects];
+        [self.chunkCacheOrder removeAllObjects];
     }
 
-    [self.call onStreamingEventWithParticipant:nil event:StreamingEventStop];
+    [self postWithEvent:StreamingEventStop];
 
     NSFileManager *fileMgr = [NSFileManager defaultManager];
     [fileMgr removeItemAtPath:self.temporaryFile error:nil];
@@ -341,30 +863,73 @@ static const int ddLogLevel = DDLogLevelWarning;
         default:
             return;
     }
-    [self.call onStreamingEventWithParticipant:nil event:event];
-    if (mustStop) {
+    [self postWithEvent:event];
+    if (mustStop && self.priority == StreamingPriorityBackground) {
         [self.call stopStreaming];
     }
 }
 
+- (void)postWithEvent:(StreamingEvent)event {
+    DDLogVerbose(@"%@ postWithEvent: %d", LOG_TAG, event);
+
+    // The events without participant describe the background stream: the interactive stream plays
+    // once along with it and it is released when it completes or fails.
+    if (self.priority == StreamingPriorityBackground) {
+        [self.call onStreamingEventWithParticipant:nil event:event];
+    } else if (event == StreamingEventCompleted || event == StreamingEventError || event == StreamingEventUnsupported) {
+        // The peers may still play their buffered tail and ask for the last blocks: a STOP would cut them.
+        // A peer that never reports its completion does not keep the streamer forever.
+        self.localCompleted = YES;
+        [self releaseInteractiveIfCompleted];
+        CallState *call = self.call;
+        int64_t ident = self.ident;
+        dispatch_after(dispatch_time(DISPATCH_TIME_NOW, INTERACTIVE_RELEASE_DELAY * NSEC_PER_SEC), dispatch_get_global_queue(QOS_CLASS_UTILITY, 0), ^{
+            [call stopInteractiveStreamingWithIdent:ident notify:NO];
+        });
+    }
+}
+
+- (void)releaseInteractiveIfCompleted {
+    DDLogVerbose(@"%@ releaseInteractiveIfCompleted", LOG_TAG);
+
+    if (self.priority != StreamingPriorityInteractive || !self.localCompleted) {
+        return;
+    }
+    @synchronized (self) {
+        for (NSUUID *peerId in self.remotePlayers) {
+            if (!self.remotePlayers[peerId].completed) {
+                return;
+            }
+        }
+    }
+    [self.call stopInteractiveStreamingWithIdent:self.ident notify:NO];
+}
+
 - (void)sendStreamStart {
     DDLogVerbose(@"%@ sendStreamStart", LOG_TAG);
 
+    BOOL preparing;
+    @synchronized (self) {
+        self.mediaReady = YES;
+        preparing = self.preparing;
+    }
+    if (preparing) {
+        // A video is only exported in advance, the AVPlayer of the peers cannot prefetch it.
+        if (!self.video) {
+            [self sendStreamPrepare];
+        }
+        return;
+    }
+
     int64_t now = [[NSDate date] timeIntervalSince1970] * 1000;
     self.startTime = now;
-    StreamingControlIQ *streamingControlIQ = [[StreamingControlIQ alloc] initWithSerializer:[CallConnection STREAMING_CONTROL_SERIALIZER] requestId:[self.call allocateRequestId] ident:self.ident mode:self.video ? StreamingControlModeStartVideo : StreamingControlModeStartAudio length:0 timestamp:now position:0 latency:0];
-    
-    StreamingInfoIQ *streamingInfoIQ = nil;
-    if (self.mediaItem.title) {
-        NSData *artwork = nil;
-        MPMediaItemArtwork *artworkItem = [self.mediaItem valueForProperty: MPMediaItemPropertyArtwork];
-        UIImage *artworkImage = [artworkItem imageWithSize:CGSizeMake(STREAMER_IMAGE_SIZE, STREAMER_IMAGE_SIZE)];
-        if (artworkImage) {
-            artwork = UIImageJPEGRepresentation(artworkImage, IMAGE_JPEG_QUALITY);
-        }
-        
-        streamingInfoIQ = [[StreamingInfoIQ alloc] initWithSerializer:[CallConnection STREAMING_INFO_SERIALIZER] requestId:[self.call allocateRequestId] ident:self.ident title:self.mediaItem.title album:self.mediaItem.albumTitle artist:self.mediaItem.artist artwork:artwork duration:(int64_t)self.mediaItem.playbackDuration];
+    // The video player must know the size of the stream to give it to AVPlayer, the audio player uses it
+    // to ask the exact tail of the stream.  The size is not known yet while the audio is exported.
+    int64_t length;
+    @synchronized (self.pendingReads) {
+        length = self.exporting ? 0 : self.lastPosition;
     }
+    StreamingControlIQ *streamingControlIQ = [[StreamingControlIQ alloc] initWithSerializer:[CallConnection STREAMING_CONTROL_SERIALIZER] requestId:[self.call allocateRequestId] ident:self.ident mode:self.video ? StreamingControlModeStartVideo : (self.priority == StreamingPriorityInteractive ? StreamingControlModeStartInteractiveAudio : StreamingControlModeStartAudio) length:length timestamp:now position:0 latency:0 packetCount:self.packetCount];
     
     NSArray<CallConnection *> *connections = [self.call getConnections];
     for (CallConnection *connection in connections) {
@@ -372,31 +937,111 @@ static const int ddLogLevel = DDLogLevelWarning;
         if (IS_STREAMING_SUPPORTED(status)) {
             NSUUID *peerConnectionId = [connection peerConnectionId];
             if (peerConnectionId) {
-                [self.remotePlayers setObject:[[RemotePlayerInfo alloc] init] forKey:peerConnectionId];
-                [connection sendMessageWithIQ:streamingControlIQ statType:TLPeerConnectionServiceStatTypeIqSetPushObject];
-                if (streamingInfoIQ) {
-                    [connection sendMessageWithIQ:streamingInfoIQ statType:(TLPeerConnectionServiceStatType)TLPeerConnectionServiceStatTypeIqSetPushObject];
-                }
-                
+                [self addRemotePlayerWithPeerConnectionId:peerConnectionId];
+                [connection sendStreamingIQ:streamingControlIQ];
                 [connection updatePeerWithStreamingStatus:StreamingStatusReady];
             }
         }
     }
 
     if (self.localPlayer) {
-        [self.localPlayer start];
+        if (self.prefetched) {
+            [self.localPlayer startPlayback];
+        } else {
+            [self.localPlayer start];
+        }
+    }
+
+    // The peers get the title and artwork after the start so that the first data blocks are not delayed.
+    @synchronized (self) {
+        self.streamStarted = YES;
+    }
+    [self sendStreamInfo];
+}
+
+- (void)sendStreamPrepare {
+    DDLogVerbose(@"%@ sendStreamPrepare", LOG_TAG);
+
+    int64_t now = [[NSDate date] timeIntervalSince1970] * 1000;
+    int64_t length;
+    @synchronized (self.pendingReads) {
+        length = self.exporting ? 0 : self.lastPosition;
+    }
+    StreamingControlIQ *streamingControlIQ = [[StreamingControlIQ alloc] initWithSerializer:[CallConnection STREAMING_CONTROL_SERIALIZER] requestId:[self.call allocateRequestId] ident:self.ident mode:StreamingControlModePrepareAudio length:length timestamp:now position:0 latency:0 packetCount:self.packetCount];
+    NSArray<CallConnection *> *connections = [self.call getConnections];
+    for (CallConnection *connection in connections) {
+        StreamingStatus status = [connection streamingStatus];
+        NSUUID *peerConnectionId = [connection peerConnectionId];
+        if (IS_STREAMING_SUPPORTED(status) && peerConnectionId) {
+            [self addRemotePlayerWithPeerConnectionId:peerConnectionId];
+            [connection sendStreamingIQ:streamingControlIQ];
+        }
+    }
+
+    if (self.localPlayer) {
+        self.prefetched = YES;
+        [self.localPlayer prefetch];
+    }
+}
+
+- (void)addRemotePlayerWithPeerConnectionId:(nonnull NSUUID *)peerConnectionId {
+    DDLogVerbose(@"%@ addRemotePlayerWithPeerConnectionId: %@", LOG_TAG, peerConnectionId);
+
+    @synchronized (self) {
+        if (!self.remotePlayers[peerConnectionId]) {
+            [self.remotePlayers setObject:[[RemotePlayerInfo alloc] init] forKey:peerConnectionId];
+        }
+    }
+}
+
+- (void)sendStreamInfo {
+    DDLogVerbose(@"%@ sendStreamInfo", LOG_TAG);
+
+    NSData *artwork;
+    @synchronized (self) {
+        if (!self.streamStarted || !self.artworkReady || self.infoSent) {
+            return;
+        }
+        self.infoSent = YES;
+        artwork = self.artwork;
+    }
+    if (!self.mediaItem.title) {
+        return;
+    }
+
+    StreamingInfoIQ *streamingInfoIQ = [[StreamingInfoIQ alloc] initWithSerializer:[CallConnection STREAMING_INFO_SERIALIZER] requestId:[self.call allocateRequestId] ident:self.ident title:self.mediaItem.title album:self.mediaItem.albumTitle artist:self.mediaItem.artist artwork:artwork duration:(int64_t)self.mediaItem.playbackDuration];
+    NSArray<CallConnection *> *connections = [self.call getConnections];
+    for (CallConnection *connection in connections) {
+        StreamingStatus status = [connection streamingStatus];
+        NSUUID *peerConnectionId = [connection peerConnectionId];
+        BOOL started;
+        @synchronized (self) {
+            started = peerConnectionId && self.remotePlayers[peerConnectionId] != nil;
+        }
+        if (IS_STREAMING_SUPPORTED(status) && started) {
+            [connection sendMessageWithIQ:streamingInfoIQ statType:(TLPeerConnectionServiceStatType)TLPeerConnectionServiceStatTypeIqSetPushObject];
+        }
     }
 }
 
 - (void)sendStreamControlWithMode:(StreamingControlMode)mode length:(int64_t)length timestamp:(int64_t)timestamp streamerPosition:(int64_t)streamerPosition {
     DDLogVerbose(@"%@ sendStreamControlWithMode: %d length: %lld timestamp: %lld streamerPosition: %lld", LOG_TAG, mode, length, timestamp - self.startTime, streamerPosition);
 
+    // The positions are not continuous after a pause, resume or seek.
+    if (mode == StreamingControlModePause || mode == StreamingControlModeResume || mode == StreamingControlModeSeek) {
+        @synchronized (self) {
+            for (NSUUID *peerId in self.remotePlayers) {
+                [self.remotePlayers[peerId].clock reset];
+            }
+        }
+    }
+
     StreamingControlIQ *streamingControlIQ = [[StreamingControlIQ alloc] initWithSerializer:[CallConnection STREAMING_CONTROL_SERIALIZER] requestId:[self.call allocateRequestId] ident:self.ident mode:mode length:length timestamp:timestamp position:streamerPosition latency:0];
     NSArray<CallConnection *> *connections = [self.call getConnections];
     for (CallConnection *connection in connections) {
         StreamingStatus status = [connection streamingStatus];
         if (IS_STREAMING_SUPPORTED(status)) {
-            [connection sendMessageWithIQ:streamingControlIQ statType:TLPeerConnectionServiceStatTypeIqSetPushObject];
+            [connection sendStreamingIQ:streamingControlIQ];
         }
     }
 }
@@ -414,7 +1059,10 @@ static const int ddLogLevel = DDLogLevelWarning;
         return;
     }
 
-    RemotePlayerInfo *playerInfo = self.remotePlayers[peerConnectionId];
+    RemotePlayerInfo *playerInfo;
+    @synchronized (self) {
+        playerInfo = self.remotePlayers[peerConnectionId];
+    }
     if (!playerInfo) {
         return;
     }
@@ -462,17 +1110,28 @@ static const int ddLogLevel = DDLogLevelWarning;
             break;
 
         case StreamingControlModeStatusError:
+            playerInfo.completed = YES;
             [connection updatePeerWithStreamingStatus:StreamingStatusError];
+            [self releaseInteractiveIfCompleted];
             break;
 
         case StreamingControlModeStatusUnSupported:
+            playerInfo.completed = YES;
             [connection updatePeerWithStreamingStatus:StreamingStatusUnSupported];
+            [self releaseInteractiveIfCompleted];
             break;
 
         case StreamingControlModeStatusReady:
+            playerInfo.paused = YES;
+            [connection updatePeerWithStreamingStatus:StreamingStatusReady];
+            break;
+
         case StreamingControlModeStatusCompleted:
+        case StreamingControlModeStatusStopped:
             playerInfo.paused = YES;
+            playerInfo.completed = YES;
             [connection updatePeerWithStreamingStatus:StreamingStatusReady];
+            [self releaseInteractiveIfCompleted];
             break;
 
         default:
@@ -489,13 +1148,23 @@ static const int ddLogLevel = DDLogLevelWarning;
         return;
     }
 
-    RemotePlayerInfo *playerInfo = self.remotePlayers[peerConnectionId];
+    RemotePlayerInfo *playerInfo;
+    @synchronized (self) {
+        playerInfo = self.remotePlayers[peerConnectionId];
+    }
     if (!playerInfo) {
         return;
     }
     playerInfo.lastDate = receiveTime;
-    if (iq.lastRTT < MAX_LATENCY) {
-        playerInfo.latency = iq.lastRTT;
+
+    // Use the latency of the best recent sample instead of the last RTT which has some jitter.
+    int64_t streamerPosition = (self.localPlayer ? [self.localPlayer playerPosition] : 0);
+    if (iq.lastRTT > 0) {
+        int64_t offset = iq.playerPosition + iq.lastRTT / 2 - streamerPosition;
+        [playerInfo.clock addSampleWithOffset:offset roundTrip:iq.lastRTT time:receiveTime];
+        if (playerInfo.clock.latency < MAX_LATENCY) {
+            playerInfo.latency = playerInfo.clock.latency;
+        }
     }
     if (playerInfo.paused) {
         playerInfo.position = iq.playerPosition;
@@ -503,43 +1172,264 @@ static const int ddLogLevel = DDLogLevelWarning;
         playerInfo.position = iq.playerPosition + playerInfo.latency;
     }
 
-    int64_t streamerPosition = (self.localPlayer ? [self.localPlayer playerPosition] : 0);
     DDLogVerbose(@"%@ player %@ position=%lld streamerPosition=%lld dt=%lld time=%lld", LOG_TAG, peerConnectionId, iq.playerPosition, streamerPosition, streamerPosition - iq.playerPosition, receiveTime - self.startTime);
 
-    dispatch_async(self.readQueue, ^{
-        NSData *data = [self readBlockWithOffset:iq.offset length:iq.length request:iq.requestId];
+    // A coalesced request can cover several blocks: it is answered with as many StreamingDataIQ
+    // as necessary, each of them not exceeding the maximum data size supported by the peer.
+    int64_t length = MIN(iq.length, (int64_t)STREAMING_MAX_REQUEST_SIZE);
+    StreamingPeerStats *peerStats = [self.stats peerStatsWithId:peerConnectionId];
+    [peerStats recordRequest];
+    int64_t pendingBytes;
+    @synchronized (playerInfo) {
+        playerInfo.pendingBytes += length;
+        pendingBytes = playerInfo.pendingBytes;
+    }
+    [peerStats updateWithQueueDepth:pendingBytes drift:playerInfo.position - streamerPosition];
+
+    // The reads complete in any order: the sequence keeps the data sent to the peer in the order
+    // of its requests since older peers process the data blocks in their arrival order.
+    int64_t sequence = [playerInfo allocateSequence];
+    [self readAsyncBlockWithOffset:iq.offset length:length withBlock:^(NSData *data) {
+        [playerInfo sendWithSequence:sequence block:^{
+            [self sendDataWithConnection:connection playerInfo:playerInfo iq:iq length:length receiveTime:receiveTime peerStats:peerStats data:data];
+        }];
+    }];
+}
 
-        int64_t streamerPosition = self.localPlayer ? [self.localPlayer playerPosition] : 0;
-        int streamerLatency = (int) ([[NSDate date] timeIntervalSince1970] * 1000 - receiveTime);
-        StreamingDataIQ *streamingDataIQ = [[StreamingDataIQ alloc] initWithSerializer:[CallConnection STREAMING_DATA_SERIALIZER] requestId:iq.requestId ident:self.ident offset:iq.offset streamerPosition:streamerPosition timestamp:iq.timestamp streamerLatency:streamerLatency data:data start:0 length:(int32_t)data.length];
-        [connection sendMessageWithIQ:streamingDataIQ statType:TLPeerConnectionServiceStatTypeIqSetPushObject];
-    });
+- (void)sendDataWithConnection:(nonnull CallConnection *)connection playerInfo:(nonnull RemotePlayerInfo *)playerInfo iq:(nonnull StreamingRequestIQ *)iq length:(int64_t)length receiveTime:(int64_t)receiveTime peerStats:(nonnull StreamingPeerStats *)peerStats data:(nullable NSData *)data {
+    DDLogVerbose(@"%@ sendDataWithConnection: %@ offset: %lld length: %lld", LOG_TAG, connection, iq.offset, length);
+
+    @synchronized (playerInfo) {
+        playerInfo.pendingBytes -= length;
+    }
+
+    // The peer measured the request-to-data latency of its previous request.
+    [peerStats recordWithBytes:data.length latency:iq.lastRTT > 0 ? iq.lastRTT : -1];
+
+    int64_t streamerPosition = self.localPlayer ? [self.localPlayer playerPosition] : 0;
+    int streamerLatency = (int) ([[NSDate date] timeIntervalSince1970] * 1000 - receiveTime);
+    int32_t maxDataSize = [connection streamingMaxDataSize];
+    BOOL parity = STREAMING_PARITY_GROUP_SIZE > 0 && data.length > 0 && [connection isStreamingParitySupported];
+    TLBinaryPacketIQSerializer *serializer = [connection streamingDataSerializer];
+    int64_t endOffset;
+    @synchronized (self.pendingReads) {
+        endOffset = self.exporting ? -1 : self.lastPosition;
+    }
+    int32_t start = 0;
+    do {
+        int32_t frameLength = (int32_t)MIN((int64_t)maxDataSize, (int64_t)data.length - start);
+        BOOL endOfStream = endOffset >= 0 && iq.offset + start + frameLength >= endOffset;
+        StreamingDataIQ *streamingDataIQ = [[StreamingDataIQ alloc] initWithSerializer:serializer requestId:iq.requestId ident:self.ident offset:iq.offset + start streamerPosition:streamerPosition timestamp:iq.timestamp streamerLatency:streamerLatency data:data start:start length:frameLength endOfStream:endOfStream];
+        [connection sendStreamingIQ:streamingDataIQ priority:self.priority];
+        if (parity) {
+            [self sendParityWithConnection:connection playerInfo:playerInfo data:data start:start length:frameLength offset:iq.offset + start endOffset:endOffset];
+        }
+        start += frameLength;
+    } while (start < data.length);
+}
+
+- (void)sendParityWithConnection:(nonnull CallConnection *)connection playerInfo:(nonnull RemotePlayerInfo *)playerInfo data:(nonnull NSData *)data start:(int32_t)start length:(int32_t)length offset:(int64_t)offset endOffset:(int64_t)endOffset {
+    DDLogVerbose(@"%@ sendParityWithConnection: %@ offset: %lld length: %d endOffset: %lld", LOG_TAG, connection, offset, length, endOffset);
+
+    // The last blocks of the stream are protected by a smaller group.
+    BOOL last = endOffset >= 0 && offset + length >= endOffset;
+    StreamingParityIQ *parityIQ = nil;
+    @synchronized (playerInfo) {
+        NSUInteger count = [playerInfo addParityWithData:data start:start length:length offset:offset];
+        if (count >= STREAMING_PARITY_GROUP_SIZE || last) {
+            parityIQ = [[StreamingParityIQ alloc] initWithSerializer:[CallConnection STREAMING_PARITY_SERIALIZER] requestId:[self.call allocateRequestId] ident:self.ident offsets:playerInfo.parityOffsets lengths:playerInfo.parityLengths data:playerInfo.parityData];
+            playerInfo.parityData = nil;
+            playerInfo.parityOffsets = nil;
+            playerInfo.parityLengths = nil;
+        }
+    }
+
+    // Every block of the group was sent before it was added to the group: the parity comes after them.
+    if (parityIQ) {
+        [connection sendStreamingIQ:parityIQ priority:self.priority];
+    }
+}
+
+- (int64_t)streamSize {
+
+    return self.lastPosition;
 }
 
 - (void)readAsyncBlockWithOffset:(int64_t)offset length:(int64_t)length withBlock:(nonnull void (^)(NSData *_Nullable data))block {
     DDLogVerbose(@"%@ readAsyncBlockWithOffset: %lld length: %lld", LOG_TAG, offset, length);
 
+    // When the file is memory mapped, there is nothing to share: the range is a no-copy slice of the mapping.
+    if (self.mappedData || offset < 0 || length <= 0) {
+        dispatch_async(self.readQueue, ^{
+            block([self readBlockWithOffset:offset length:length request:0]);
+        });
+        return;
+    }
+
+    // The peers and the local player ask for overlapping ranges: the reads and the cache use the aligned
+    // blocks that cover the range, a block being read is shared by its requesters and each requester
+    // gets its range as a slice of the blocks.
+    int64_t blockOffset = offset - (offset % STREAMER_CACHE_CHUNK_SIZE);
+    NSUInteger count = (NSUInteger)((offset + length - blockOffset + STREAMER_CACHE_CHUNK_SIZE - 1) / STREAMER_CACHE_CHUNK_SIZE);
+    NSMutableArray<id> *blocks = [[NSMutableArray alloc] initWithCapacity:count];
+    for (NSUInteger i = 0; i < count; i++) {
+        [blocks addObject:[NSNull null]];
+    }
+
+    // The extra count is released once every block is cached or queued.
+    __block NSUInteger remaining = count + 1;
+    void (^onBlock)(NSUInteger index, NSData *_Nullable data) = ^(NSUInteger index, NSData *_Nullable data) {
+        BOOL done;
+        @synchronized (blocks) {
+            if (index < count && data) {
+                blocks[index] = data;
+            }
+            remaining--;
+            done = remaining == 0;
+        }
+        if (done) {
+            dispatch_async(self.readQueue, ^{
+                block([Streamer sliceWithBlocks:blocks blockOffset:blockOffset offset:offset length:length]);
+            });
+        }
+    };
+
+    NSMutableArray<StreamerPendingRead *> *newReads = [[NSMutableArray alloc] init];
+    @synchronized (self.pendingReads) {
+        for (NSUInteger i = 0; i < count; i++) {
+            NSNumber *key = [NSNumber numberWithLongLong:blockOffset + (int64_t)i * STREAMER_CACHE_CHUNK_SIZE];
+            NSData *data = self.chunkCache[key];
+            if (data) {
+                [self.chunkCacheOrder removeObject:key];
+                [self.chunkCacheOrder addObject:key];
+                onBlock(i, data);
+                continue;
+            }
+
+            StreamerPendingRead *pendingRead = self.pendingReads[key];
+            if (!pendingRead) {
+                pendingRead = [[StreamerPendingRead alloc] initWithOffset:key.longLongValue length:STREAMER_CACHE_CHUNK_SIZE];
+                self.pendingReads[key] = pendingRead;
+
+                // The file is being exported: wait until the whole block is written.
+                if (self.exporting && pendingRead.offset + pendingRead.length > self.lastPosition) {
+                    [self.parkedReads addObject:pendingRead];
+                } else {
+                    [newReads addObject:pendingRead];
+                }
+            }
+            [pendingRead.requesters addObject:^(NSData *_Nullable data) {
+                onBlock(i, data);
+            }];
+        }
+    }
+
+    for (StreamerPendingRead *pendingRead in newReads) {
+        [self readWithPendingRead:pendingRead];
+    }
+    onBlock(NSNotFound, nil);
+}
+
+- (void)readWithPendingRead:(nonnull StreamerPendingRead *)pendingRead {
+    DDLogVerbose(@"%@ readWithPendingRead: %lld length: %lld", LOG_TAG, pendingRead.offset, pendingRead.length);
+
     dispatch_async(self.readQueue, ^{
-        NSData *data = [self readBlockWithOffset:offset length:length request:0];
-        
-        block(data);
+        NSData *data = [self readBlockWithOffset:pendingRead.offset length:pendingRead.length request:0];
+        NSNumber *key = [NSNumber numberWithLongLong:pendingRead.offset];
+
+        NSArray<void (^)(NSData *_Nullable data)> *requesters;
+        @synchronized (self.pendingReads) {
+            requesters = [pendingRead.requesters copy];
+            [self.pendingReads removeObjectForKey:key];
+
+            // The last block of a file being exported is not complete yet.
+            if (data.length == STREAMER_CACHE_CHUNK_SIZE || (data.length > 0 && !self.exporting)) {
+                if (self.chunkCacheOrder.count >= STREAMER_CACHE_COUNT) {
+                    [self.chunkCache removeObjectForKey:self.chunkCacheOrder[0]];
+                    [self.chunkCacheOrder removeObjectAtIndex:0];
+                }
+                self.chunkCache[key] = data;
+                [self.chunkCacheOrder addObject:key];
+            }
+        }
+        for (void (^requester)(NSData *_Nullable data) in requesters) {
+            requester(data);
+        }
     });
 }
 
++ (nullable NSData *)sliceWithBlocks:(nonnull NSArray<id> *)blocks blockOffset:(int64_t)blockOffset offset:(int64_t)offset length:(int64_t)length {
+    DDLogVerbose(@"%@ sliceWithBlocks: %lld offset: %lld length: %lld", LOG_TAG, blockOffset, offset, length);
+
+    int64_t end = offset + length;
+    NSMutableData *result = nil;
+    for (id block in blocks) {
+        if (![block isKindOfClass:[NSData class]]) {
+            break;
+        }
+        NSData *data = block;
+        int64_t start = MAX(offset, blockOffset) - blockOffset;
+        int64_t last = MIN(end - blockOffset, (int64_t)data.length);
+        if (last <= start) {
+            break;
+        }
+        NSRange range = NSMakeRange((NSUInteger)start, (NSUInteger)(last - start));
+        if (!result && last - start == length) {
+            return [data subdataWithRange:range];
+        }
+        if (!result) {
+            result = [[NSMutableData alloc] initWithCapacity:(NSUInteger)length];
+        }
+        [result appendData:[data subdataWithRange:range]];
+
+        // A short block is the end of the stream.
+        if (data.length < STREAMER_CACHE_CHUNK_SIZE) {
+            break;
+        }
+        blockOffset += STREAMER_CACHE_CHUNK_SIZE;
+    }
+    return result;
+}
+
 - (nullable NSData *)readBlockWithOffset:(int64_t)offset length:(int64_t)length  request:(int64_t)request {
     DDLogVerbose(@"%@ readBlockWithOffset: %lld length: %lld", LOG_TAG, offset, length);
 
-    NSData *data = nil;
-    if (offset < self.lastPosition) {
+    if (offset < 0 || length <= 0 || offset >= self.lastPosition) {
+        return nil;
+    }
+    if (length > self.lastPosition - offset) {
+        length = self.lastPosition - offset;
+    }
+
+    NSData *mappedData = self.mappedData;
+    if (mappedData) {
+        // The slice keeps the mapping alive until the IQ has been serialized.
+        const char *bytes = (const char *)mappedData.bytes + offset;
+        return [[NSData alloc] initWithBytesNoCopy:(void *)bytes length:(NSUInteger)length deallocator:^(void *bytes, NSUInteger length) {
+            (void)mappedData;
+        }];
+    }
+
+    NSFileHandle *fileHandle = self.fileHandle;
+    if (!fileHandle) {
+        return nil;
+    }
+
+    // Fallback when the file could not be mapped: the file handle has a single position.
+    NSData *data;
+    @synchronized (fileHandle) {
+        if (!self.fileHandle) {
+            return nil;
+        }
         if (self.position != offset) {
-            [self.fileHandle seekToFileOffset:offset];
+            [fileHandle seekToFileOffset:offset];
         }
-        data = [self.fileHandle readDataOfLength:length];
+        data = [fileHandle readDataOfLength:(NSUInteger)length];
         self.position = offset + data.length;
     }
     // DDLogError(@"%@ readBlockWithOffset: %lld length: %lld position: %lld request: %lld", LOG_TAG, offset, (int64_t)data.length, self.position, request);
 
-    return data;
+    return data.length > 0 ? data : nil;
 }
 
 @end
@@ -0,0 +1,41 @@
+/*
+ *  Copyright (c) 2023 twinlife SA.
+ *  SPDX-License-Identifier: AGPL-3.0-only
+ *
+ *  Contributors:
+ *   Stephane Carrez (Stephane.Carrez@twin.life)
+ */
+
+#import <Foundation/Foundation.h>
+
+//
+// Interface: StreamingClock
+//
+
+/// Estimate the offset between two media positions from (offset, round trip) samples, in the same
+/// way as NTP: the sample with the smallest round trip of the last samples is the most accurate
+/// one and the skew is the slope of these selected offsets over time.
+@interface StreamingClock : NSObject
+
+/// The offset (ms) given by the best recent sample.
+@property (readonly) int64_t offset;
+
+/// The skew in ms per second: how fast the offset changes.
+@property (readonly) double skew;
+
+/// The one-way latency (ms) estimated from the best recent sample.
+@property (readonly) int latency;
+
+/// The number of samples used since the last reset.
+@property (readonly) int sampleCount;
+
+/// Add a sample measured at the given time (ms).
+- (void)addSampleWithOffset:(int64_t)offset roundTrip:(int64_t)roundTrip time:(int64_t)time;
+
+/// Get the offset predicted at the given time (ms) by using the skew.
+- (int64_t)offsetWithTime:(int64_t)time;
+
+/// Forget the samples after a discontinuity (seek, pause, resume).
+- (void)reset;
+
+@end
@@ -0,0 +1,147 @@
+/*
+ *  Copyright (c) 2023 twinlife SA.
+ *  SPDX-License-Identifier: AGPL-3.0-only
+ *
+ *  Contributors:
+ *   Stephane Carrez (Stephane.Carrez@twin.life)
+ */
+
+#import "StreamingClock.h"
+
+// Number of samples among which we select the one with the smallest round trip.
+#define CLOCK_FILTER_SIZE    8
+
+// Number of selected offsets used to compute the skew, and the minimum period they must cover.
+#define CLOCK_HISTORY_SIZE   32
+#define CLOCK_SKEW_MIN_TIME  10000
+
+// Maximum skew (ms per second) that we accept.
+#define CLOCK_MAX_SKEW       50.0
+
+typedef struct {
+    int64_t offset;
+    int64_t roundTrip;
+    int64_t time;
+} ClockSample_t;
+
+//
+// Interface: StreamingClock
+//
+
+@interface StreamingClock ()
+
+@property int64_t offset;
+@property double skew;
+@property int latency;
+@property int sampleCount;
+@property (nonatomic) int64_t offsetTime;
+
+/// Compute the skew with a least squares fit on the selected offsets.
+- (void)updateSkew;
+
+@end
+
+//
+// Implementation: StreamingClock
+//
+
+#undef LOG_TAG
+#define LOG_TAG @"StreamingClock"
+
+@implementation StreamingClock {
+    ClockSample_t _filter[CLOCK_FILTER_SIZE];
+    ClockSample_t _history[CLOCK_HISTORY_SIZE];
+    int _historyCount;
+}
+
+- (nonnull instancetype)init {
+
+    self = [super init];
+    if (self) {
+        [self reset];
+    }
+    return self;
+}
+
+- (void)addSampleWithOffset:(int64_t)offset roundTrip:(int64_t)roundTrip time:(int64_t)time {
+
+    if (roundTrip < 0) {
+        return;
+    }
+
+    @synchronized (self) {
+        _filter[self.sampleCount % CLOCK_FILTER_SIZE] = (ClockSample_t){ offset, roundTrip, time };
+        self.sampleCount++;
+
+        int count = MIN(self.sampleCount, CLOCK_FILTER_SIZE);
+        ClockSample_t *best = &_filter[0];
+        for (int i = 1; i < count; i++) {
+            if (_filter[i].roundTrip < best->roundTrip) {
+                best = &_filter[i];
+            }
+        }
+
+        self.offset = best->offset;
+        self.offsetTime = best->time;
+        self.latency = (int)(best->roundTrip / 2);
+
+        // Keep each selected sample once to compute the skew.
+        if (_historyCount == 0 || _history[(_historyCount - 1) % CLOCK_HISTORY_SIZE].time != best->time) {
+            _history[_historyCount % CLOCK_HISTORY_SIZE] = *best;
+            _historyCount++;
+            [self updateSkew];
+        }
+    }
+}
+
+- (int64_t)offsetWithTime:(int64_t)time {
+
+    @synchronized (self) {
+        return self.offset + (int64_t)(self.skew * (double)(time - self.offsetTime) / 1000.0);
+    }
+}
+
+- (void)reset {
+
+    @synchronized (self) {
+        self.offset = 0;
+        self.offsetTime = 0;
+        self.skew = 0;
+        self.latency = 0;
+        self.sampleCount = 0;
+        _historyCount = 0;
+    }
+}
+
+- (void)updateSkew {
+
+    int count = MIN(_historyCount, CLOCK_HISTORY_SIZE);
+    if (count < 4) {
+        return;
+    }
+
+    // Use times relative to the first sample to keep the sums small.
+    int first = _historyCount - count;
+    int64_t t0 = _history[first % CLOCK_HISTORY_SIZE].time;
+    double sumT = 0, sumO = 0, sumTT = 0, sumTO = 0;
+    int64_t lastTime = t0;
+    for (int i = first; i < _historyCount; i++) {
+        ClockSample_t *sample = &_history[i % CLOCK_HISTORY_SIZE];
+        double t = (double)(sample->time - t0);
+        double o = (double)sample->offset;
+        sumT += t;
+        sumO += o;
+        sumTT += t * t;
+        sumTO += t * o;
+        lastTime = sample->time;
+    }
+    double d = count * sumTT - sumT * sumT;
+    if (lastTime - t0 < CLOCK_SKEW_MIN_TIME || d <= 0) {
+        return;
+    }
+
+    double skew = 1000.0 * (count * sumTO - sumT * sumO) / d;
+    self.skew = MAX(-CLOCK_MAX_SKEW, MIN(CLOCK_MAX_SKEW, skew));
+}
+
+@end
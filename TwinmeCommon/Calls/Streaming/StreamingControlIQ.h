@@ -18,6 +18,8 @@ typedef enum {
     StreamingControlModeResume,
     StreamingControlModeSeek,
     StreamingControlModeStop,
+    StreamingControlModePrepareAudio,
+    StreamingControlModeStartInteractiveAudio,
 
     // Queries from the peer to operate on the streamer (values 11..20).
     StreamingControlModeAskPause,
@@ -35,6 +37,12 @@ typedef enum {
     StreamingControlModeStatusCompleted
 } StreamingControlMode;
 
+// Streams of a call with an interactive priority (a voice note) are served before the background ones (the music).
+typedef enum {
+    StreamingPriorityBackground,
+    StreamingPriorityInteractive
+} StreamingPriority;
+
 //
 // Interface: StreamingControlIQSerializer
 //
@@ -45,6 +53,19 @@ typedef enum {
 
 @end
 
+//
+// Interface: StreamingControlIQDeltaSerializer
+//
+
+/// Compact encoding (schema version 2) used when the peer has the "stream-ctl2" capability.
+/// The timestamp is sent as a delta with the start of its stream, the serializer keeps the stream bases
+/// of each direction of a single connection and must not be shared.
+@interface StreamingControlIQDeltaSerializer : TLBinaryPacketIQSerializer
+
+- (nonnull instancetype)initWithSchema:(nonnull NSString *)schema;
+
+@end
+
 //
 // Interface: StreamingControlIQ
 //
@@ -57,7 +78,11 @@ typedef enum {
 @property (readonly) int64_t timestamp;
 @property (readonly) int64_t position;
 @property (readonly) int latency;
+/// Number of audio packets of the stream given by the start (0 when unknown, only transmitted with the schema version 2).
+@property (readonly) int64_t packetCount;
 
 - (nonnull instancetype)initWithSerializer:(nonnull TLBinaryPacketIQSerializer *)serializer requestId:(int64_t)requestId ident:(int64_t)ident mode:(StreamingControlMode)mode length:(int64_t)length timestamp:(int64_t)timestamp position:(int64_t)position latency:(int)latency;
 
+- (nonnull instancetype)initWithSerializer:(nonnull TLBinaryPacketIQSerializer *)serializer requestId:(int64_t)requestId ident:(int64_t)ident mode:(StreamingControlMode)mode length:(int64_t)length timestamp:(int64_t)timestamp position:(int64_t)position latency:(int)latency packetCount:(int64_t)packetCount;
+
 @end
@@ -36,193 +36,214 @@
  *
  * </pre>
  *
+ * Schema version 2
+ * <pre>
+ * {
+ *  "schemaId":"a080a7a6-59fe-4463-8ac4-61d897a2aa50",
+ *  "schemaVersion":"2",
+ *
+ *  "type":"record",
+ *  "name":"StreamingControlIQ",
+ *  "namespace":"org.twinlife.schemas.calls",
+ *  "super":"org.twinlife.schemas.BinaryPacketIQ"
+ *  "fields": [
+ *     {"name":"ident", "type":"long"},
+ *     {"name":"control", "type":"enum"},
+ *     {"name":"length", "type":"long"},
+ *     {"name":"timestampDelta", "type":"long"},
+ *     {"name":"position", "type":"long"},
+ *     {"name":"latency", "type":"int"},
+ *     {"name":"packetCount", "type":"long"}
+ *  ]
+ * }
+ *
+ * </pre>
+ *
+ * The version 2 is used on a connection when the peer has the "stream-ctl2" capability.
+ * - the start and prepare controls carry the complete timestamp which becomes the base of that ident,
+ * - the other controls carry timestampDelta, the difference with the base of their ident.
+ * A control only depends on the start of its stream and not on the previous controls: a lost control
+ * does not prevent decoding the next ones.  Both directions share the base of a stream since the
+ * player status controls refer to the start they have received.
+ * The start controls give the stream size in length (0 while it is exported) and its number of packets.
+ *
  * - Streaming starts either with a START_AUDIO_STREAMING or a START_VIDEO_STREAMING,
  * - The streaming can be paused with PAUSE_STREAMING and then resumed with RESUME_STREAMING,
  * - We can seek at a given position with SEEK_STREAMING,
  * - Peek can ask some operation on the streamer with the ASK_PAUSE_STREAMING, ASK_RESUME_STREAMING,
  *   ASK_SEEK_STREAMING and ASK_STOP_STREAMING
  * - Streaming is stopped with STOP_STREAMING
+ * - The next stream of a queue is announced with PREPARE_AUDIO_STREAMING so that the peers prefetch
+ *   its first blocks, it starts playing when the START_AUDIO_STREAMING with the same ident is received.
+ * - An interactive stream (a voice note) is started with START_INTERACTIVE_AUDIO_STREAMING, it plays with
+ *   the current stream which is not replaced, the other controls select the stream with the ident.
  *
  */
 
-//
-// Implementation: StreamingControlIQSerializer
-//
-
-@implementation StreamingControlIQSerializer
-
-- (nonnull instancetype)initWithSchema:(nonnull NSString *)schema schemaVersion:(int)schemaVersion {
+static int streamingControlModeToEnum(StreamingControlMode mode) {
 
-    return [super initWithSchema:schema schemaVersion:schemaVersion class:[StreamingControlIQ class]];
-}
-
-- (void)serializeWithSerializerFactory:(TLSerializerFactory *)serializerFactory encoder:(id<TLEncoder>)encoder object:(NSObject *)object {
-    
-    [super serializeWithSerializerFactory:serializerFactory encoder:encoder object:object];
-    
-    StreamingControlIQ *streamingControlIQ = (StreamingControlIQ *)object;
-    [encoder writeLong:streamingControlIQ.ident];
-    switch (streamingControlIQ.mode) {
+    switch (mode) {
         case StreamingControlModeStartAudio:
-            [encoder writeEnum:1];
-            break;
+            return 1;
 
         case StreamingControlModeStartVideo:
-            [encoder writeEnum:2];
-            break;
+            return 2;
 
         case StreamingControlModePause:
-            [encoder writeEnum:3];
-            break;
+            return 3;
 
         case StreamingControlModeResume:
-            [encoder writeEnum:4];
-            break;
+            return 4;
 
         case StreamingControlModeSeek:
-            [encoder writeEnum:5];
-            break;
+            return 5;
 
         case StreamingControlModeStop:
-            [encoder writeEnum:6];
-            break;
+            return 6;
+
+        case StreamingControlModePrepareAudio:
+            return 7;
+
+        case StreamingControlModeStartInteractiveAudio:
+            return 8;
 
             // Queries operation range 11..20
         case StreamingControlModeAskPause:
-            [encoder writeEnum:11];
-            break;
+            return 11;
 
         case StreamingControlModeAskResume:
-            [encoder writeEnum:12];
-            break;
+            return 12;
 
         case StreamingControlModeAskSeek:
-            [encoder writeEnum:13];
-            break;
+            return 13;
 
         case StreamingControlModeAskStop:
-            [encoder writeEnum:14];
-            break;
+            return 14;
 
             // Status operations range 21..30
         case StreamingControlModeStatusPlaying:
-            [encoder writeEnum:21];
-            break;
+            return 21;
 
         case StreamingControlModeStatusPaused:
-            [encoder writeEnum:22];
-            break;
+            return 22;
 
         case StreamingControlModeStatusReady:
-            [encoder writeEnum:23];
-            break;
+            return 23;
 
         case StreamingControlModeStatusUnSupported:
-            [encoder writeEnum:24];
-            break;
+            return 24;
 
         case StreamingControlModeStatusError:
-            [encoder writeEnum:25];
-            break;
+            return 25;
 
         case StreamingControlModeStatusStopped:
-            [encoder writeEnum:26];
-            break;
+            return 26;
 
         case StreamingControlModeStatusCompleted:
-            [encoder writeEnum:27];
-            break;
+            return 27;
 
         default:
             // When we serialize, we must know how to send the control command.
             // UNKNOWN is not used when sending but can be obtained when we deserialize.
             @throw [NSException exceptionWithName:@"TLEncoderException" reason:nil userInfo:nil];
     }
-    [encoder writeLong:streamingControlIQ.length];
-    [encoder writeLong:streamingControlIQ.timestamp];
-    [encoder writeLong:streamingControlIQ.position];
-    [encoder writeInt:streamingControlIQ.latency];
 }
 
-- (NSObject *)deserializeWithSerializerFactory:(TLSerializerFactory *)serializerFactory decoder:(id<TLDecoder>)decoder {
+static StreamingControlMode streamingControlModeFromEnum(int value) {
 
-    TLBinaryPacketIQ *iq = (TLBinaryPacketIQ *)[super deserializeWithSerializerFactory:serializerFactory decoder:decoder];
-    
-    int64_t ident = [decoder readLong];
-    StreamingControlMode mode;
-    switch ([decoder readEnum]) {
+    switch (value) {
         case 1:
-            mode = StreamingControlModeStartAudio;
-            break;
+            return StreamingControlModeStartAudio;
 
         case 2:
-            mode = StreamingControlModeStartVideo;
-            break;
+            return StreamingControlModeStartVideo;
 
         case 3:
-            mode = StreamingControlModePause;
-            break;
+            return StreamingControlModePause;
 
         case 4:
-            mode = StreamingControlModeResume;
-            break;
+            return StreamingControlModeResume;
 
         case 5:
-            mode = StreamingControlModeSeek;
-            break;
+            return StreamingControlModeSeek;
 
         case 6:
-            mode = StreamingControlModeStop;
-            break;
+            return StreamingControlModeStop;
+
+        case 7:
+            return StreamingControlModePrepareAudio;
+
+        case 8:
+            return StreamingControlModeStartInteractiveAudio;
 
         case 11:
-            mode = StreamingControlModeAskPause;
-            break;
+            return StreamingControlModeAskPause;
 
         case 12:
-            mode = StreamingControlModeAskResume;
-            break;
+            return StreamingControlModeAskResume;
 
         case 13:
-            mode = StreamingControlModeAskSeek;
-            break;
+            return StreamingControlModeAskSeek;
 
         case 14:
-            mode = StreamingControlModeAskStop;
-            break;
+            return StreamingControlModeAskStop;
 
         case 21:
-            mode = StreamingControlModeStatusPlaying;
-            break;
+            return StreamingControlModeStatusPlaying;
 
         case 22:
-            mode = StreamingControlModeStatusPaused;
-            break;
+            return StreamingControlModeStatusPaused;
 
         case 23:
-            mode = StreamingControlModeStatusReady;
-            break;
+            return StreamingControlModeStatusReady;
 
         case 24:
-            mode = StreamingControlModeStatusUnSupported;
-            break;
+            return StreamingControlModeStatusUnSupported;
 
         case 25:
-            mode = StreamingControlModeStatusError;
-            break;
+            return StreamingControlModeStatusError;
 
         case 26:
-            mode = StreamingControlModeStatusStopped;
-            break;
+            return StreamingControlModeStatusStopped;
 
         case 27:
-            mode = StreamingControlModeStatusCompleted;
-            break;
+            return StreamingControlModeStatusCompleted;
 
         default:
-            mode = StreamingControlModeUnknown;
-            break;
+            return StreamingControlModeUnknown;
     }
+}
+
+//
+// Implementation: StreamingControlIQSerializer
+//
+
+@implementation StreamingControlIQSerializer
+
+- (nonnull instancetype)initWithSchema:(nonnull NSString *)schema schemaVersion:(int)schemaVersion {
+
+    return [super initWithSchema:schema schemaVersion:schemaVersion class:[StreamingControlIQ class]];
+}
+
+- (void)serializeWithSerializerFactory:(TLSerializerFactory *)serializerFactory encoder:(id<TLEncoder>)encoder object:(NSObject *)object {
+    
+    [super serializeWithSerializerFactory:serializerFactory encoder:encoder object:object];
+    
+    StreamingControlIQ *streamingControlIQ = (StreamingControlIQ *)object;
+    [encoder writeLong:streamingControlIQ.ident];
+    [encoder writeEnum:streamingControlModeToEnum(streamingControlIQ.mode)];
+    [encoder writeLong:streamingControlIQ.length];
+    [encoder writeLong:streamingControlIQ.timestamp];
+    [encoder writeLong:streamingControlIQ.position];
+    [encoder writeInt:streamingControlIQ.latency];
+}
+
+- (NSObject *)deserializeWithSerializerFactory:(TLSerializerFactory *)serializerFactory decoder:(id<TLDecoder>)decoder {
+
+    TLBinaryPacketIQ *iq = (TLBinaryPacketIQ *)[super deserializeWithSerializerFactory:serializerFactory decoder:decoder];
+    
+    int64_t ident = [decoder readLong];
+    StreamingControlMode mode = streamingControlModeFromEnum([decoder readEnum]);
     int64_t length = [decoder readLong];
     int64_t timestamp = [decoder readLong];
     int64_t position = [decoder readLong];
@@ -233,6 +254,116 @@
 
 @end
 
+//
+// Implementation: StreamingControlIQDeltaSerializer
+//
+
+// Maximum number of stream timestamp bases kept by a connection (the oldest streams are forgotten).
+#define STREAMING_CONTROL_MAX_BASES  16
+
+@interface StreamingControlIQDeltaSerializer ()
+
+/// The bases of the controls that we send, and of those that we receive: each side numbers its own
+/// streams and a direction is ordered on the data channel, so that its encoder and decoder agree.
+@property (nonatomic, readonly, nonnull) NSMutableDictionary<NSNumber *, NSNumber *> *sendBases;
+@property (nonatomic, readonly, nonnull) NSMutableDictionary<NSNumber *, NSNumber *> *receiveBases;
+
+/// Returns YES if the control carries the complete timestamp and defines the base of its stream.
++ (BOOL)isBaseWithMode:(StreamingControlMode)mode;
+
+/// Record the base timestamp of the stream in the table (must be called with the serializer lock held).
+- (void)setBaseWithBases:(nonnull NSMutableDictionary<NSNumber *, NSNumber *> *)bases ident:(int64_t)ident timestamp:(int64_t)timestamp;
+
+@end
+
+@implementation StreamingControlIQDeltaSerializer
+
+- (nonnull instancetype)initWithSchema:(nonnull NSString *)schema {
+
+    self = [super initWithSchema:schema schemaVersion:2 class:[StreamingControlIQ class]];
+    if (self) {
+        _sendBases = [[NSMutableDictionary alloc] init];
+        _receiveBases = [[NSMutableDictionary alloc] init];
+    }
+    return self;
+}
+
++ (BOOL)isBaseWithMode:(StreamingControlMode)mode {
+
+    switch (mode) {
+        case StreamingControlModeStartAudio:
+        case StreamingControlModeStartVideo:
+        case StreamingControlModeStartInteractiveAudio:
+        case StreamingControlModePrepareAudio:
+            return YES;
+
+        default:
+            return NO;
+    }
+}
+
+- (void)setBaseWithBases:(nonnull NSMutableDictionary<NSNumber *, NSNumber *> *)bases ident:(int64_t)ident timestamp:(int64_t)timestamp {
+
+    NSNumber *key = [NSNumber numberWithLongLong:ident];
+    if (!bases[key] && bases.count >= STREAMING_CONTROL_MAX_BASES) {
+        // The idents are allocated in increasing order: forget the oldest stream.
+        NSNumber *oldest = [[bases allKeys] valueForKeyPath:@"@min.self"];
+        [bases removeObjectForKey:oldest];
+    }
+    bases[key] = [NSNumber numberWithLongLong:timestamp];
+}
+
+- (void)serializeWithSerializerFactory:(TLSerializerFactory *)serializerFactory encoder:(id<TLEncoder>)encoder object:(NSObject *)object {
+
+    [super serializeWithSerializerFactory:serializerFactory encoder:encoder object:object];
+
+    StreamingControlIQ *streamingControlIQ = (StreamingControlIQ *)object;
+    int enumValue = streamingControlModeToEnum(streamingControlIQ.mode);
+    int64_t timestamp = streamingControlIQ.timestamp;
+    @synchronized (self) {
+        if ([StreamingControlIQDeltaSerializer isBaseWithMode:streamingControlIQ.mode]) {
+            [self setBaseWithBases:self.sendBases ident:streamingControlIQ.ident timestamp:timestamp];
+        } else {
+            NSNumber *base = self.sendBases[[NSNumber numberWithLongLong:streamingControlIQ.ident]];
+            timestamp -= base ? base.longLongValue : 0;
+        }
+    }
+    [encoder writeLong:streamingControlIQ.ident];
+    [encoder writeEnum:enumValue];
+    [encoder writeLong:streamingControlIQ.length];
+    [encoder writeLong:timestamp];
+    [encoder writeLong:streamingControlIQ.position];
+    [encoder writeInt:streamingControlIQ.latency];
+    [encoder writeLong:streamingControlIQ.packetCount];
+}
+
+- (NSObject *)deserializeWithSerializerFactory:(TLSerializerFactory *)serializerFactory decoder:(id<TLDecoder>)decoder {
+
+    TLBinaryPacketIQ *iq = (TLBinaryPacketIQ *)[super deserializeWithSerializerFactory:serializerFactory decoder:decoder];
+
+    int64_t ident = [decoder readLong];
+    StreamingControlMode mode = streamingControlModeFromEnum([decoder readEnum]);
+    int64_t length = [decoder readLong];
+    int64_t timestamp = [decoder readLong];
+    int64_t position = [decoder readLong];
+    int latency = [decoder readInt];
+    int64_t packetCount = [decoder readLong];
+
+    // A control of a stream whose start is not known gets a 0 base: that stream is ignored by the receiver.
+    @synchronized (self) {
+        if ([StreamingControlIQDeltaSerializer isBaseWithMode:mode]) {
+            [self setBaseWithBases:self.receiveBases ident:ident timestamp:timestamp];
+        } else {
+            NSNumber *base = self.receiveBases[[NSNumber numberWithLongLong:ident]];
+            timestamp += base ? base.longLongValue : 0;
+        }
+    }
+
+    return [[StreamingControlIQ alloc] initWithSerializer:self requestId:iq.requestId ident:ident mode:mode length:length timestamp:timestamp position:position latency:latency packetCount:packetCount];
+}
+
+@end
+
 //
 // Implementation: StreamingControlIQ
 //
@@ -241,6 +372,11 @@
 
 - (nonnull instancetype)initWithSerializer:(nonnull TLBinaryPacketIQSerializer *)serializer requestId:(int64_t)requestId ident:(int64_t)ident mode:(StreamingControlMode)mode length:(int64_t)length timestamp:(int64_t)timestamp position:(int64_t)position latency:(int)latency {
 
+    return [self initWithSerializer:serializer requestId:requestId ident:ident mode:mode length:length timestamp:timestamp position:position latency:latency packetCount:0];
+}
+
+- (nonnull instancetype)initWithSerializer:(nonnull TLBinaryPacketIQSerializer *)serializer requestId:(int64_t)requestId ident:(int64_t)ident mode:(StreamingControlMode)mode length:(int64_t)length timestamp:(int64_t)timestamp position:(int64_t)position latency:(int)latency packetCount:(int64_t)packetCount {
+
     self = [super initWithSerializer:serializer requestId:requestId];
     
     if (self) {
@@ -250,6 +386,7 @@
         _timestamp = timestamp;
         _position = position;
         _latency = latency;
+        _packetCount = packetCount;
     }
     return self;
 }
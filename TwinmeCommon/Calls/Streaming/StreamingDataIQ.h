@@ -8,6 +8,12 @@
 
 #import <Twinlife/TLBinaryPacketIQ.h>
 
+// Size of data blocks exchanged with peers that only support the "stream" capability.
+#define STREAMING_DATA_DEFAULT_SIZE  8192
+
+// Maximum size of a data block (and of a coalesced request) with peers supporting the "stream-large" capability.
+#define STREAMING_DATA_MAX_SIZE      (64*1024)
+
 //
 // Interface: StreamingDataIQSerializer
 //
@@ -32,7 +38,9 @@
 @property (readonly, nullable) NSData* data;
 @property (readonly) int32_t start;
 @property (readonly) int32_t length;
+/// Set on the block that contains the last byte of the stream (only transmitted with the schema version 2).
+@property (readonly) BOOL endOfStream;
 
-- (nonnull instancetype)initWithSerializer:(nonnull TLBinaryPacketIQSerializer *)serializer requestId:(int64_t)requestId ident:(int64_t)ident offset:(int64_t)offset streamerPosition:(int64_t)streamerPosition timestamp:(int64_t)timestamp streamerLatency:(int)streamerLatency data:(nullable NSData*)data start:(int32_t)start length:(int32_t)length;
+- (nonnull instancetype)initWithSerializer:(nonnull TLBinaryPacketIQSerializer *)serializer requestId:(int64_t)requestId ident:(int64_t)ident offset:(int64_t)offset streamerPosition:(int64_t)streamerPosition timestamp:(int64_t)timestamp streamerLatency:(int)streamerLatency data:(nullable NSData*)data start:(int32_t)start length:(int32_t)length endOfStream:(BOOL)endOfStream;
 
 @end
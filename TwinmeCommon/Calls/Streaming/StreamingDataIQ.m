@@ -36,6 +36,32 @@
  *
  * </pre>
  *
+ * Schema version 2
+ * <pre>
+ * {
+ *  "schemaId":"5a5d0994-2ca3-4a62-9da3-9b7d5c4abdd4",
+ *  "schemaVersion":"2",
+ *
+ *  "type":"record",
+ *  "name":"StreamingDataIQ",
+ *  "namespace":"org.twinlife.schemas.calls",
+ *  "super":"org.twinlife.schemas.BinaryPacketIQ"
+ *  "fields": [
+ *     {"name":"ident", "type":"long"},
+ *     {"name":"offset", "type":"long"},
+ *     {"name":"timestamp", "type":"long"},
+ *     {"name":"streamerPosition", "type":"long"},
+ *     {"name":"streamerLatency", "type":"int"},
+ *     {"name":"data", "type": [null, "bytes"]},
+ *     {"name":"endOfStream", "type":"boolean"}
+ *  ]
+ * }
+ *
+ * </pre>
+ *
+ * The version 2 is sent to the peers having the "stream-eof" capability: the player knows the end
+ * of the stream without looking at the size of the blocks.
+ *
  * @see StreamingRequestIQ
  */
 
@@ -43,11 +69,21 @@
 // Implementation: StreamingDataIQSerializer
 //
 
+@interface StreamingDataIQSerializer ()
+
+@property (nonatomic, readonly) BOOL hasEndOfStream;
+
+@end
+
 @implementation StreamingDataIQSerializer
 
 - (nonnull instancetype)initWithSchema:(nonnull NSString *)schema schemaVersion:(int)schemaVersion {
 
-    return [super initWithSchema:schema schemaVersion:schemaVersion class:[StreamingDataIQ class]];
+    self = [super initWithSchema:schema schemaVersion:schemaVersion class:[StreamingDataIQ class]];
+    if (self) {
+        _hasEndOfStream = schemaVersion >= 2;
+    }
+    return self;
 }
 
 - (void)serializeWithSerializerFactory:(TLSerializerFactory *)serializerFactory encoder:(id<TLEncoder>)encoder object:(NSObject *)object {
@@ -66,6 +102,9 @@
         [encoder writeEnum:1];
         [encoder writeDataWithData:streamingDataIQ.data start:streamingDataIQ.start length:streamingDataIQ.length];
     }
+    if (self.hasEndOfStream) {
+        [encoder writeBoolean:streamingDataIQ.endOfStream];
+    }
 }
 
 - (NSObject *)deserializeWithSerializerFactory:(TLSerializerFactory *)serializerFactory decoder:(id<TLDecoder>)decoder {
@@ -86,8 +125,9 @@
         data = [decoder readData];
         length = (int32_t) data.length;
     }
+    BOOL endOfStream = self.hasEndOfStream ? [decoder readBoolean] : NO;
 
-    return [[StreamingDataIQ alloc] initWithSerializer:self requestId:iq.requestId ident:ident offset:offset streamerPosition:streamerPosition timestamp:timestamp streamerLatency:streamerLatency data:data start:0 length:length];
+    return [[StreamingDataIQ alloc] initWithSerializer:self requestId:iq.requestId ident:ident offset:offset streamerPosition:streamerPosition timestamp:timestamp streamerLatency:streamerLatency data:data start:0 length:length endOfStream:endOfStream];
 }
 
 @end
@@ -98,7 +138,7 @@
 
 @implementation StreamingDataIQ
 
-- (nonnull instancetype)initWithSerializer:(nonnull TLBinaryPacketIQSerializer *)serializer requestId:(int64_t)requestId ident:(int64_t)ident offset:(int64_t)offset streamerPosition:(int64_t)streamerPosition timestamp:(int64_t)timestamp streamerLatency:(int)streamerLatency data:(nullable NSData*)data start:(int32_t)start length:(int32_t)length {
+- (nonnull instancetype)initWithSerializer:(nonnull TLBinaryPacketIQSerializer *)serializer requestId:(int64_t)requestId ident:(int64_t)ident offset:(int64_t)offset streamerPosition:(int64_t)streamerPosition timestamp:(int64_t)timestamp streamerLatency:(int)streamerLatency data:(nullable NSData*)data start:(int32_t)start length:(int32_t)length endOfStream:(BOOL)endOfStream {
 
     self = [super initWithSerializer:serializer requestId:requestId];
     
@@ -111,6 +151,7 @@
         _data = data;
         _start = start;
         _length = length;
+        _endOfStream = endOfStream;
     }
     return self;
 }
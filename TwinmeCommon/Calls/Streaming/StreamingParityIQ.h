@@ -0,0 +1,44 @@
+/*
+ *  Copyright (c) 2023 twinlife SA.
+ *  SPDX-License-Identifier: AGPL-3.0-only
+ *
+ *  Contributors:
+ *   Stephane Carrez (Stephane.Carrez@twin.life)
+ */
+
+#import <Twinlife/TLBinaryPacketIQ.h>
+
+// Number of data blocks protected by a parity block (0 to disable the parity blocks).
+#define STREAMING_PARITY_GROUP_SIZE  4
+
+//
+// Interface: StreamingParityIQSerializer
+//
+
+@interface StreamingParityIQSerializer : TLBinaryPacketIQSerializer
+
+- (nonnull instancetype)initWithSchema:(nonnull NSString *)schema schemaVersion:(int)schemaVersion;
+
+@end
+
+//
+// Interface: StreamingParityIQ
+//
+
+/// The XOR of a group of data blocks sent to a peer: the peer can rebuild one missing block of the group.
+@interface StreamingParityIQ : TLBinaryPacketIQ
+
+@property (readonly) int64_t ident;
+/// The offset of each data block of the group.
+@property (readonly, nonnull) NSArray<NSNumber *> *offsets;
+/// The length of each data block of the group.
+@property (readonly, nonnull) NSArray<NSNumber *> *lengths;
+/// The XOR of the data blocks, its length is the length of the longest block.
+@property (readonly, nonnull) NSData *data;
+
+- (nonnull instancetype)initWithSerializer:(nonnull TLBinaryPacketIQSerializer *)serializer requestId:(int64_t)requestId ident:(int64_t)ident offsets:(nonnull NSArray<NSNumber *> *)offsets lengths:(nonnull NSArray<NSNumber *> *)lengths data:(nonnull NSData *)data;
+
+/// Rebuild the data block at the given index from the parity and the other blocks of the group.
+- (nonnull NSData *)recoverBlockAtIndex:(NSUInteger)index blocks:(nonnull NSArray<NSData *> *)blocks;
+
+@end
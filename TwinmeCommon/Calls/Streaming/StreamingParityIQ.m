@@ -0,0 +1,127 @@
+/*
+ *  Copyright (c) 2023 twinlife SA.
+ *  SPDX-License-Identifier: AGPL-3.0-only
+ *
+ *  Contributors:
+ *   Stephane Carrez (Stephane.Carrez@twin.life)
+ */
+
+#import "StreamingParityIQ.h"
+
+#import <Twinlife/TLDecoder.h>
+#import <Twinlife/TLEncoder.h>
+
+/**
+ * A parity block for a group of StreamingDataIQ sent to a peer.
+ *
+ * Schema version 1
+ * <pre>
+ * {
+ *  "schemaId":"d3b6b4c1-5e8f-4c2a-9f0e-7a41c2e5b813",
+ *  "schemaVersion":"1",
+ *
+ *  "type":"record",
+ *  "name":"StreamingParityIQ",
+ *  "namespace":"org.twinlife.schemas.calls",
+ *  "super":"org.twinlife.schemas.BinaryPacketIQ"
+ *  "fields": [
+ *     {"name":"ident", "type":"long"},
+ *     {"name":"count", "type":"int"},
+ *     [{"name":"offset", "type":"long"},
+ *      {"name":"length", "type":"int"}],
+ *     {"name":"data", "type":"bytes"}
+ *  ]
+ * }
+ *
+ * </pre>
+ *
+ * The parity is sent after the data blocks it protects when both peers have the "stream-fec" capability,
+ * which is advertised only by the builds with STREAMING_PARITY (unreliable data channel).
+ * The data is the XOR of the blocks, each block being padded with zeros to the longest one.
+ *
+ * @see StreamingDataIQ
+ */
+
+//
+// Implementation: StreamingParityIQSerializer
+//
+
+@implementation StreamingParityIQSerializer
+
+- (nonnull instancetype)initWithSchema:(nonnull NSString *)schema schemaVersion:(int)schemaVersion {
+
+    return [super initWithSchema:schema schemaVersion:schemaVersion class:[StreamingParityIQ class]];
+}
+
+- (void)serializeWithSerializerFactory:(TLSerializerFactory *)serializerFactory encoder:(id<TLEncoder>)encoder object:(NSObject *)object {
+    
+    [super serializeWithSerializerFactory:serializerFactory encoder:encoder object:object];
+    
+    StreamingParityIQ *streamingParityIQ = (StreamingParityIQ *)object;
+    [encoder writeLong:streamingParityIQ.ident];
+    NSUInteger count = streamingParityIQ.offsets.count;
+    [encoder writeInt:(int)count];
+    for (NSUInteger i = 0; i < count; i++) {
+        [encoder writeLong:streamingParityIQ.offsets[i].longLongValue];
+        [encoder writeInt:streamingParityIQ.lengths[i].intValue];
+    }
+    [encoder writeDataWithData:streamingParityIQ.data start:0 length:(int32_t)streamingParityIQ.data.length];
+}
+
+- (NSObject *)deserializeWithSerializerFactory:(TLSerializerFactory *)serializerFactory decoder:(id<TLDecoder>)decoder {
+
+    TLBinaryPacketIQ *iq = (TLBinaryPacketIQ *)[super deserializeWithSerializerFactory:serializerFactory decoder:decoder];
+    
+    int64_t ident = [decoder readLong];
+    int count = [decoder readInt];
+    if (count < 0 || count > 256) {
+        @throw [NSException exceptionWithName:@"TLDecoderException" reason:nil userInfo:nil];
+    }
+    NSMutableArray<NSNumber *> *offsets = [[NSMutableArray alloc] initWithCapacity:count];
+    NSMutableArray<NSNumber *> *lengths = [[NSMutableArray alloc] initWithCapacity:count];
+    for (int i = 0; i < count; i++) {
+        [offsets addObject:[NSNumber numberWithLongLong:[decoder readLong]]];
+        [lengths addObject:[NSNumber numberWithInt:[decoder readInt]]];
+    }
+    NSData *data = [decoder readData];
+
+    return [[StreamingParityIQ alloc] initWithSerializer:self requestId:iq.requestId ident:ident offsets:offsets lengths:lengths data:data];
+}
+
+@end
+
+//
+// Implementation: StreamingParityIQ
+//
+
+@implementation StreamingParityIQ
+
+- (nonnull instancetype)initWithSerializer:(nonnull TLBinaryPacketIQSerializer *)serializer requestId:(int64_t)requestId ident:(int64_t)ident offsets:(nonnull NSArray<NSNumber *> *)offsets lengths:(nonnull NSArray<NSNumber *> *)lengths data:(nonnull NSData *)data {
+
+    self = [super initWithSerializer:serializer requestId:requestId];
+    
+    if (self) {
+        _ident = ident;
+        _offsets = offsets;
+        _lengths = lengths;
+        _data = data;
+    }
+    return self;
+}
+
+- (nonnull NSData *)recoverBlockAtIndex:(NSUInteger)index blocks:(nonnull NSArray<NSData *> *)blocks {
+
+    NSUInteger length = MIN((NSUInteger)self.lengths[index].intValue, self.data.length);
+    NSMutableData *result = [[NSMutableData alloc] initWithBytes:self.data.bytes length:length];
+    uint8_t *dst = result.mutableBytes;
+    for (NSData *block in blocks) {
+        const uint8_t *src = block.bytes;
+        NSUInteger count = MIN(length, block.length);
+        for (NSUInteger i = 0; i < count; i++) {
+            dst[i] ^= src[i];
+        }
+    }
+    return result;
+}
+
+@end
@@ -0,0 +1,99 @@
+/*
+ *  Copyright (c) 2023 twinlife SA.
+ *  SPDX-License-Identifier: AGPL-3.0-only
+ *
+ *  Contributors:
+ *   Stephane Carrez (Stephane.Carrez@twin.life)
+ */
+
+#import <Foundation/Foundation.h>
+
+@class TLBinaryPacketIQ;
+
+typedef enum {
+    StreamingRecordKindControl,
+    StreamingRecordKindRequest,
+    StreamingRecordKindData
+} StreamingRecordKind;
+
+//
+// Interface: StreamingRecord
+//
+
+/// A streaming IQ that was sent or received during the session (the data block content is not recorded).
+@interface StreamingRecord : NSObject
+
+/// Monotonic time (us) since the recorder was created.
+@property (readonly) int64_t time;
+@property (readonly) BOOL received;
+@property (readonly) StreamingRecordKind kind;
+@property (readonly, nullable) NSUUID *peerConnectionId;
+@property (readonly) int64_t ident;
+/// The control mode, the request offset or the data block offset.
+@property (readonly) int64_t offset;
+/// The control length, the request length or the data block length.
+@property (readonly) int64_t length;
+/// The player position (request), the streamer position (data) or the control position.
+@property (readonly) int64_t position;
+@property (readonly) int64_t timestamp;
+
+@end
+
+//
+// Interface: StreamingReplayReport
+//
+
+/// The result of replaying a recorded session.
+@interface StreamingReplayReport : NSObject
+
+@property (readonly) int64_t messageCount;
+@property (readonly) int64_t requestCount;
+@property (readonly) int64_t dataCount;
+@property (readonly) int64_t bytes;
+/// Duration (ms) between the first and the last record.
+@property (readonly) int64_t duration;
+/// Data throughput in bytes per second.
+@property (readonly) int64_t throughput;
+/// Number of received data blocks kept by the player reorder buffer until they are parsed.
+@property (readonly) int64_t allocationCount;
+/// Received data blocks that the player drops: duplicates, already parsed or requested before a seek.
+@property (readonly) int64_t droppedCount;
+/// Highest number of received data blocks waiting in the player reorder buffer for a missing block.
+@property (readonly) int64_t maxPendingBlocks;
+/// Highest number of requested bytes not yet answered.
+@property (readonly) int64_t maxInFlight;
+/// Requests that never got their data.
+@property (readonly) int64_t unansweredCount;
+
+/// Get the request-to-data latency (ms) below which we have the given percentage of the requests.
+- (int64_t)latencyPercentile:(int)percentile;
+
+@end
+
+//
+// Interface: StreamingRecorder
+//
+
+/// Record the streaming IQs exchanged for a session so that it can be replayed and measured outside of a call.
+@interface StreamingRecorder : NSObject
+
+- (nonnull instancetype)init;
+
+/// Record a StreamingControlIQ, StreamingRequestIQ or StreamingDataIQ sent to or received from the peer.
+- (void)recordWithIQ:(nonnull TLBinaryPacketIQ *)iq peerConnectionId:(nullable NSUUID *)peerConnectionId received:(BOOL)received;
+
+- (nonnull NSArray<StreamingRecord *> *)records;
+
+/// Save the recording in the file and return NO if it cannot be written.
+- (BOOL)writeToFile:(nonnull NSString *)path;
+
+/// Load a recording that was saved with writeToFile.
++ (nullable StreamingRecorder *)recorderWithContentsOfFile:(nonnull NSString *)path;
+
+/// Replay the recorded messages in order and compute the throughput and latency figures.
+/// The received data blocks are given to the player StreamingReorderBuffer, in the order and within
+/// the limits of the requests that were sent.
+/// The replay does not depend on the wall clock: the same recording always gives the same report.
+- (nonnull StreamingReplayReport *)replay;
+
+@end
@@ -0,0 +1,477 @@
+/*
+ *  Copyright (c) 2023 twinlife SA.
+ *  SPDX-License-Identifier: AGPL-3.0-only
+ *
+ *  Contributors:
+ *   Stephane Carrez (Stephane.Carrez@twin.life)
+ */
+
+#import <CocoaLumberjack.h>
+#include <time.h>
+
+#import "StreamingRecorder.h"
+#import "StreamingControlIQ.h"
+#import "StreamingRequestIQ.h"
+#import "StreamingDataIQ.h"
+#import "StreamingReorderBuffer.h"
+
+#if 0
+static const int ddLogLevel = DDLogLevelVerbose;
+#else
+static const int ddLogLevel = DDLogLevelWarning;
+#endif
+
+#define STREAMING_RECORD_MAGIC       0x52535754 // "TWSR"
+#define STREAMING_RECORD_VERSION     1
+
+/**
+ * Layout of a record in the file, the file starts with the magic and version numbers.
+ */
+typedef struct StreamingRecordEntry {
+    int64_t time;
+    int64_t ident;
+    int64_t offset;
+    int64_t length;
+    int64_t position;
+    int64_t timestamp;
+    uint8_t received;
+    uint8_t kind;
+    uint8_t hasPeer;
+    uint8_t reserved[5];
+    uuid_t peerConnectionId;
+} StreamingRecordEntry_t;
+
+//
+// Interface: StreamingRecord
+//
+
+@interface StreamingRecord ()
+
+- (nonnull instancetype)initWithEntry:(nonnull const StreamingRecordEntry_t *)entry;
+
+- (void)entryWithBuffer:(nonnull StreamingRecordEntry_t *)entry;
+
+@end
+
+//
+// Interface: StreamingReplayReport
+//
+
+@interface StreamingReplayReport ()
+
+@property int64_t messageCount;
+@property int64_t requestCount;
+@property int64_t dataCount;
+@property int64_t bytes;
+@property int64_t duration;
+@property int64_t throughput;
+@property int64_t allocationCount;
+@property int64_t droppedCount;
+@property int64_t maxPendingBlocks;
+@property int64_t maxInFlight;
+@property int64_t unansweredCount;
+@property (nonatomic, nonnull) NSArray<NSNumber *> *latencies;
+
+@end
+
+//
+// Interface: StreamingReplayRequest
+//
+
+/// A request waiting for its data blocks during the replay.
+@interface StreamingReplayRequest : NSObject
+
+@property (readonly, nonnull) StreamingRecord *record;
+@property int64_t remaining;
+
+- (nonnull instancetype)initWithRecord:(nonnull StreamingRecord *)record;
+
+@end
+
+//
+// Interface: StreamingReplayStream
+//
+
+/// The player side of a stream during the replay.
+@interface StreamingReplayStream : NSObject
+
+@property (readonly, nonnull) StreamingReorderBuffer *buffer;
+/// The end of the last request sent: the player streamReadOffset.
+@property int64_t limit;
+
+- (nonnull instancetype)init;
+
+@end
+
+//
+// Interface: StreamingRecorder
+//
+
+@interface StreamingRecorder ()
+
+@property (readonly) uint64_t startTime;
+@property (nonatomic, readonly, nonnull) NSMutableArray<StreamingRecord *> *recordList;
+
+- (nonnull instancetype)initWithRecords:(nonnull NSMutableArray<StreamingRecord *> *)records;
+
+/// Get the player side of the stream for the replay of the record.
+- (nonnull StreamingReplayStream *)replayStreamWithRecord:(nonnull StreamingRecord *)record streams:(nonnull NSMutableDictionary<NSString *, StreamingReplayStream *> *)streams;
+
+/// Give the received data block to the player reorder buffer and parse what is now in order.
+- (void)replayDataWithRecord:(nonnull StreamingRecord *)record stream:(nonnull StreamingReplayStream *)stream report:(nonnull StreamingReplayReport *)report;
+
+@end
+
+//
+// Implementation: StreamingRecord
+//
+
+#undef LOG_TAG
+#define LOG_TAG @"StreamingRecord"
+
+@implementation StreamingRecord
+
+- (nonnull instancetype)initWithEntry:(nonnull const StreamingRecordEntry_t *)entry {
+
+    self = [super init];
+    if (self) {
+        _time = entry->time;
+        _received = entry->received != 0;
+        _kind = (StreamingRecordKind)entry->kind;
+        _peerConnectionId = entry->hasPeer ? [[NSUUID alloc] initWithUUIDBytes:entry->peerConnectionId] : nil;
+        _ident = entry->ident;
+        _offset = entry->offset;
+        _length = entry->length;
+        _position = entry->position;
+        _timestamp = entry->timestamp;
+    }
+    return self;
+}
+
+- (void)entryWithBuffer:(nonnull StreamingRecordEntry_t *)entry {
+
+    memset(entry, 0, sizeof(StreamingRecordEntry_t));
+    entry->time = self.time;
+    entry->received = self.received ? 1 : 0;
+    entry->kind = (uint8_t)self.kind;
+    entry->ident = self.ident;
+    entry->offset = self.offset;
+    entry->length = self.length;
+    entry->position = self.position;
+    entry->timestamp = self.timestamp;
+    if (self.peerConnectionId) {
+        entry->hasPeer = 1;
+        [self.peerConnectionId getUUIDBytes:entry->peerConnectionId];
+    }
+}
+
+@end
+
+//
+// Implementation: StreamingReplayReport
+//
+
+#undef LOG_TAG
+#define LOG_TAG @"StreamingReplayReport"
+
+@implementation StreamingReplayReport
+
+- (int64_t)latencyPercentile:(int)percentile {
+
+    if (self.latencies.count == 0) {
+        return 0;
+    }
+
+    NSUInteger index = (self.latencies.count * percentile + 99) / 100;
+    index = MAX(1, MIN(index, self.latencies.count));
+    return self.latencies[index - 1].longLongValue;
+}
+
+- (nonnull NSString *)description {
+
+    return [NSString stringWithFormat:@"messages: %lld requests: %lld data: %lld bytes: %lld duration: %lld ms throughput: %lld B/s allocations: %lld dropped: %lld pending: %lld in-flight: %lld unanswered: %lld latency p50: %lld p95: %lld", self.messageCount, self.requestCount, self.dataCount, self.bytes, self.duration, self.throughput, self.allocationCount, self.droppedCount, self.maxPendingBlocks, self.maxInFlight, self.unansweredCount, [self latencyPercentile:50], [self latencyPercentile:95]];
+}
+
+@end
+
+//
+// Implementation: StreamingReplayRequest
+//
+
+#undef LOG_TAG
+#define LOG_TAG @"StreamingReplayRequest"
+
+@implementation StreamingReplayRequest
+
+- (nonnull instancetype)initWithRecord:(nonnull StreamingRecord *)record {
+
+    self = [super init];
+    if (self) {
+        _record = record;
+        _remaining = record.length;
+    }
+    return self;
+}
+
+@end
+
+//
+// Implementation: StreamingReplayStream
+//
+
+#undef LOG_TAG
+#define LOG_TAG @"StreamingReplayStream"
+
+@implementation StreamingReplayStream
+
+- (nonnull instancetype)init {
+
+    self = [super init];
+    if (self) {
+        _buffer = [[StreamingReorderBuffer alloc] init];
+        _limit = 0;
+    }
+    return self;
+}
+
+@end
+
+//
+// Implementation: StreamingRecorder
+//
+
+#undef LOG_TAG
+#define LOG_TAG @"StreamingRecorder"
+
+@implementation StreamingRecorder
+
+- (nonnull instancetype)init {
+    DDLogVerbose(@"%@ init", LOG_TAG);
+
+    return [self initWithRecords:[[NSMutableArray alloc] init]];
+}
+
+- (nonnull instancetype)initWithRecords:(nonnull NSMutableArray<StreamingRecord *> *)records {
+
+    self = [super init];
+    if (self) {
+        _startTime = clock_gettime_nsec_np(CLOCK_UPTIME_RAW);
+        _recordList = records;
+    }
+    return self;
+}
+
+- (void)recordWithIQ:(nonnull TLBinaryPacketIQ *)iq peerConnectionId:(nullable NSUUID *)peerConnectionId received:(BOOL)received {
+    DDLogVerbose(@"%@ recordWithIQ: %@ received: %d", LOG_TAG, iq, received);
+
+    StreamingRecordEntry_t entry;
+
+    memset(&entry, 0, sizeof(entry));
+    if ([iq isKindOfClass:[StreamingDataIQ class]]) {
+        StreamingDataIQ *dataIQ = (StreamingDataIQ *)iq;
+        entry.kind = StreamingRecordKindData;
+        entry.ident = dataIQ.ident;
+        entry.offset = dataIQ.offset;
+        entry.length = dataIQ.data ? dataIQ.length : 0;
+        entry.position = dataIQ.streamerPosition;
+        entry.timestamp = dataIQ.timestamp;
+    } else if ([iq isKindOfClass:[StreamingRequestIQ class]]) {
+        StreamingRequestIQ *requestIQ = (StreamingRequestIQ *)iq;
+        entry.kind = StreamingRecordKindRequest;
+        entry.ident = requestIQ.ident;
+        entry.offset = requestIQ.offset;
+        entry.length = requestIQ.length;
+        entry.position = requestIQ.playerPosition;
+        entry.timestamp = requestIQ.timestamp;
+    } else if ([iq isKindOfClass:[StreamingControlIQ class]]) {
+        StreamingControlIQ *controlIQ = (StreamingControlIQ *)iq;
+        entry.kind = StreamingRecordKindControl;
+        entry.ident = controlIQ.ident;
+        entry.offset = controlIQ.mode;
+        entry.length = controlIQ.length;
+        entry.position = controlIQ.position;
+        entry.timestamp = controlIQ.timestamp;
+    } else {
+        return;
+    }
+    entry.received = received ? 1 : 0;
+    if (peerConnectionId) {
+        entry.hasPeer = 1;
+        [peerConnectionId getUUIDBytes:entry.peerConnectionId];
+    }
+
+    StreamingRecord *record;
+    @synchronized (self) {
+        entry.time = (int64_t)(clock_gettime_nsec_np(CLOCK_UPTIME_RAW) - self.startTime) / 1000;
+        record = [[StreamingRecord alloc] initWithEntry:&entry];
+        [self.recordList addObject:record];
+    }
+}
+
+- (nonnull NSArray<StreamingRecord *> *)records {
+
+    @synchronized (self) {
+        return [self.recordList copy];
+    }
+}
+
+- (BOOL)writeToFile:(nonnull NSString *)path {
+    DDLogVerbose(@"%@ writeToFile: %@", LOG_TAG, path);
+
+    NSArray<StreamingRecord *> *records = [self records];
+    NSMutableData *content = [[NSMutableData alloc] initWithCapacity:2 * sizeof(int32_t) + records.count * sizeof(StreamingRecordEntry_t)];
+    int32_t header[2] = { STREAMING_RECORD_MAGIC, STREAMING_RECORD_VERSION };
+    [content appendBytes:header length:sizeof(header)];
+
+    StreamingRecordEntry_t entry;
+    for (StreamingRecord *record in records) {
+        [record entryWithBuffer:&entry];
+        [content appendBytes:&entry length:sizeof(entry)];
+    }
+
+    NSError *error;
+    if (![content writeToFile:path options:NSDataWritingAtomic error:&error]) {
+        DDLogError(@"%@ cannot write %@: %@", LOG_TAG, path, error);
+        return NO;
+    }
+    return YES;
+}
+
++ (nullable StreamingRecorder *)recorderWithContentsOfFile:(nonnull NSString *)path {
+    DDLogVerbose(@"%@ recorderWithContentsOfFile: %@", LOG_TAG, path);
+
+    NSData *content = [NSData dataWithContentsOfFile:path];
+    int32_t header[2];
+    if (!content || content.length < sizeof(header)) {
+        return nil;
+    }
+    [content getBytes:header length:sizeof(header)];
+    if (header[0] != STREAMING_RECORD_MAGIC || header[1] != STREAMING_RECORD_VERSION) {
+        DDLogError(@"%@ %@ is not a streaming recording", LOG_TAG, path);
+        return nil;
+    }
+
+    NSUInteger count = (content.length - sizeof(header)) / sizeof(StreamingRecordEntry_t);
+    NSMutableArray<StreamingRecord *> *records = [[NSMutableArray alloc] initWithCapacity:count];
+    const StreamingRecordEntry_t *entries = (const StreamingRecordEntry_t *)((const char *)content.bytes + sizeof(header));
+    for (NSUInteger i = 0; i < count; i++) {
+        [records addObject:[[StreamingRecord alloc] initWithEntry:&entries[i]]];
+    }
+    return [[StreamingRecorder alloc] initWithRecords:records];
+}
+
+- (nonnull StreamingReplayReport *)replay {
+    DDLogVerbose(@"%@ replay", LOG_TAG);
+
+    NSArray<StreamingRecord *> *records = [[self records] sortedArrayUsingComparator:^NSComparisonResult(StreamingRecord *r1, StreamingRecord *r2) {
+        return r1.time < r2.time ? NSOrderedAscending : (r1.time > r2.time ? NSOrderedDescending : NSOrderedSame);
+    }];
+
+    StreamingReplayReport *report = [[StreamingReplayReport alloc] init];
+    NSMutableArray<StreamingReplayRequest *> *pending = [[NSMutableArray alloc] init];
+    NSMutableArray<NSNumber *> *latencies = [[NSMutableArray alloc] init];
+    NSMutableDictionary<NSString *, StreamingReplayStream *> *streams = [[NSMutableDictionary alloc] init];
+    int64_t inFlight = 0;
+    for (StreamingRecord *record in records) {
+        report.messageCount++;
+        switch (record.kind) {
+            case StreamingRecordKindRequest:
+                report.requestCount++;
+                [pending addObject:[[StreamingReplayRequest alloc] initWithRecord:record]];
+                inFlight += record.length;
+                report.maxInFlight = MAX(report.maxInFlight, inFlight);
+
+                // The player requests from its streamReadOffset, a request elsewhere is sent after a seek.
+                if (!record.received) {
+                    StreamingReplayStream *stream = [self replayStreamWithRecord:record streams:streams];
+                    if (record.offset != stream.limit) {
+                        [stream.buffer resetWithOffset:record.offset];
+                    }
+                    stream.limit = record.offset + record.length;
+                }
+                break;
+
+            case StreamingRecordKindData: {
+                report.dataCount++;
+                report.bytes += record.length;
+                if (record.received) {
+                    [self replayDataWithRecord:record stream:[self replayStreamWithRecord:record streams:streams] report:report];
+                }
+
+                // A data block answers the requests of the same stream that were sent in the other direction,
+                // a coalesced request is answered by several blocks and it completes with the last one.
+                int64_t end = record.offset + record.length;
+                for (NSUInteger i = 0; i < pending.count; ) {
+                    StreamingReplayRequest *request = pending[i];
+                    StreamingRecord *requestRecord = request.record;
+                    int64_t requestEnd = requestRecord.offset + requestRecord.length;
+                    BOOL samePeer = (requestRecord.peerConnectionId == record.peerConnectionId) || [requestRecord.peerConnectionId isEqual:record.peerConnectionId];
+                    if (!samePeer || requestRecord.ident != record.ident || requestRecord.received == record.received
+                        || record.offset >= requestEnd || end <= requestRecord.offset) {
+                        i++;
+                        continue;
+                    }
+
+                    int64_t overlap = MIN(end, requestEnd) - MAX(record.offset, requestRecord.offset);
+                    request.remaining -= overlap;
+                    inFlight -= overlap;
+                    if (request.remaining > 0 && record.length > 0) {
+                        i++;
+                        continue;
+                    }
+
+                    // The request is completed, or the streamer reached the end of the stream.
+                    inFlight -= MAX(request.remaining, 0);
+                    [latencies addObject:[NSNumber numberWithLongLong:(record.time - requestRecord.time) / 1000]];
+                    [pending removeObjectAtIndex:i];
+                }
+                break;
+            }
+
+            case StreamingRecordKindControl:
+                break;
+        }
+    }
+
+    if (records.count > 1) {
+        report.duration = (records.lastObject.time - records.firstObject.time) / 1000;
+    }
+    report.throughput = report.duration > 0 ? (report.bytes * 1000) / report.duration : 0;
+    report.unansweredCount = pending.count;
+    report.latencies = [latencies sortedArrayUsingSelector:@selector(compare:)];
+    return report;
+}
+
+- (nonnull StreamingReplayStream *)replayStreamWithRecord:(nonnull StreamingRecord *)record streams:(nonnull NSMutableDictionary<NSString *, StreamingReplayStream *> *)streams {
+
+    NSString *key = [NSString stringWithFormat:@"%@/%lld", record.peerConnectionId ? record.peerConnectionId.UUIDString : @"", record.ident];
+    StreamingReplayStream *stream = streams[key];
+    if (!stream) {
+        stream = [[StreamingReplayStream alloc] init];
+        streams[key] = stream;
+    }
+    return stream;
+}
+
+- (void)replayDataWithRecord:(nonnull StreamingRecord *)record stream:(nonnull StreamingReplayStream *)stream report:(nonnull StreamingReplayReport *)report {
+
+    // The content is not recorded: the block is allocated with its size as the player would receive it.
+    NSData *data = [[NSMutableData alloc] initWithLength:(NSUInteger)record.length];
+    if (![stream.buffer addWithData:data offset:record.offset limit:stream.limit]) {
+        report.droppedCount++;
+        return;
+    }
+    if (record.length > 0) {
+        report.allocationCount++;
+    }
+
+    // The player parses the blocks as soon as they are in order, the others wait for the missing block.
+    int64_t offset;
+    NSData *block;
+    do {
+        block = [stream.buffer popWithOffset:&offset];
+    } while (block);
+    report.maxPendingBlocks = MAX(report.maxPendingBlocks, (int64_t)stream.buffer.count);
+}
+
+@end
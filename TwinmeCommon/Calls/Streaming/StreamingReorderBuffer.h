@@ -0,0 +1,45 @@
+/*
+ *  Copyright (c) 2023 twinlife SA.
+ *  SPDX-License-Identifier: AGPL-3.0-only
+ *
+ *  Contributors:
+ *   Stephane Carrez (Stephane.Carrez@twin.life)
+ */
+
+#import <Foundation/Foundation.h>
+
+//
+// Interface: StreamingReorderBuffer
+//
+
+/// Give back in order the data blocks of a stream that are received out of order, possibly more
+/// than once and overlapping what was already consumed when they were requested before a seek.
+/// The buffer is not thread safe: it is used from the player processQueue.
+@interface StreamingReorderBuffer : NSObject
+
+/// The offset of the next byte that we expect.
+@property (readonly) int64_t readOffset;
+
+/// The number of blocks waiting for a missing part.
+@property (readonly) NSUInteger count;
+
+- (nonnull instancetype)init;
+
+/// Forget the pending blocks and expect the next byte at the given offset.
+- (void)resetWithOffset:(int64_t)offset;
+
+/// Keep the block until it can be given back in order, return NO when it is dropped because it was
+/// already consumed or because it starts at or after the limit (it was requested before a seek).
+- (BOOL)addWithData:(nonnull NSData *)data offset:(int64_t)offset limit:(int64_t)limit;
+
+/// Get and remove the pending block which contains the readOffset and drop the blocks before it.
+/// The block is returned as received: it starts before the readOffset when it overlaps what was
+/// already consumed.  The readOffset is moved at the end of the block.
+- (nullable NSData *)popWithOffset:(nonnull int64_t *)offset;
+
+#if defined(DEBUG)
+/// Check the reordering, the duplicates, the overlaps and the gaps on a fixed scenario (called by the test tools).
++ (BOOL)check;
+#endif
+
+@end
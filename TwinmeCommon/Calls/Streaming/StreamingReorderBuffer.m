@@ -0,0 +1,167 @@
+/*
+ *  Copyright (c) 2023 twinlife SA.
+ *  SPDX-License-Identifier: AGPL-3.0-only
+ *
+ *  Contributors:
+ *   Stephane Carrez (Stephane.Carrez@twin.life)
+ */
+
+#import "StreamingReorderBuffer.h"
+
+//
+// Interface: StreamingReorderBuffer
+//
+
+@interface StreamingReorderBuffer ()
+
+@property int64_t readOffset;
+@property (nonatomic, readonly, nonnull) NSMutableDictionary<NSNumber *, NSData *> *blocks;
+
+@end
+
+//
+// Implementation: StreamingReorderBuffer
+//
+
+#undef LOG_TAG
+#define LOG_TAG @"StreamingReorderBuffer"
+
+@implementation StreamingReorderBuffer
+
+- (nonnull instancetype)init {
+
+    self = [super init];
+    if (self) {
+        _readOffset = 0;
+        _blocks = [[NSMutableDictionary alloc] init];
+    }
+    return self;
+}
+
+- (NSUInteger)count {
+
+    return self.blocks.count;
+}
+
+- (void)resetWithOffset:(int64_t)offset {
+
+    [self.blocks removeAllObjects];
+    self.readOffset = offset;
+}
+
+- (BOOL)addWithData:(nonnull NSData *)data offset:(int64_t)offset limit:(int64_t)limit {
+
+    if (offset + (int64_t)data.length < self.readOffset || offset >= limit) {
+        return NO;
+    }
+
+    // A duplicate replaces the block that we already have at the same offset.
+    self.blocks[[NSNumber numberWithLongLong:offset]] = data;
+    return YES;
+}
+
+- (nullable NSData *)popWithOffset:(nonnull int64_t *)offset {
+
+    int64_t readOffset = self.readOffset;
+    NSNumber *found = nil;
+    NSMutableArray<NSNumber *> *oldBlocks = nil;
+    for (NSNumber *key in self.blocks) {
+        int64_t start = key.longLongValue;
+        int64_t end = start + (int64_t)self.blocks[key].length;
+
+        // An empty block at the readOffset tells the end of the stream.
+        if (start <= readOffset && (readOffset < end || start == end)) {
+            found = key;
+        } else if (end <= readOffset) {
+            if (!oldBlocks) {
+                oldBlocks = [[NSMutableArray alloc] init];
+            }
+            [oldBlocks addObject:key];
+        }
+    }
+    if (oldBlocks) {
+        [self.blocks removeObjectsForKeys:oldBlocks];
+    }
+    if (!found) {
+        return nil;
+    }
+
+    NSData *data = self.blocks[found];
+    [self.blocks removeObjectForKey:found];
+    *offset = found.longLongValue;
+    self.readOffset = *offset + (int64_t)data.length;
+    return data;
+}
+
+#if defined(DEBUG)
++ (BOOL)check {
+
+    char bytes[40];
+    for (size_t i = 0; i < sizeof(bytes); i++) {
+        bytes[i] = (char)i;
+    }
+    NSData *content = [NSData dataWithBytes:bytes length:sizeof(bytes)];
+    NSData *(^block)(NSUInteger, NSUInteger) = ^(NSUInteger start, NSUInteger length) {
+        return [content subdataWithRange:NSMakeRange(start, length)];
+    };
+
+    // Collect what is given back in order and remove the overlap with what was already consumed.
+    StreamingReorderBuffer *buffer = [[StreamingReorderBuffer alloc] init];
+    NSMutableData *result = [[NSMutableData alloc] init];
+    void (^drain)(void) = ^{
+        int64_t offset;
+        NSData *data;
+        while ((data = [buffer popWithOffset:&offset])) {
+            int64_t skip = (int64_t)result.length - offset;
+            if (skip < 0 || skip > (int64_t)data.length) {
+                [result setLength:0];
+                return;
+            }
+            [result appendBytes:(const char *)data.bytes + skip length:data.length - (NSUInteger)skip];
+        }
+    };
+
+    // Blocks received out of order are kept until the gap before them is filled.
+    [buffer addWithData:block(10, 10) offset:10 limit:40];
+    [buffer addWithData:block(20, 10) offset:20 limit:40];
+    drain();
+    if (result.length != 0 || buffer.count != 2 || buffer.readOffset != 0) {
+        return NO;
+    }
+    [buffer addWithData:block(0, 10) offset:0 limit:40];
+    drain();
+    if (result.length != 30 || buffer.count != 0 || buffer.readOffset != 30) {
+        return NO;
+    }
+
+    // A duplicate of a consumed block is dropped, a duplicate of a pending block replaces it.
+    if ([buffer addWithData:block(10, 10) offset:10 limit:40]) {
+        return NO;
+    }
+    [buffer addWithData:block(35, 5) offset:35 limit:40];
+    [buffer addWithData:block(35, 5) offset:35 limit:40];
+    if (buffer.count != 1) {
+        return NO;
+    }
+
+    // A block overlapping the consumed part only gives back its new bytes, a block after the limit is dropped.
+    if ([buffer addWithData:block(0, 0) offset:40 limit:40]) {
+        return NO;
+    }
+    [buffer addWithData:block(25, 10) offset:25 limit:40];
+    drain();
+    if (result.length != 40 || buffer.count != 0 || memcmp(result.bytes, bytes, sizeof(bytes)) != 0) {
+        return NO;
+    }
+
+    // After a seek, the blocks before the new offset are not used and the first one can overlap it.
+    [buffer resetWithOffset:32];
+    [result setLength:32];
+    [buffer addWithData:block(20, 10) offset:20 limit:40];
+    [buffer addWithData:block(30, 10) offset:30 limit:40];
+    drain();
+    return result.length == 40 && buffer.count == 0 && memcmp(result.bytes, bytes, sizeof(bytes)) == 0;
+}
+#endif
+
+@end
@@ -0,0 +1,64 @@
+/*
+ *  Copyright (c) 2023 twinlife SA.
+ *  SPDX-License-Identifier: AGPL-3.0-only
+ *
+ *  Contributors:
+ *   Stephane Carrez (Stephane.Carrez@twin.life)
+ */
+
+#import <Foundation/Foundation.h>
+
+//
+// Interface: StreamingPeerStats
+//
+
+/// Streaming metrics for a peer: on the streamer side they describe what we served to the peer,
+/// on the player side they describe what we received from the streamer.
+@interface StreamingPeerStats : NSObject
+
+/// The peer connection or nil for the local player.
+@property (readonly, nullable) NSUUID *peerConnectionId;
+@property (readonly) int64_t bytes;
+@property (readonly) int64_t requestCount;
+@property (readonly) int64_t underrunCount;
+@property (readonly) int64_t queueDepth;
+@property (readonly) int64_t drift;
+
+- (nonnull instancetype)initWithPeerConnectionId:(nullable NSUUID *)peerConnectionId;
+
+/// Record a data block of the given size that was obtained with the request-to-data latency (ms).
+- (void)recordWithBytes:(int64_t)bytes latency:(int64_t)latency;
+
+/// Record a data request (a request is answered by one or several data blocks).
+- (void)recordRequest;
+
+/// Record an underrun: the audio queue had no more packets to play.
+- (void)recordUnderrun;
+
+/// Update the queue depth (bytes waiting to be played or requests waiting to be served) and
+/// the drift (ms) between the player position and the streamer position.
+- (void)updateWithQueueDepth:(int64_t)queueDepth drift:(int64_t)drift;
+
+/// Get the latency (ms) below which we have the given percentage of the requests (0 if there is no sample).
+- (int64_t)latencyPercentile:(int)percentile;
+
+@end
+
+//
+// Interface: StreamingStats
+//
+
+/// Streaming metrics for a stream, the local player (if any) is described by the peer with a nil peerConnectionId.
+@interface StreamingStats : NSObject
+
+@property (readonly) int64_t ident;
+
+- (nonnull instancetype)initWithIdent:(int64_t)ident;
+
+/// Get the metrics of the peer, create them if necessary.
+- (nonnull StreamingPeerStats *)peerStatsWithId:(nullable NSUUID *)peerConnectionId;
+
+/// Get the metrics of each peer.
+- (nonnull NSArray<StreamingPeerStats *> *)peers;
+
+@end
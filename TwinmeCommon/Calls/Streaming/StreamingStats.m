@@ -0,0 +1,179 @@
+/*
+ *  Copyright (c) 2023 twinlife SA.
+ *  SPDX-License-Identifier: AGPL-3.0-only
+ *
+ *  Contributors:
+ *   Stephane Carrez (Stephane.Carrez@twin.life)
+ */
+
+#import "StreamingStats.h"
+
+// Upper bound (ms) of the latency histogram buckets, the last bucket holds what is above.
+static const int64_t latencyBuckets[] = { 10, 20, 50, 100, 200, 300, 500, 750, 1000, 2000, 5000 };
+
+#define LATENCY_BUCKET_COUNT (sizeof(latencyBuckets) / sizeof(latencyBuckets[0]) + 1)
+
+//
+// Interface: StreamingPeerStats
+//
+
+@interface StreamingPeerStats ()
+
+@property int64_t bytes;
+@property int64_t requestCount;
+@property int64_t underrunCount;
+@property int64_t queueDepth;
+@property int64_t drift;
+
+@end
+
+//
+// Interface: StreamingStats
+//
+
+@interface StreamingStats ()
+
+@property (nonatomic, readonly, nonnull) NSMutableDictionary<NSUUID *, StreamingPeerStats *> *peerStats;
+@property (nullable) StreamingPeerStats *localStats;
+
+@end
+
+//
+// Implementation: StreamingPeerStats
+//
+
+#undef LOG_TAG
+#define LOG_TAG @"StreamingPeerStats"
+
+@implementation StreamingPeerStats {
+    int64_t _latencyHistogram[LATENCY_BUCKET_COUNT];
+}
+
+- (nonnull instancetype)initWithPeerConnectionId:(nullable NSUUID *)peerConnectionId {
+
+    self = [super init];
+    if (self) {
+        _peerConnectionId = peerConnectionId;
+        _bytes = 0;
+        _requestCount = 0;
+        _underrunCount = 0;
+        _queueDepth = 0;
+        _drift = 0;
+        memset(_latencyHistogram, 0, sizeof(_latencyHistogram));
+    }
+    return self;
+}
+
+- (void)recordWithBytes:(int64_t)bytes latency:(int64_t)latency {
+
+    @synchronized (self) {
+        self.bytes += bytes;
+        if (latency >= 0) {
+            int bucket = 0;
+            while (bucket < LATENCY_BUCKET_COUNT - 1 && latency > latencyBuckets[bucket]) {
+                bucket++;
+            }
+            _latencyHistogram[bucket]++;
+        }
+    }
+}
+
+- (void)recordRequest {
+
+    @synchronized (self) {
+        self.requestCount++;
+    }
+}
+
+- (void)recordUnderrun {
+
+    @synchronized (self) {
+        self.underrunCount++;
+    }
+}
+
+- (void)updateWithQueueDepth:(int64_t)queueDepth drift:(int64_t)drift {
+
+    @synchronized (self) {
+        self.queueDepth = queueDepth;
+        self.drift = drift;
+    }
+}
+
+- (int64_t)latencyPercentile:(int)percentile {
+
+    @synchronized (self) {
+        int64_t total = 0;
+        for (int i = 0; i < LATENCY_BUCKET_COUNT; i++) {
+            total += _latencyHistogram[i];
+        }
+        if (total == 0) {
+            return 0;
+        }
+
+        int64_t limit = (total * percentile + 99) / 100;
+        int64_t count = 0;
+        for (int i = 0; i < LATENCY_BUCKET_COUNT - 1; i++) {
+            count += _latencyHistogram[i];
+            if (count >= limit) {
+                return latencyBuckets[i];
+            }
+        }
+        return latencyBuckets[LATENCY_BUCKET_COUNT - 2];
+    }
+}
+
+- (nonnull NSString *)description {
+
+    return [NSString stringWithFormat:@"StreamingPeerStats[%@ bytes=%lld requests=%lld underruns=%lld queue=%lld drift=%lld p50=%lld p95=%lld]", self.peerConnectionId, self.bytes, self.requestCount, self.underrunCount, self.queueDepth, self.drift, [self latencyPercentile:50], [self latencyPercentile:95]];
+}
+
+@end
+
+//
+// Implementation: StreamingStats
+//
+
+#undef LOG_TAG
+#define LOG_TAG @"StreamingStats"
+
+@implementation StreamingStats
+
+- (nonnull instancetype)initWithIdent:(int64_t)ident {
+
+    self = [super init];
+    if (self) {
+        _ident = ident;
+        _peerStats = [[NSMutableDictionary alloc] init];
+    }
+    return self;
+}
+
+- (nonnull StreamingPeerStats *)peerStatsWithId:(nullable NSUUID *)peerConnectionId {
+
+    @synchronized (self) {
+        StreamingPeerStats *stats = peerConnectionId ? self.peerStats[peerConnectionId] : self.localStats;
+        if (!stats) {
+            stats = [[StreamingPeerStats alloc] initWithPeerConnectionId:peerConnectionId];
+            if (peerConnectionId) {
+                self.peerStats[peerConnectionId] = stats;
+            } else {
+                self.localStats = stats;
+            }
+        }
+        return stats;
+    }
+}
+
+- (nonnull NSArray<StreamingPeerStats *> *)peers {
+
+    @synchronized (self) {
+        NSMutableArray<StreamingPeerStats *> *result = [[NSMutableArray alloc] initWithArray:self.peerStats.allValues];
+        if (self.localStats) {
+            [result addObject:self.localStats];
+        }
+        return result;
+    }
+}
+
+@end